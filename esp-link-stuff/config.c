@@ -45,7 +45,16 @@ FlashConfig flashDefault = {
   .sscp_events          = 0,
   .dbg_enable           = 0,
   .sscp_loader          = 0,
-  .p2_ddloader_enable   = 0
+  .p2_ddloader_enable   = 0,
+  .dns_cache_size       = 0,
+  .dns_cache_ttl        = 0,
+  .ws_console_latency   = 0,
+  .ws_console_batch     = 0,
+  .uart_rx_full         = 0,
+  .uart_rx_timeout      = 0,
+  .fast_loader_baud_rate = 0,
+  .image_cache_size     = 0,
+  .p2_baud_escalation   = 0
 };
 
 typedef union {
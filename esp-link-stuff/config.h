@@ -28,6 +28,15 @@ typedef struct {
   int8_t   dbg_enable;
   int8_t   sscp_loader;
   int8_t   p2_ddloader_enable;
+  int32_t  dns_cache_size;
+  int32_t  dns_cache_ttl;
+  int32_t  ws_console_latency;
+  int32_t  ws_console_batch;
+  int32_t  uart_rx_full;
+  int32_t  uart_rx_timeout;
+  int32_t  fast_loader_baud_rate;
+  int32_t  image_cache_size;
+  int8_t   p2_baud_escalation;
 } FlashConfig;
 
 extern FlashConfig flashConfig;
@@ -7,6 +7,7 @@
 #include "config.h"
 #include "sscp.h"
 #include "gpio-helpers.h"
+#include "wsbridge.h"
 
 //#define SERBR_DBG
 
@@ -19,6 +20,302 @@ void (*programmingCB)(char *buffer, short length) = NULL;
 // Connection pool
 serbridgeConnData connData[MAX_CONN];
 
+static void serbridgeFlushConn(serbridgeConnData *conn);
+static void serbridgePurgeConn(serbridgeConnData *conn);
+
+//===== Telnet / RFC 2217
+
+// A connection whose first byte is IAC is treated as a telnet client and may use the RFC 2217
+// COM-PORT-OPTION to change the UART settings and pulse the reset line. Anything else is bridged
+// transparently as before.
+
+#define IAC   255
+#define DONT  254
+#define DO    253
+#define WONT  252
+#define WILL  251
+#define SB    250
+#define SE    240
+
+#define TELOPT_BINARY   0
+#define TELOPT_SGA      3
+#define TELOPT_COMPORT  44
+
+// COM-PORT-OPTION commands, the server replies with the command + 100
+#define CPO_SIGNATURE           0
+#define CPO_SET_BAUDRATE        1
+#define CPO_SET_DATASIZE        2
+#define CPO_SET_PARITY          3
+#define CPO_SET_STOPSIZE        4
+#define CPO_SET_CONTROL         5
+#define CPO_SET_LINESTATE_MASK  10
+#define CPO_SET_MODEMSTATE_MASK 11
+#define CPO_PURGE_DATA          12
+#define CPO_SERVER_OFFSET       100
+
+// SET-CONTROL values
+#define CTL_FLOW_REQUEST  0
+#define CTL_FLOW_NONE     1
+#define CTL_BREAK_REQUEST 4
+#define CTL_BREAK_OFF     6
+#define CTL_DTR_REQUEST   7
+#define CTL_DTR_ON        8
+#define CTL_DTR_OFF       9
+#define CTL_RTS_REQUEST   10
+#define CTL_RTS_ON        11
+#define CTL_RTS_OFF       12
+
+#define PURGE_RX 1
+
+// serbridgeConnData.lines bits
+#define LINE_DTR 0x01
+#define LINE_RTS 0x02
+
+enum telnetStates {
+  tnData = 0,       // passing data through
+  tnIac,            // got IAC
+  tnOption,         // got WILL/WONT/DO/DONT, option follows
+  tnSbOption,       // got IAC SB, option follows
+  tnSbData,         // in a subnegotiation
+  tnSbIac,          // got IAC in a subnegotiation
+};
+
+static void ICACHE_FLASH_ATTR
+serbridgeResetMcu(void)
+{
+  if (mcu_reset_pin >= 0) {
+    os_delay_us(100L);
+    GPIO_OUTPUT_SET(mcu_reset_pin, 0);
+    os_delay_us(100L);
+    GPIO_OUTPUT_SET(mcu_reset_pin, 1);
+  }
+}
+
+// add a byte to a telnet reply, doubling IAC
+static short ICACHE_FLASH_ATTR
+telnetPut(uint8_t *buf, short len, uint8_t c)
+{
+  buf[len++] = c;
+  if (c == IAC) buf[len++] = IAC;
+  return len;
+}
+
+// replies that find espconn out of write buffers wait in the connection and go out from the
+// sent callback, ahead of any more output
+static void ICACHE_FLASH_ATTR
+telnetSend(serbridgeConnData *conn, uint8_t *buf, short len)
+{
+  if (conn->reply_len + len > SERBR_REPLY_MAX) {
+    os_printf("serbridge: telnet reply dropped on conn %p\n", conn);
+    return;
+  }
+  os_memcpy(conn->reply + conn->reply_len, buf, len);
+  conn->reply_len += len;
+  serbridgeFlushConn(conn);
+}
+
+static void ICACHE_FLASH_ATTR
+telnetNegotiate(serbridgeConnData *conn, uint8_t cmd, uint8_t opt)
+{
+  uint8_t reply[3] = { IAC, 0, opt };
+  bool supported = opt == TELOPT_BINARY || opt == TELOPT_SGA || opt == TELOPT_COMPORT;
+  switch (cmd) {
+  case DO:   reply[1] = supported ? WILL : WONT; break;
+  case WILL: reply[1] = supported ? DO : DONT;   break;
+  default:   return; // nothing is ever enabled that a WONT/DONT could turn off
+  }
+  telnetSend(conn, reply, sizeof(reply));
+}
+
+// answer a COM-PORT-OPTION command with the value now in effect
+static void ICACHE_FLASH_ATTR
+comPortReply(serbridgeConnData *conn, uint8_t cmd, uint8_t *value, short valueLen)
+{
+  uint8_t reply[32]; // room for the signature
+  short len = 0;
+  reply[len++] = IAC;
+  reply[len++] = SB;
+  reply[len++] = TELOPT_COMPORT;
+  len = telnetPut(reply, len, cmd + CPO_SERVER_OFFSET);
+  for (short i=0; i<valueLen; i++)
+    len = telnetPut(reply, len, value[i]);
+  reply[len++] = IAC;
+  reply[len++] = SE;
+  telnetSend(conn, reply, len);
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+comPortControl(serbridgeConnData *conn, uint8_t value)
+{
+  switch (value) {
+  case CTL_DTR_ON:
+  case CTL_RTS_ON:
+    // like a Prop Plug, asserting either line pulses reset
+    if (!conn->lines) serbridgeResetMcu();
+    conn->lines |= value == CTL_DTR_ON ? LINE_DTR : LINE_RTS;
+    return value;
+  case CTL_DTR_OFF:
+    conn->lines &= ~LINE_DTR;
+    return value;
+  case CTL_RTS_OFF:
+    conn->lines &= ~LINE_RTS;
+    return value;
+  case CTL_DTR_REQUEST:
+    return conn->lines & LINE_DTR ? CTL_DTR_ON : CTL_DTR_OFF;
+  case CTL_RTS_REQUEST:
+    return conn->lines & LINE_RTS ? CTL_RTS_ON : CTL_RTS_OFF;
+  case CTL_BREAK_REQUEST:
+    return CTL_BREAK_OFF;
+  default:
+    // break and flow control aren't supported
+    return value < CTL_BREAK_REQUEST ? CTL_FLOW_NONE : CTL_BREAK_OFF;
+  }
+}
+
+static void ICACHE_FLASH_ATTR
+comPortCommand(serbridgeConnData *conn)
+{
+  uint8_t cmd = conn->sb_buf[0];
+  uint8_t *value = conn->sb_buf + 1;
+  short valueLen = conn->sb_len - 1;
+  uint8_t result[4];
+
+  if (conn->sb_len == 0) return;
+
+  switch (cmd) {
+  case CPO_SIGNATURE:
+    comPortReply(conn, cmd, (uint8_t *)"Parallax-ESP", 12);
+    break;
+  case CPO_SET_BAUDRATE:
+    if (valueLen == 4) {
+      int baud = (value[0] << 24) | (value[1] << 16) | (value[2] << 8) | value[3];
+      if (baud > 0) {
+        flashConfig.baud_rate = baud;
+        uart_drain_tx_buffer(UART0);
+        uart0_config(flashConfig.baud_rate, flashConfig.stop_bits);
+      }
+    }
+    result[0] = flashConfig.baud_rate >> 24;
+    result[1] = flashConfig.baud_rate >> 16;
+    result[2] = flashConfig.baud_rate >> 8;
+    result[3] = flashConfig.baud_rate;
+    comPortReply(conn, cmd, result, 4);
+    break;
+  case CPO_SET_DATASIZE:
+    result[0] = 8; // the only size supported
+    comPortReply(conn, cmd, result, 1);
+    break;
+  case CPO_SET_PARITY:
+    result[0] = 1; // NONE, the only parity supported
+    comPortReply(conn, cmd, result, 1);
+    break;
+  case CPO_SET_STOPSIZE:
+    // RFC 2217 uses 1, 2, 3 for 1, 2, 1.5 stop bits, the UART uses 1, 3, 2
+    if (valueLen == 1 && value[0] >= 1 && value[0] <= 3) {
+      flashConfig.stop_bits = value[0] == 1 ? 1 : value[0] == 2 ? 3 : 2;
+      uart_drain_tx_buffer(UART0);
+      uart0_config(flashConfig.baud_rate, flashConfig.stop_bits);
+    }
+    result[0] = flashConfig.stop_bits == 1 ? 1 : flashConfig.stop_bits == 3 ? 2 : 3;
+    comPortReply(conn, cmd, result, 1);
+    break;
+  case CPO_SET_CONTROL:
+    if (valueLen == 1) {
+      result[0] = comPortControl(conn, value[0]);
+      comPortReply(conn, cmd, result, 1);
+    }
+    break;
+  case CPO_PURGE_DATA:
+    // only output not yet sent to this client can be dropped, the UART transmits as it goes
+    if (valueLen == 1 && (value[0] & PURGE_RX))
+      serbridgePurgeConn(conn);
+    comPortReply(conn, cmd, value, valueLen);
+    break;
+  case CPO_SET_LINESTATE_MASK:
+  case CPO_SET_MODEMSTATE_MASK:
+  default:
+    // no notifications are ever sent, just acknowledge
+    if (cmd < CPO_SERVER_OFFSET)
+      comPortReply(conn, cmd, value, valueLen);
+    break;
+  }
+}
+
+// pass data through to the UART in runs between IACs and act on the telnet commands
+static void ICACHE_FLASH_ATTR
+telnetRecv(serbridgeConnData *conn, char *data, unsigned short len)
+{
+  char *end = data + len;
+
+  while (data < end) {
+    uint8_t c;
+
+    if (conn->telnet_state == tnData) {
+      char *iac = memchr(data, IAC, end - data);
+      if (!iac) {
+        uart_tx_buffer(UART0, data, end - data);
+        return;
+      }
+      if (iac > data)
+        uart_tx_buffer(UART0, data, iac - data);
+      conn->telnet_state = tnIac;
+      data = iac + 1;
+      continue;
+    }
+
+    c = *data++;
+    switch (conn->telnet_state) {
+    case tnIac:
+      switch (c) {
+      case IAC:
+        uart_tx_buffer(UART0, (char *)&c, 1);
+        conn->telnet_state = tnData;
+        break;
+      case WILL: case WONT: case DO: case DONT:
+        conn->telnet_cmd = c;
+        conn->telnet_state = tnOption;
+        break;
+      case SB:
+        conn->telnet_state = tnSbOption;
+        break;
+      default:
+        // NOP, GA and the like
+        conn->telnet_state = tnData;
+        break;
+      }
+      break;
+    case tnOption:
+      telnetNegotiate(conn, conn->telnet_cmd, c);
+      conn->telnet_state = tnData;
+      break;
+    case tnSbOption:
+      conn->telnet_cmd = c;
+      conn->sb_len = 0;
+      conn->telnet_state = tnSbData;
+      break;
+    case tnSbData:
+      if (c == IAC)
+        conn->telnet_state = tnSbIac;
+      else if (conn->sb_len < sizeof(conn->sb_buf))
+        conn->sb_buf[conn->sb_len++] = c;
+      break;
+    case tnSbIac:
+      if (c == SE) {
+        if (conn->telnet_cmd == TELOPT_COMPORT)
+          comPortCommand(conn);
+        conn->telnet_state = tnData;
+      }
+      else {
+        // an escaped IAC in the value
+        if (conn->sb_len < sizeof(conn->sb_buf))
+          conn->sb_buf[conn->sb_len++] = c;
+        conn->telnet_state = tnSbData;
+      }
+      break;
+    }
+  }
+}
+
 //===== TCP -> UART
 
 // Receive callback
@@ -27,88 +324,132 @@ serbridgeRecvCb(void *arg, char *data, unsigned short len)
 {
   serbridgeConnData *conn = ((struct espconn*)arg)->reverse;
   //os_printf("Receive callback on conn %p\n", conn);
-  if (conn == NULL) return;
-  uart_tx_buffer(UART0, data, len);
+  if (conn == NULL || len == 0) return;
+  if (conn->conn_mode == cmInit)
+    conn->conn_mode = (uint8_t)data[0] == IAC ? cmTelnet : cmTransparent;
+  if (conn->conn_mode == cmTelnet)
+    telnetRecv(conn, data, len);
+  else
+    uart_tx_buffer(UART0, data, len);
 }
 
 //===== UART -> TCP
 
-// Send all data in conn->txbuffer
-// returns result from espconn_sent if data in buffer or ESPCONN_OK (0)
-// Use only internally from espbuffsend and serbridgeSentCb
-static sint8 ICACHE_FLASH_ATTR
-sendtxbuffer(serbridgeConnData *conn)
+// UART output is written once into a ring shared by all connections. Each connection has its own
+// cursor into the ring and espconn copies what it is given (ESPCONN_COPY), so several segments can
+// be in flight per connection while the ring keeps filling.
+static char txRing[SERBR_RING_SIZE];
+static uint32_t txHead;               // total bytes ever written to the ring
+static ETSTimer flushTimer;
+static bool flushArmed;
+// UART-to-TCP turnaround, from the UART receiving data to the first of it being handed to espconn
+int serbridgeLatencyLast;
+int serbridgeLatencyAvg;
+int serbridgeLatencyMax;
+static bool latencyPending;
+static uint32_t latencyStamp;
+// telnet clients get a copy with IAC doubled, espconn copies it so one buffer does for all
+static char txEscaped[SERBR_SEGMENT];
+
+// copy ring data for a telnet client doubling each IAC, returns the bytes used from src
+static uint32_t ICACHE_FLASH_ATTR
+serbridgeEscape(char *src, uint32_t len, uint32_t *outLen)
 {
-  sint8 result = ESPCONN_OK;
-  if (conn->txbufferlen != 0) {
-    //os_printf("TX %p %d\n", conn, conn->txbufferlen);
-    conn->readytosend = false;
-    result = espconn_sent(conn->conn, (uint8_t*)conn->txbuffer, conn->txbufferlen);
-    conn->txbufferlen = 0;
+  uint32_t in = 0, out = 0;
+  // leave room to double the last byte copied
+  while (in < len && out < SERBR_SEGMENT - 1) {
+    uint32_t cnt = len - in;
+    if (cnt > SERBR_SEGMENT - 1 - out) cnt = SERBR_SEGMENT - 1 - out;
+    char *iac = memchr(src + in, IAC, cnt);
+    if (iac) cnt = iac - (src + in) + 1;
+    os_memcpy(txEscaped + out, src + in, cnt);
+    in += cnt;
+    out += cnt;
+    if (iac) txEscaped[out++] = IAC;
+  }
+  *outLen = out;
+  return in;
+}
+
+// drop the output this connection hasn't been sent yet
+static void ICACHE_FLASH_ATTR
+serbridgePurgeConn(serbridgeConnData *conn)
+{
+  conn->cursor = txHead;
+}
+
+// hand everything the connection hasn't seen yet to espconn until it has no free write buffers
+static void ICACHE_FLASH_ATTR
+serbridgeFlushConn(serbridgeConnData *conn)
+{
+  if (conn->conn && conn->reply_len > 0) {
+    sint8 result = espconn_sent(conn->conn, conn->reply, conn->reply_len);
+    if (result == ESPCONN_MAXNUM) return; // the sent callback tries again
+    if (result != ESPCONN_OK)
+      os_printf("serbridge: telnet reply error %d on conn %p\n", result, conn);
+    conn->reply_len = 0;
+  }
+  while (conn->conn && conn->cursor != txHead) {
+    uint32_t offset = conn->cursor & (SERBR_RING_SIZE-1);
+    uint32_t len = txHead - conn->cursor;
+    char *data = txRing + offset;
+    uint32_t sendLen;
+    // don't wrap within one write
+    if (len > SERBR_RING_SIZE - offset) len = SERBR_RING_SIZE - offset;
+    if (len > SERBR_SEGMENT) len = SERBR_SEGMENT;
+    sendLen = len;
+    if (conn->conn_mode == cmTelnet) {
+      len = serbridgeEscape(data, len, &sendLen);
+      data = txEscaped;
+    }
+    sint8 result = espconn_sent(conn->conn, (uint8_t*)data, sendLen);
+    if (result == ESPCONN_MAXNUM) break; // serbridgeWriteFinishCb tries again
     if (result != ESPCONN_OK) {
-      os_printf("sendtxbuffer: espconn_sent error %d on conn %p\n", result, conn);
-      conn->txbufferlen = 0;
-      if (!conn->txoverflow_at) conn->txoverflow_at = system_get_time();
-    } else {
-      conn->sentbuffer = conn->txbuffer;
-      conn->txbuffer = NULL;
-      conn->txbufferlen = 0;
+      os_printf("serbridge: espconn_sent error %d on conn %p\n", result, conn);
+      break;
+    }
+    conn->cursor += len;
+    if (latencyPending) {
+      int latency = system_get_time() - latencyStamp;
+      serbridgeLatencyLast = latency;
+      serbridgeLatencyAvg = serbridgeLatencyAvg ? serbridgeLatencyAvg + (latency - serbridgeLatencyAvg) / 8 : latency;
+      if (latency > serbridgeLatencyMax) serbridgeLatencyMax = latency;
+      latencyPending = false;
     }
   }
-  return result;
 }
 
-// espbuffsend adds data to the send buffer. If the previous send was completed it calls
-// sendtxbuffer and espconn_sent.
-// Returns ESPCONN_OK (0) for success, -128 if buffer is full or error from  espconn_sent
-// Use espbuffsend instead of espconn_sent as it solves the problem that espconn_sent must
-// only be called *after* receiving an espconn_sent_callback for the previous packet.
-static sint8 ICACHE_FLASH_ATTR
-espbuffsend(serbridgeConnData *conn, const char *data, uint16 len)
+void ICACHE_FLASH_ATTR
+serbridgeLatencyReset(void)
 {
-  if (conn->txbufferlen >= MAX_TXBUFFER) goto overflow;
+  serbridgeLatencyLast = serbridgeLatencyAvg = serbridgeLatencyMax = 0;
+  latencyPending = false;
+}
 
-  // make sure we indeed have a buffer
-  if (conn->txbuffer == NULL) conn->txbuffer = os_zalloc(MAX_TXBUFFER);
-  if (conn->txbuffer == NULL) {
-    os_printf("espbuffsend: cannot alloc tx buffer\n");
-    return -128;
+static void ICACHE_FLASH_ATTR
+serbridgeFlush(void)
+{
+  os_timer_disarm(&flushTimer);
+  flushArmed = false;
+  for (short i=0; i<MAX_CONN; i++) {
+    if (connData[i].conn)
+      serbridgeFlushConn(&connData[i]);
   }
+}
 
-  // add to send buffer
-  uint16_t avail = conn->txbufferlen+len > MAX_TXBUFFER ? MAX_TXBUFFER-conn->txbufferlen : len;
-  os_memcpy(conn->txbuffer + conn->txbufferlen, data, avail);
-  conn->txbufferlen += avail;
-
-  // try to send
-  sint8 result = ESPCONN_OK;
-  if (conn->readytosend) result = sendtxbuffer(conn);
+static void ICACHE_FLASH_ATTR
+flushTimerCb(void *arg)
+{
+  serbridgeFlush();
+}
 
-  if (avail < len) {
-    // some data didn't fit into the buffer
-    if (conn->txbufferlen == 0) {
-      // we sent the prior buffer, so try again
-      return espbuffsend(conn, data+avail, len-avail);
-    }
-    goto overflow;
-  }
-  return result;
-
-overflow:
-  if (conn->txoverflow_at) {
-    // we've already been overflowing
-    if (system_get_time() - conn->txoverflow_at > 10*1000*1000) {
-      // no progress in 10 seconds, kill the connection
-      os_printf("serbridge: killing overlowing stuck conn %p\n", conn);
-      espconn_disconnect(conn->conn);
-    }
-    // else be silent, we already printed an error
-  } else {
-    // print 1-time message and take timestamp
-    os_printf("serbridge: txbuffer full, conn %p\n", conn);
-    conn->txoverflow_at = system_get_time();
-  }
-  return -128;
+// called when espconn has room for another write
+static void ICACHE_FLASH_ATTR
+serbridgeWriteFinishCb(void *arg)
+{
+  serbridgeConnData *conn = ((struct espconn*)arg)->reverse;
+  if (conn == NULL) return;
+  serbridgeFlushConn(conn);
 }
 
 //callback after the data are sent
@@ -116,24 +457,66 @@ static void ICACHE_FLASH_ATTR
 serbridgeSentCb(void *arg)
 {
   serbridgeConnData *conn = ((struct espconn*)arg)->reverse;
-  //os_printf("Sent CB %p\n", conn);
   if (conn == NULL) return;
-  //os_printf("%d ST\n", system_get_time());
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
-  conn->sentbuffer = NULL;
-  conn->readytosend = true;
-  conn->txoverflow_at = 0;
-  sendtxbuffer(conn); // send possible new data in txbuffer
+  serbridgeFlushConn(conn);
 }
 
 void ICACHE_FLASH_ATTR
 console_process(char *buf, short len)
 {
-  // push the buffer into each open connection
-  for (short i=0; i<MAX_CONN; i++) {
-    if (connData[i].conn)
-      espbuffsend(&connData[i], buf, len);
+  bool waiting = false;
+  short i;
+
+  // a connection that would have unsent data overwritten can't keep up, drop it
+  for (i=0; i<MAX_CONN; i++) {
+    if (connData[i].conn && txHead + len - connData[i].cursor > SERBR_RING_SIZE) {
+      os_printf("serbridge: dropping lagging conn %p\n", &connData[i]);
+      espconn_disconnect(connData[i].conn);
+      // skip it until the disconnect callback frees the slot
+      connData[i].cursor = txHead + len;
+    }
+  }
+
+  // time the first batch that arrives while nothing is waiting to go out
+  if (!latencyPending) {
+    for (i=0; i<MAX_CONN; i++) {
+      if (connData[i].conn && connData[i].cursor == txHead) {
+        latencyStamp = uart0_rx_stamp;
+        latencyPending = true;
+        break;
+      }
+    }
   }
+
+  // add the data to the ring once for all connections
+  for (short done=0; done<len; ) {
+    uint32_t offset = txHead & (SERBR_RING_SIZE-1);
+    short cnt = len-done > SERBR_RING_SIZE - offset ? SERBR_RING_SIZE - offset : len-done;
+    os_memcpy(txRing + offset, buf + done, cnt);
+    txHead += cnt;
+    done += cnt;
+  }
+
+  // send now if a connection has a full batch waiting, otherwise give the UART a moment to add more
+  for (i=0; i<MAX_CONN; i++) {
+    if (connData[i].conn && txHead != connData[i].cursor) {
+      waiting = true;
+      if (txHead - connData[i].cursor >= SERBR_FLUSH_SIZE) {
+        serbridgeFlush();
+        waiting = false;
+        break;
+      }
+    }
+  }
+  if (waiting && !flushArmed) {
+    os_timer_disarm(&flushTimer);
+    os_timer_setfn(&flushTimer, flushTimerCb, NULL);
+    os_timer_arm(&flushTimer, SERBR_FLUSH_TIME, 0);
+    flushArmed = true;
+  }
+
+  // and to the websocket viewers
+  wsbridgeUartData(buf, len);
 }
 
 // callback with a buffer of characters that have arrived on the uart
@@ -173,20 +556,12 @@ serbridgeDisconCb(void *arg)
 #ifdef SERBR_DBG
   os_printf("serbridge: disconnect\n");
 #endif
-  // Free buffers
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
-  conn->sentbuffer = NULL;
-  if (conn->txbuffer != NULL) os_free(conn->txbuffer);
-  conn->txbuffer = NULL;
-  conn->txbufferlen = 0;
   // Send reset to attached uC if it was in programming mode
-  if (conn->conn_mode == cmPGM && mcu_reset_pin >= 0) {
-    os_delay_us(100L);
-    GPIO_OUTPUT_SET(mcu_reset_pin, 0);
-    os_delay_us(100L);
-    GPIO_OUTPUT_SET(mcu_reset_pin, 1);
-  }
+  if (conn->conn_mode == cmPGM)
+    serbridgeResetMcu();
   conn->conn = NULL;
+  // don't let a batch that will never be sent skew the next sample
+  latencyPending = false;
 }
 
 // Connection reset callback (note that there will be no DisconCb)
@@ -221,15 +596,18 @@ serbridgeConnectCb(void *arg)
   os_memset(connData+i, 0, sizeof(struct serbridgeConnData));
   connData[i].conn = conn;
   conn->reverse = connData+i;
-  connData[i].readytosend = true;
   connData[i].conn_mode = cmInit;
+  // a new connection only gets output from now on
+  connData[i].cursor = txHead;
 
   espconn_regist_recvcb(conn, serbridgeRecvCb);
   espconn_regist_disconcb(conn, serbridgeDisconCb);
   espconn_regist_reconcb(conn, serbridgeResetCb);
   espconn_regist_sentcb(conn, serbridgeSentCb);
+  espconn_regist_write_finish(conn, serbridgeWriteFinishCb);
 
-  espconn_set_opt(conn, ESPCONN_REUSEADDR|ESPCONN_NODELAY);
+  espconn_set_opt(conn, ESPCONN_REUSEADDR|ESPCONN_NODELAY|ESPCONN_COPY);
+  espconn_tcp_set_buf_count(conn, SERBR_SEGMENTS);
 }
 
 //===== Initialization
@@ -8,8 +8,15 @@
 #define MAX_CONN 4
 #define SER_BRIDGE_TIMEOUT 300 // 300 seconds = 5 minutes
 
-// Send buffer size
-#define MAX_TXBUFFER (2*1460)
+// UART -> TCP ring shared by all connections, must be a power of 2
+#define SERBR_RING_SIZE 4096
+// Max bytes handed to espconn in one write
+#define SERBR_SEGMENT 1460
+// Writes a connection can have queued in lwIP at once
+#define SERBR_SEGMENTS 4
+// Send right away once this much is waiting, otherwise after SERBR_FLUSH_TIME ms
+#define SERBR_FLUSH_SIZE 512
+#define SERBR_FLUSH_TIME 2
 
 enum connModes {
   cmInit = 0,        // initialization mode: nothing received yet
@@ -19,15 +26,22 @@ enum connModes {
   cmTelnet,          // use telnet escape sequences for programming mode
 };
 
+// Longest RFC 2217 subnegotiation value we keep, longer ones are truncated
+#define SERBR_SB_MAX 4
+// Telnet replies held while espconn has no free write buffers
+#define SERBR_REPLY_MAX 64
+
 typedef struct serbridgeConnData {
 	struct espconn *conn;
 	enum connModes conn_mode;     // connection mode
   uint8_t        telnet_state;
-	uint16         txbufferlen;   // length of data in txbuffer
-	char           *txbuffer;     // buffer for the data to send
-  char           *sentbuffer;   // buffer sent, awaiting callback to get freed
-  uint32_t       txoverflow_at; // when the transmitter started to overflow
-	bool           readytosend;   // true, if txbuffer can be sent by espconn_sent
+  uint8_t        telnet_cmd;    // WILL/WONT/DO/DONT or subnegotiation option being parsed
+  uint8_t        sb_len;        // subnegotiation bytes received after the option
+  uint8_t        sb_buf[SERBR_SB_MAX+1]; // subnegotiation command followed by its value
+  uint8_t        lines;         // DTR/RTS state set by the client
+  uint8_t        reply_len;     // bytes waiting in reply
+  uint8_t        reply[SERBR_REPLY_MAX]; // telnet replies not yet accepted by espconn
+  uint32_t       cursor;        // ring position of the next byte to send to this connection
 } serbridgeConnData;
 
 // port1 is transparent&programming, second port is programming only
@@ -35,6 +49,12 @@ void ICACHE_FLASH_ATTR serbridgeInit(int port);
 void ICACHE_FLASH_ATTR serbridgeInitPins(void);
 void ICACHE_FLASH_ATTR serbridgeUartCb(char *buf, short len);
 
+// UART-to-TCP turnaround in usecs, the average is a moving average over about 8 samples
+extern int serbridgeLatencyLast;
+extern int serbridgeLatencyAvg;
+extern int serbridgeLatencyMax;
+void ICACHE_FLASH_ATTR serbridgeLatencyReset(void);
+
 // callback when receiving UART chars when in programming mode
 extern void (*programmingCB)(char *buffer, short length);
 
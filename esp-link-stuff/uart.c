@@ -24,6 +24,7 @@
 #include "config.h"
 
 #define DEF_STOP_BITS   ONE_STOP_BIT
+#define UART_TX_FIFO_LIMIT 100 // characters allowed in the 128 character TX FIFO
 //#define DEF_STOP_BITS   TWO_STOP_BITS
 
 #ifdef UART_DBG
@@ -36,6 +37,12 @@ static int uart0_baudRate = -1;
 static int uart0_stopBits = -1;
 static int uart1_baudRate = -1;
 static int uart1_stopBits = -1;
+static int uart0_rxFull = -1;
+static int uart0_rxTimeout = -1;
+static uint32 uart0_toutDelay;       // usecs the RX timeout waits after the last character
+
+// time the data being handed to the receive callbacks arrived, see uart.h
+uint32 uart0_rx_stamp;
 
 LOCAL uint8_t uart_recvTaskNum;
 
@@ -85,20 +92,12 @@ uart_config(uint8 uart_no)
   CLEAR_PERI_REG_MASK(UART_CONF0(uart_no), UART_RXFIFO_RST | UART_TXFIFO_RST);
 
   if (uart_no == UART0) {
-    // Configure RX interrupt conditions as follows: trigger rx-full when there are 80 characters
-    // in the buffer, trigger rx-timeout when the fifo is non-empty and nothing further has been
-    // received for 4 character periods.
-    // Set the hardware flow-control to trigger when the FIFO holds 100 characters, although
-    // we don't really expect the signals to actually be wired up to anything. It doesn't hurt
-    // to set the threshold here...
+    // Configure RX interrupt conditions from the uart-rx-full and uart-rx-timeout settings
+    // (80 characters and 4 character periods by default), see uart0_rx_thresholds().
     // We do not enable framing error interrupts 'cause they tend to cause an interrupt avalanche
     // and instead just poll for them when we get a std RX interrupt.
-    WRITE_PERI_REG(UART_CONF1(uart_no),
-                   ((80 & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
-                   ((100 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
-                   UART_RX_FLOW_EN |
-                   (4 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
-                   UART_RX_TOUT_EN);
+    uart0_rxFull = -1; // always write the thresholds
+    uart0_rx_thresholds(flashConfig.uart_rx_full, flashConfig.uart_rx_timeout);
     SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA | UART_BRK_DET_INT_RAW);
   } else {
     WRITE_PERI_REG(UART_CONF1(uart_no),
@@ -120,7 +119,7 @@ STATUS ICACHE_FLASH_ATTR
 uart_tx_one_char(uint8 uart, uint8 c)
 {
   //Wait until there is room in the FIFO
-  while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100) ;
+  while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=UART_TX_FIFO_LIMIT) ;
   //Send the character
   WRITE_PERI_REG(UART_FIFO(uart), c);
   return OK;
@@ -137,7 +136,7 @@ STATUS ICACHE_FLASH_ATTR
 uart_try_tx_one_char(uint8 uart, uint8 c)
 {
   //Check for room in the FIFO
-  if (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100)
+  if (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=UART_TX_FIFO_LIMIT)
     return FAIL;
   //Send the character
   WRITE_PERI_REG(UART_FIFO(uart), c);
@@ -158,6 +157,21 @@ uart_drain_tx_buffer(uint8 uart)
   return OK;
 }
 
+// number of characters waiting in the TX FIFO
+uint16_t ICACHE_FLASH_ATTR
+uart_tx_fifo_count(uint8 uart)
+{
+  return (READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT;
+}
+
+// number of characters that can be written to the TX FIFO without waiting
+uint16_t ICACHE_FLASH_ATTR
+uart_tx_fifo_room(uint8 uart)
+{
+  int count = uart_tx_fifo_count(uart);
+  return count < UART_TX_FIFO_LIMIT ? UART_TX_FIFO_LIMIT - count : 0;
+}
+
 /******************************************************************************
  * FunctionName : uart_tx_buffer
  * Description  : use uart to transfer buffer
@@ -169,11 +183,15 @@ uart_drain_tx_buffer(uint8 uart)
 void ICACHE_FLASH_ATTR
 uart_tx_buffer(uint8 uart, char *buf, uint16 len)
 {
-  uint16 i;
-
-  for (i = 0; i < len; i++)
-  {
-    uart_tx_one_char(uart, buf[i]);
+  // fill whatever room the FIFO has each time its count is read instead of polling before every character,
+  // callers that mustn't wait here write no more than uart_tx_fifo_room
+  while (len > 0) {
+    int room = UART_TX_FIFO_LIMIT - ((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT);
+    if (room <= 0) continue;
+    if (room > len) room = len;
+    len -= room;
+    while (--room >= 0)
+      WRITE_PERI_REG(UART_FIFO(uart), *buf++);
   }
 }
 
@@ -215,10 +233,13 @@ uart0_rx_intr_handler(void *para)
   if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_BRK_DET_INT_RAW)
     schedule = 1;
 
-  if (UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST)
-  ||  UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
-  {
-    //DBG_UART("stat:%02X",*(uint8 *)UART_INT_ENA(uart_no));
+  if (UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST)) {
+    uart0_rx_stamp = system_get_time();
+    schedule = 1;
+  }
+  else if (UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST)) {
+    // the last character arrived a timeout ago
+    uart0_rx_stamp = system_get_time() - uart0_toutDelay;
     schedule = 1;
   }
 
@@ -287,6 +308,7 @@ uart0_config(int baudRate, int stopBits) {
     if (baudRate != uart0_baudRate) {
         uart_div_modify(UART0, UART_CLK_FREQ / baudRate);
         uart0_baudRate = baudRate;
+        uart0_toutDelay = uart0_rxTimeout * 10000000 / baudRate;
     }
     if (stopBits != uart0_stopBits) {
         WRITE_PERI_REG(UART_CONF0(0),
@@ -296,6 +318,30 @@ uart0_config(int baudRate, int stopBits) {
    }
 }
 
+void ICACHE_FLASH_ATTR
+uart0_rx_thresholds(int rxFull, int rxTimeout) {
+  if (rxFull <= 0) rxFull = UART_RX_FULL_DEFAULT;
+  if (rxFull > UART_RX_FULL_MAX) rxFull = UART_RX_FULL_MAX;
+  if (rxTimeout <= 0) rxTimeout = UART_RX_TIMEOUT_DEFAULT;
+  if (rxTimeout > UART_RX_TOUT_THRHD) rxTimeout = UART_RX_TOUT_THRHD;
+  if (rxFull != uart0_rxFull || rxTimeout != uart0_rxTimeout) {
+    DBG_UART("UART: rx full %d, rx timeout %d\n", rxFull, rxTimeout);
+    // Set the hardware flow-control to trigger when the FIFO holds 100 characters, although
+    // we don't really expect the signals to actually be wired up to anything. It doesn't hurt
+    // to set the threshold here...
+    WRITE_PERI_REG(UART_CONF1(UART0),
+                   ((rxFull & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((100 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
+                   UART_RX_FLOW_EN |
+                   (rxTimeout & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
+                   UART_RX_TOUT_EN);
+    uart0_rxFull = rxFull;
+    uart0_rxTimeout = rxTimeout;
+    // a character is 10 bit periods with one stop bit
+    uart0_toutDelay = rxTimeout * 10000000 / (uart0_baudRate > 0 ? uart0_baudRate : UartDev.baud_rate);
+  }
+}
+
 void ICACHE_FLASH_ATTR
 uart1_config(int baudRate, int stopBits) {
   static char *stopBitNames[4] = { "(error)", "1", "1.5", "2" };
@@ -14,6 +14,8 @@ void uart_tx_buffer(uint8 uart, char *buf, uint16 len);
 STATUS uart_tx_one_char(uint8 uart, uint8 c);
 STATUS uart_try_tx_one_char(uint8 uart, uint8 c);
 STATUS uart_drain_tx_buffer(uint8 uart);
+uint16_t uart_tx_fifo_count(uint8 uart);
+uint16_t uart_tx_fifo_room(uint8 uart);
 
 // Add a receive callback function, this is called on the uart receive task each time a chunk
 // of bytes are received. A small number of callbacks can be added and they are all called
@@ -24,6 +26,16 @@ void uart_add_recv_cb(UartRecv_cb cb);
 uint16_t uart0_rx_poll(char *buff, uint16_t nchars, uint32_t timeout_us);
 
 void uart0_config(int baudRate, int stopBits);
+
+// RX interrupt thresholds: characters in the FIFO before an rx-full interrupt and idle character
+// periods before an rx-timeout interrupt, zero selects the default
+#define UART_RX_FULL_DEFAULT    80
+#define UART_RX_FULL_MAX        120
+#define UART_RX_TIMEOUT_DEFAULT 4
+void uart0_rx_thresholds(int rxFull, int rxTimeout);
+
+// system_get_time() when the data passed to the receive callbacks arrived, for latency measurement
+extern uint32 uart0_rx_stamp;
 void uart1_config(int baudRate, int stopBits);
 
 
@@ -0,0 +1,95 @@
+// Binary websocket bridge for UART0, the browser counterpart of the telnet serbridge
+
+#include "esp8266.h"
+
+#include "uart.h"
+#include "config.h"
+#include "wsbridge.h"
+
+static int viewers;                     // number of open bridge websockets
+static char batch[WSBRIDGE_BATCH_MAX];  // UART output waiting for the latency timer
+static short batchLen;
+static ETSTimer batchTimer;
+static bool batchTimerArmed;
+
+static int ICACHE_FLASH_ATTR
+batchLimit(void)
+{
+  int limit = flashConfig.ws_console_batch;
+  if (limit <= 0) return WSBRIDGE_BATCH;
+  return limit > WSBRIDGE_BATCH_MAX ? WSBRIDGE_BATCH_MAX : limit;
+}
+
+// send the batch to every viewer, cgiWebsockBroadcast encodes the frame once for all of them
+static void ICACHE_FLASH_ATTR
+wsbridgeFlush(void)
+{
+  os_timer_disarm(&batchTimer);
+  batchTimerArmed = false;
+  if (batchLen == 0) return;
+  cgiWebsockBroadcast(WSBRIDGE_URL, batch, batchLen, WEBSOCK_FLAG_BIN);
+  batchLen = 0;
+}
+
+static void ICACHE_FLASH_ATTR
+batchTimerCb(void *arg)
+{
+  wsbridgeFlush();
+}
+
+void ICACHE_FLASH_ATTR
+wsbridgeUartData(char *buf, short len)
+{
+  short limit, avail;
+
+  if (viewers == 0) return;
+
+  limit = batchLimit();
+  while (len > 0) {
+    if (batchLen >= limit) wsbridgeFlush();
+    avail = limit - batchLen;
+    if (avail > len) avail = len;
+    os_memcpy(batch + batchLen, buf, avail);
+    batchLen += avail;
+    buf += avail;
+    len -= avail;
+    if (batchLen >= limit) wsbridgeFlush();
+  }
+
+  // start the latency timer with the first byte of a batch
+  if (batchLen > 0 && !batchTimerArmed) {
+    int latency = flashConfig.ws_console_latency > 0 ? flashConfig.ws_console_latency : WSBRIDGE_LATENCY;
+    os_timer_disarm(&batchTimer);
+    os_timer_setfn(&batchTimer, batchTimerCb, NULL);
+    os_timer_arm(&batchTimer, latency, 0);
+    batchTimerArmed = true;
+  }
+}
+
+//===== Websocket callbacks
+
+static void ICACHE_FLASH_ATTR
+wsbridgeRecvCb(Websock *ws, char *data, int len, int flags)
+{
+  uart_tx_buffer(UART0, data, len);
+}
+
+static void ICACHE_FLASH_ATTR
+wsbridgeCloseCb(Websock *ws)
+{
+  if (viewers > 0 && --viewers == 0) {
+    os_timer_disarm(&batchTimer);
+    batchTimerArmed = false;
+    batchLen = 0;
+  }
+}
+
+void ICACHE_FLASH_ATTR
+wsbridgeConnect(Websock *ws)
+{
+  ws->recvCb = wsbridgeRecvCb;
+  ws->closeCb = wsbridgeCloseCb;
+  // a viewer that falls behind misses output rather than stalling the others
+  ws->queuePolicy = WEBSOCK_QUEUE_DROP;
+  ++viewers;
+}
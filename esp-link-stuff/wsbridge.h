@@ -0,0 +1,16 @@
+#ifndef __WS_BRIDGE_H__
+#define __WS_BRIDGE_H__
+
+#include "cgiwebsocket.h"
+
+#define WSBRIDGE_URL "/console/ws"
+#define WSBRIDGE_LATENCY 5      // default ms to hold UART output before sending it
+#define WSBRIDGE_BATCH 512      // default bytes that are sent right away
+#define WSBRIDGE_BATCH_MAX 1024
+
+// websocket connect handler for WSBRIDGE_URL
+void ICACHE_FLASH_ATTR wsbridgeConnect(Websock *ws);
+// queue UART output for the websocket viewers
+void ICACHE_FLASH_ATTR wsbridgeUartData(char *buf, short len);
+
+#endif /* __WS_BRIDGE_H__ */
@@ -107,3 +107,64 @@ int ICACHE_FLASH_ATTR base64_encode(size_t in_len, const unsigned char *in, size
 	return io;
 }
 
+static void ICACHE_FLASH_ATTR base64_group(const unsigned char *in, char *out) {
+	out[0]=base64enc_tab[in[0]>>2];
+	out[1]=base64enc_tab[((in[0]&3)<<4)|(in[1]>>4)];
+	out[2]=base64enc_tab[((in[1]&15)<<2)|(in[2]>>6)];
+	out[3]=base64enc_tab[in[2]&63];
+}
+
+void ICACHE_FLASH_ATTR base64_stream_init(Base64Stream *s) {
+	s->pendingCount=0;
+}
+
+/* encode as many whole groups as the pending and new bytes make up, returns the number of characters written */
+int ICACHE_FLASH_ATTR base64_stream_encode(Base64Stream *s, size_t in_len, const unsigned char *in, size_t out_len, char *out) {
+	unsigned char group[3];
+	size_t io=0;
+
+	if ((s->pendingCount+in_len)/3*4>out_len) return -1; /* truncation is failure */
+
+	/* complete the group left over from the last call */
+	if (s->pendingCount>0) {
+		if (s->pendingCount+in_len<3) {
+			while (in_len-->0) s->pending[s->pendingCount++]=*in++;
+			return 0;
+		}
+		group[0]=s->pending[0];
+		group[1]=s->pendingCount>1 ? s->pending[1] : *in++;
+		group[2]=*in++;
+		in_len-=3-s->pendingCount;
+		base64_group(group, out);
+		io+=4;
+	}
+
+	while (in_len>=3) {
+		base64_group(in, &out[io]);
+		in+=3;
+		in_len-=3;
+		io+=4;
+	}
+
+	for (s->pendingCount=0; s->pendingCount<in_len; s->pendingCount++)
+		s->pending[s->pendingCount]=in[s->pendingCount];
+
+	return io;
+}
+
+/* flush the pending bytes as a partial group, with '=' padding if pad is non-zero */
+int ICACHE_FLASH_ATTR base64_stream_finish(Base64Stream *s, int pad, size_t out_len, char *out) {
+	unsigned char group[3]={0, 0, 0};
+	int count=s->pendingCount;
+	int io;
+
+	if (count==0) return 0;
+	if (out_len<(pad ? 4 : count+1)) return -1; /* truncation is failure */
+
+	group[0]=s->pending[0];
+	if (count>1) group[1]=s->pending[1];
+	base64_group(group, out);
+	for (io=count+1; pad && io<4; io++) out[io]='=';
+	s->pendingCount=0;
+	return io;
+}
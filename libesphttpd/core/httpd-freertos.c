@@ -46,6 +46,10 @@ void httpdPlatDisableTimeout(ConnTypePtr conn) {
 	//Unimplemented for FreeRTOS
 }
 
+void httpdPlatHoldRecv(ConnTypePtr conn, int hold) {
+	//Unimplemented for FreeRTOS
+}
+
 
 #define RECV_BUF_SIZE 2048
 static void platHttpServerTask(void *pvParameters) {
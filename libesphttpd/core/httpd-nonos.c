@@ -62,6 +62,12 @@ void ICACHE_FLASH_ATTR httpdPlatDisableTimeout(ConnTypePtr conn) {
 	espconn_regist_time(conn, 7199, 1);
 }
 
+//Stop or restart delivery of received data; the TCP window closes while it is held.
+void ICACHE_FLASH_ATTR httpdPlatHoldRecv(ConnTypePtr conn, int hold) {
+	if (hold) espconn_recv_hold(conn);
+	else espconn_recv_unhold(conn);
+}
+
 //Initialize listening socket, do general initialization
 void ICACHE_FLASH_ATTR httpdPlatInit(int port, int maxConnCt) {
 	httpdConn.type=ESPCONN_TCP;
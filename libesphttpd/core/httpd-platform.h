@@ -4,6 +4,7 @@
 int httpdPlatSendData(ConnTypePtr conn, const char *buff, int len);
 void httpdPlatDisconnect(ConnTypePtr conn);
 void httpdPlatDisableTimeout(ConnTypePtr conn);
+void httpdPlatHoldRecv(ConnTypePtr conn, int hold);
 void httpdPlatInit(int port, int maxConnCt);
 
 #endif
\ No newline at end of file
@@ -434,6 +434,11 @@ int ICACHE_FLASH_ATTR httpdUnbufferedSend(HttpdConnData *conn, const char *data,
 	return 1;
 }
 
+//Stop delivering POST data to the cgi until it is released again, so the client is made to wait.
+void ICACHE_FLASH_ATTR httpdHoldRecv(HttpdConnData *conn, int hold) {
+	if (conn->conn) httpdPlatHoldRecv(conn->conn, hold);
+}
+
 void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdConnData *conn) {
 	conn->cgi=NULL; //no need to call this anymore
 	if (conn->priv->flags&HFL_CHUNKED) {
@@ -712,11 +717,12 @@ void ICACHE_FLASH_ATTR httpdRecvCb(ConnTypePtr rconn, char *remIp, int remPort,
 					if (r==HTTPD_CGI_DONE) {
 						httpdCgiIsDone(conn);
 					}
-				} else {
+				} else if (conn->post->received==conn->post->buffLen) {
 					//No CGI fn set yet: probably first call. Allow httpdProcessRequest to choose CGI and
 					//call it the first time.
 					httpdProcessRequest(conn);
 				}
+				//Otherwise the cgi finished before the whole body arrived; drop the rest.
 				conn->post->buffLen = 0;
 			}
 		} else {
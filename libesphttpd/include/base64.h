@@ -0,0 +1,17 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+int base64_decode(size_t in_len, const char *in, size_t out_len, unsigned char *out);
+int base64_encode(size_t in_len, const unsigned char *in, size_t out_len, char *out);
+
+//Streaming encoder. Input can be fed in pieces of any size; the 0-2 bytes that don't make up a
+//whole group are kept until the next call, so no padding is produced until base64_stream_finish.
+typedef struct {
+	unsigned char pending[2];
+	int pendingCount;
+} Base64Stream;
+
+void base64_stream_init(Base64Stream *s);
+int base64_stream_encode(Base64Stream *s, size_t in_len, const unsigned char *in, size_t out_len, char *out);
+int base64_stream_finish(Base64Stream *s, int pad, size_t out_len, char *out);
+#endif
\ No newline at end of file
@@ -7,6 +7,14 @@
 #define WEBSOCK_FLAG_CONT (1<<0) //Set if the data is not the final data in the message; more follows
 #define WEBSOCK_FLAG_BIN (1<<1) //Set if the data is binary instead of text
 
+//What to do when a websocket can't keep up with broadcasts
+#define WEBSOCK_QUEUE_DROP 0 //Drop the oldest queued frame (default)
+#define WEBSOCK_QUEUE_CLOSE 1 //Close the websocket
+
+//Returned by cgiWebsocketSend when the socket can't take the frame right now. The frame isn't sent;
+//writableCb is called once the socket has drained.
+#define WEBSOCK_WOULDBLOCK (-1)
+
 
 
 typedef struct Websock Websock;
@@ -16,6 +24,7 @@ typedef void(*WsConnectedCb)(Websock *ws);
 typedef void(*WsRecvCb)(Websock *ws, char *data, int len, int flags);
 typedef void(*WsSentCb)(Websock *ws);
 typedef void(*WsCloseCb)(Websock *ws);
+typedef void(*WsWritableCb)(Websock *ws);
 
 struct Websock {
 	void *userData;
@@ -24,11 +33,15 @@ struct Websock {
 	WsRecvCb recvCb;
 	WsSentCb sentCb;
 	WsCloseCb closeCb;
+	WsWritableCb writableCb;
+	uint8_t queuePolicy; //WEBSOCK_QUEUE_DROP or WEBSOCK_QUEUE_CLOSE
 	WebsockPriv *priv;
 };
 
 int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData);
 int ICACHE_FLASH_ATTR cgiWebsocketSend(Websock *ws, char *data, int len, int flags);
+int ICACHE_FLASH_ATTR cgiWebsocketSendCredit(Websock *ws);
+void ICACHE_FLASH_ATTR cgiWebsocketWantWritable(Websock *ws);
 void ICACHE_FLASH_ATTR cgiWebsocketClose(Websock *ws, int reason);
 int ICACHE_FLASH_ATTR cgiWebSocketRecv(HttpdConnData *connData, char *data, int len);
 int ICACHE_FLASH_ATTR cgiWebsockBroadcast(char *resource, char *data, int len, int flags);
@@ -81,6 +81,7 @@ int httpdSend(HttpdConnData *conn, const char *data, int len);
 int httpdUnbufferedSend(HttpdConnData *conn, const char *data, int len);
 void httpdSetSendBuffer(HttpdConnData *conn, char *buff, short max);
 void httpdFlushSendBuffer(HttpdConnData *conn);
+void httpdHoldRecv(HttpdConnData *conn, int hold);
 void httpdCgiIsDone(HttpdConnData *conn);
 
 //Platform dependent code should call these.
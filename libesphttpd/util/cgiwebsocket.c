@@ -14,6 +14,7 @@ Websocket support for esphttpd. Inspired by https://github.com/dangrie158/ESP-82
 
 #include <esp8266.h>
 #include "httpd.h"
+#include "httpd-platform.h"
 #include "sha1.h"
 #include "base64.h"
 #include "cgiwebsocket.h"
@@ -68,6 +69,17 @@ typedef struct WebsockFrame WebsockFrame;
 #define ST_MASK4 13
 #define ST_PAYLOAD 14
 
+//Max number of broadcast frames waiting for one websocket before its slow consumer policy kicks in
+#define WEBSOCK_QUEUE_MAX 8
+//Max bytes queued on a websocket before cgiWebsocketSend reports WEBSOCK_WOULDBLOCK. Control frames
+//are queued regardless.
+#define WEBSOCK_BACKLOG_LIMIT (2*1024)
+//Largest frame header we send
+#define WEBSOCK_HEAD_MAX 10
+//Seconds between pings, and the number of unanswered pings after which a peer is considered dead
+#define WEBSOCK_PING_INTERVAL 15
+#define WEBSOCK_PING_MISSES 2
+
 struct WebsockFrame {
 	uint8_t flags;
 	uint8_t len8;
@@ -75,19 +87,41 @@ struct WebsockFrame {
 	uint8_t mask[4];
 };
 
+//A broadcast frame, encoded once and shared by the queues of all websockets it goes to.
+typedef struct WebsockBuf WebsockBuf;
+struct WebsockBuf {
+	int refs;
+	int len;
+	char data[];
+};
+
+typedef struct WebsockQueueItem WebsockQueueItem;
+struct WebsockQueueItem {
+	WebsockBuf *buf;
+	WebsockQueueItem *next;
+};
+
 struct WebsockPriv {
 	struct WebsockFrame fr;
 	uint8_t maskCtr;
 	uint8 frameCont;
 	uint8 closedHere;
+	uint8 queueBusy; //a queued frame has been handed to the socket and isn't sent yet
+	uint8 wantWritable; //a send would have blocked; call writableCb when the queue drains
+	uint8 missedPongs; //pings sent without a pong coming back, or intervals waited for a close we started
 	int wsStatus;
+	WebsockQueueItem *queue; //frames waiting to be sent, every frame for the socket goes through here
+	int queueLen;
+	int queueBytes;
+	WebsockBuf *pong; //pong being filled from a ping whose payload arrives in pieces
 	Websock *next; //in linked list
 };
 
 static Websock *llStart=NULL;
+static os_timer_t pingTimer;
 
-static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
-	char buf[14];
+//Write a frame header to buf, which needs room for 10 bytes. Returns the header length.
+static int ICACHE_FLASH_ATTR encodeFrameHead(char *buf, int opcode, int len) {
 	int i=0;
 	buf[i++]=opcode;
 	if (len>65535) {
@@ -104,57 +138,187 @@ static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
 	} else {
 		buf[i++]=len;
 	}
-	httpd_printf("WS: Sent frame head for payload of %d bytes.\n", len);
-	return httpdSend(ws->conn, buf, i);
+	return i;
+}
+
+//Allocate a frame with room for len payload bytes and encode its header. The payload is copied in
+//if data isn't NULL. The frame starts with one reference.
+static WebsockBuf ICACHE_FLASH_ATTR *newFrame(int opcode, const char *data, int len) {
+	WebsockBuf *buf=malloc(sizeof(WebsockBuf)+WEBSOCK_HEAD_MAX+len);
+	if (buf==NULL) return NULL;
+	buf->len=encodeFrameHead(buf->data, opcode, len);
+	if (data!=NULL) {
+		memcpy(buf->data+buf->len, data, len);
+		buf->len+=len;
+	}
+	buf->refs=1;
+	return buf;
+}
+
+static void ICACHE_FLASH_ATTR releaseBuf(WebsockBuf *buf) {
+	if (--buf->refs==0) free(buf);
+}
+
+static void ICACHE_FLASH_ATTR removeQueued(Websock *ws) {
+	WebsockQueueItem *item=ws->priv->queue;
+	ws->priv->queue=item->next;
+	ws->priv->queueLen--;
+	ws->priv->queueBytes-=item->buf->len;
+	releaseBuf(item->buf);
+	free(item);
+}
+
+static void ICACHE_FLASH_ATTR freeQueue(Websock *ws) {
+	while (ws->priv->queue!=NULL) removeQueued(ws);
+}
+
+//Hand the next queued frame to the socket. Espconn copies the data, so the frame is released as soon
+//as it is accepted. If the socket is still busy the frame stays queued until the next sent callback.
+static void ICACHE_FLASH_ATTR sendQueued(Websock *ws) {
+	WebsockQueueItem *item=ws->priv->queue;
+	if (item==NULL || ws->priv->queueBusy || ws->conn->conn==NULL) return;
+	if (!httpdPlatSendData(ws->conn->conn, item->buf->data, item->buf->len)) return;
+	ws->priv->queueBusy=1;
+	removeQueued(ws);
+}
+
+//Append a frame to the send queue of a websocket and try to send it. Returns 0 if out of memory.
+static int ICACHE_FLASH_ATTR appendFrame(Websock *ws, WebsockBuf *buf) {
+	WebsockQueueItem *item, *last;
+	item=malloc(sizeof(WebsockQueueItem));
+	if (item==NULL) return 0;
+	item->buf=buf;
+	item->next=NULL;
+	buf->refs++;
+	if (ws->priv->queue==NULL) {
+		ws->priv->queue=item;
+	} else {
+		last=ws->priv->queue;
+		while (last->next!=NULL) last=last->next;
+		last->next=item;
+	}
+	ws->priv->queueLen++;
+	ws->priv->queueBytes+=buf->len;
+	sendQueued(ws);
+	return 1;
+}
+
+//Queue a frame for a single websocket. Returns 0 if out of memory.
+static int ICACHE_FLASH_ATTR sendFrame(Websock *ws, int opcode, const char *data, int len) {
+	WebsockBuf *buf=newFrame(opcode, data, len);
+	int r;
+	if (buf==NULL) return 0;
+	r=appendFrame(ws, buf);
+	releaseBuf(buf);
+	return r;
 }
 
+//Returns how many payload bytes can be sent right now without cgiWebsocketSend blocking.
+int ICACHE_FLASH_ATTR cgiWebsocketSendCredit(Websock *ws) {
+	int credit;
+	if (ws->conn==NULL || ws->conn->conn==NULL || ws->priv->closedHere) return 0;
+	credit=WEBSOCK_BACKLOG_LIMIT-ws->priv->queueBytes-WEBSOCK_HEAD_MAX;
+	return credit<0?0:credit;
+}
+
+//Ask for writableCb to be called once the socket has drained.
+void ICACHE_FLASH_ATTR cgiWebsocketWantWritable(Websock *ws) {
+	ws->priv->wantWritable=1;
+}
+
+//Frames are queued, so this can be called from anywhere, not just from inside a httpd callback.
 int ICACHE_FLASH_ATTR cgiWebsocketSend(Websock *ws, char *data, int len, int flags) {
-	int r=0;
 	int fl=0;
+	if (len>cgiWebsocketSendCredit(ws)) {
+		ws->priv->wantWritable=1;
+		return WEBSOCK_WOULDBLOCK;
+	}
 	if (flags&WEBSOCK_FLAG_BIN) fl=OPCODE_BINARY; else fl=OPCODE_TEXT;
 	if (!(flags&WEBSOCK_FLAG_CONT)) fl|=FLAG_FIN;
-	sendFrameHead(ws, fl, len);
-	if (len!=0) r=httpdSend(ws->conn, data, len);
-	httpdFlushSendBuffer(ws->conn);
-	return r;
+	return sendFrame(ws, fl, data, len);
+}
+
+//The close frame goes out after everything already queued. If it can't be queued the socket is
+//disconnected instead.
+void ICACHE_FLASH_ATTR cgiWebsocketClose(Websock *ws, int reason) {
+	char rs[2]={reason>>8, reason&0xff};
+	ws->priv->closedHere=1;
+	if (!sendFrame(ws, FLAG_FIN|OPCODE_CLOSE, rs, 2) && ws->conn->conn!=NULL) httpdPlatDisconnect(ws->conn->conn);
+}
+
+//Add a frame to the send queue of a websocket. Returns 0 if the websocket was closed because it
+//couldn't keep up.
+static int ICACHE_FLASH_ATTR queueFrame(Websock *ws, WebsockBuf *buf) {
+	if (ws->priv->queueLen>=WEBSOCK_QUEUE_MAX) {
+		if (ws->queuePolicy==WEBSOCK_QUEUE_CLOSE) {
+			httpd_printf("WS: Closing slow websocket\n");
+			freeQueue(ws);
+			cgiWebsocketClose(ws, 1008);
+			return 0;
+		}
+		//Drop the oldest frame so the newest data gets through.
+		removeQueued(ws);
+	}
+	appendFrame(ws, buf);
+	return 1;
 }
 
 //Broadcast data to all websockets at a specific url. Returns the amount of connections sent to.
+//The frame is encoded once and queued on every websocket; each queue drains from its own sent
+//callback, so this can be called from anywhere, not just from inside a httpd callback.
 int ICACHE_FLASH_ATTR cgiWebsockBroadcast(char *resource, char *data, int len, int flags) {
-//This is majorly broken (and actually, always, it just tended to work because the circumstances
-//were juuuust right). Because the socket is used outside of the httpd send/receive context, it 
-//will not have an associated send buffer. This means httpdSend will write to a dangling pointer!
-//Disabled for now. If you really need this, open an issue on github or otherwise poke me and I'll
-//see what I can do.
-	int ret=0;
-#if 1
-	Websock *lw=llStart;
+	WebsockBuf *buf;
+	Websock *lw;
+	int ret=0, fl;
+	if (flags&WEBSOCK_FLAG_BIN) fl=OPCODE_BINARY; else fl=OPCODE_TEXT;
+	if (!(flags&WEBSOCK_FLAG_CONT)) fl|=FLAG_FIN;
+	//The reference newFrame starts with is held while queueing so the buffer can't be freed by a send
+	//that completes right away.
+	buf=newFrame(fl, data, len);
+	if (buf==NULL) return 0;
+	lw=llStart;
 	while (lw!=NULL) {
-        char sendBuff[1024];
-        httpdSetSendBuffer(lw->conn, sendBuff, sizeof(sendBuff));
-		if (strcmp(lw->conn->url, resource)==0) {
-			cgiWebsocketSend(lw, data, len, flags);
-			ret++;
+		Websock *next=lw->priv->next;
+		if (strcmp(lw->conn->url, resource)==0 && !lw->priv->closedHere) {
+			if (queueFrame(lw, buf)) ret++;
 		}
-		lw=lw->priv->next;
+		lw=next;
 	}
-#endif
+	releaseBuf(buf);
 	return ret;
 }
 
 
-void ICACHE_FLASH_ATTR cgiWebsocketClose(Websock *ws, int reason) {
-	char rs[2]={reason>>8, reason&0xff};
-	sendFrameHead(ws, FLAG_FIN|OPCODE_CLOSE, 2);
-	httpdSend(ws->conn, rs, 2);
-	ws->priv->closedHere=1;
-	httpdFlushSendBuffer(ws->conn);
+//Ping every websocket and disconnect the ones that stopped answering, so their slots are freed.
+//A websocket we closed isn't pinged, but it gets the same number of intervals to finish the close
+//handshake before it is disconnected.
+static void ICACHE_FLASH_ATTR pingTimerCb(void *arg) {
+	Websock *lw=llStart;
+	while (lw!=NULL) {
+		Websock *next=lw->priv->next;
+		if (lw->conn->conn!=NULL) {
+			if (lw->priv->missedPongs>=WEBSOCK_PING_MISSES) {
+				httpd_printf("WS: No pong, disconnecting\n");
+				httpdPlatDisconnect(lw->conn->conn);
+			} else {
+				lw->priv->missedPongs++;
+				if (!lw->priv->closedHere) sendFrame(lw, FLAG_FIN|OPCODE_PING, NULL, 0);
+			}
+		}
+		lw=next;
+	}
 }
 
-
 static void ICACHE_FLASH_ATTR websockFree(Websock *ws) {
 	httpd_printf("Ws: Free\n");
 	if (ws->closeCb) ws->closeCb(ws);
+	//A close frame queued just before the cgi finished still has to go out, so whatever is left moves
+	//to the httpd backlog, which drains before the connection is closed.
+	while (ws->priv->queue!=NULL) {
+		if (ws->conn->conn!=NULL) httpdUnbufferedSend(ws->conn, ws->priv->queue->buf->data, ws->priv->queue->buf->len);
+		removeQueued(ws);
+	}
+	if (ws->priv->pong) releaseBuf(ws->priv->pong);
 	//Clean up linked list
 	if (llStart==ws) {
 		llStart=ws->priv->next;
@@ -164,11 +328,40 @@ static void ICACHE_FLASH_ATTR websockFree(Websock *ws) {
 		while (lws!=NULL && lws->priv->next!=ws) lws=lws->priv->next;
 		if (lws!=NULL) lws->priv->next=ws->priv->next;
 	}
+	if (llStart==NULL) os_timer_disarm(&pingTimer);
 	if (ws->priv) free(ws->priv);
 }
 
+//Unmask len bytes of payload in place. Bytes are done one at a time until the data is word aligned,
+//then a word at a time with the mask rotated to match, and the tail one at a time again.
+static void ICACHE_FLASH_ATTR unmaskPayload(char *data, int len, uint8_t *mask, uint8_t *maskCtr) {
+	uint8_t ctr=*maskCtr;
+	uint8_t m[4];
+	uint32_t w, *p;
+	while (len>0 && ((uintptr_t)data&3)!=0) {
+		*data++^=mask[(ctr++)&3];
+		len--;
+	}
+	if (len>=4) {
+		m[0]=mask[ctr&3]; m[1]=mask[(ctr+1)&3]; m[2]=mask[(ctr+2)&3]; m[3]=mask[(ctr+3)&3];
+		memcpy(&w, m, 4);
+		p=(uint32_t*)data;
+		ctr+=len&~3;
+		while (len>=4) {
+			*p++^=w;
+			len-=4;
+		}
+		data=(char*)p;
+	}
+	while (len>0) {
+		*data++^=mask[(ctr++)&3];
+		len--;
+	}
+	*maskCtr=ctr;
+}
+
 int ICACHE_FLASH_ATTR cgiWebSocketRecv(HttpdConnData *connData, char *data, int len) {
-	int i, j, sl;
+	int i, sl;
 	int r=HTTPD_CGI_MORE;
 	int wasHeaderByte;
 	Websock *ws=(Websock*)connData->cgiData;
@@ -218,7 +411,7 @@ int ICACHE_FLASH_ATTR cgiWebSocketRecv(HttpdConnData *connData, char *data, int
 			sl=len-i;
 			httpd_printf("Ws: Frame payload. wasHeaderByte %d fr.len %d sl %d cmd 0x%x\n", wasHeaderByte, (int)ws->priv->fr.len, (int)sl, ws->priv->fr.flags);
 			if (sl > ws->priv->fr.len) sl=ws->priv->fr.len;
-			for (j=0; j<sl; j++) data[i+j]^=(ws->priv->fr.mask[(ws->priv->maskCtr++)&3]);
+			unmaskPayload(data+i, sl, ws->priv->fr.mask, &ws->priv->maskCtr);
 
 //			httpd_printf("Unmasked: ");
 //			for (j=0; j<sl; j++) httpd_printf("%02X ", data[i+j]&0xff);
@@ -231,8 +424,20 @@ int ICACHE_FLASH_ATTR cgiWebSocketRecv(HttpdConnData *connData, char *data, int
 					r=HTTPD_CGI_DONE;
 					break;
 				} else {
-					if (!ws->priv->frameCont) sendFrameHead(ws, OPCODE_PONG|FLAG_FIN, ws->priv->fr.len);
-					if (sl>0) httpdSend(ws->conn, data+i, sl);
+					//The pong is queued once the whole ping payload is in.
+					if (!ws->priv->frameCont) {
+						if (ws->priv->pong) releaseBuf(ws->priv->pong);
+						ws->priv->pong=newFrame(OPCODE_PONG|FLAG_FIN, NULL, ws->priv->fr.len);
+					}
+					if (ws->priv->pong) {
+						memcpy(ws->priv->pong->data+ws->priv->pong->len, data+i, sl);
+						ws->priv->pong->len+=sl;
+						if (sl==ws->priv->fr.len) {
+							appendFrame(ws, ws->priv->pong);
+							releaseBuf(ws->priv->pong);
+							ws->priv->pong=NULL;
+						}
+					}
 				}
 			} else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_TEXT || 
 						(ws->priv->fr.flags&OPCODE_MASK)==OPCODE_BINARY ||
@@ -249,6 +454,8 @@ int ICACHE_FLASH_ATTR cgiWebSocketRecv(HttpdConnData *connData, char *data, int
 					if ((ws->priv->fr.flags&FLAG_FIN)==0) flags|=WEBSOCK_FLAG_CONT;
 					if (ws->recvCb) ws->recvCb(ws, data+i, sl, flags);
 				}
+			} else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_PONG) {
+				if (!ws->priv->closedHere) ws->priv->missedPongs=0;
 			} else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_CLOSE) {
 				httpd_printf("WS: Got close frame\n");
 				if (!ws->priv->closedHere) {
@@ -324,6 +531,8 @@ int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 				base64_encode(20, sha1_result(&s), sizeof(buff), buff);
 				httpdHeader(connData, "Sec-WebSocket-Accept", buff);
 				httpdEndHeaders(connData);
+				//Frames go out through the queue from here on, so the headers have to be on their way first.
+				httpdFlushSendBuffer(connData);
 				//Set data receive handler
 				connData->recvHdl=cgiWebSocketRecv;
 				//Inform CGI function we have a connection
@@ -332,6 +541,9 @@ int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 				//Insert ws into linked list
 				if (llStart==NULL) {
 					llStart=ws;
+					os_timer_disarm(&pingTimer);
+					os_timer_setfn(&pingTimer, pingTimerCb, NULL);
+					os_timer_arm(&pingTimer, WEBSOCK_PING_INTERVAL*1000, 1);
 				} else {
 					Websock *lw=llStart;
 					while (lw->priv->next) lw=lw->priv->next;
@@ -346,9 +558,17 @@ int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 		return HTTPD_CGI_DONE;
 	}
 	
-	//Sending is done. Call the sent callback if we have one.
+	//Sending is done. Send the next queued frame and call the sent callback if we have one.
 	Websock *ws=(Websock*)connData->cgiData;
+	if (ws) {
+		ws->priv->queueBusy=0;
+		sendQueued(ws);
+	}
 	if (ws && ws->sentCb) ws->sentCb(ws);
+	if (ws && ws->priv->wantWritable && ws->priv->queue==NULL) {
+		ws->priv->wantWritable=0;
+		if (ws->writableCb) ws->writableCb(ws);
+	}
 
 	return HTTPD_CGI_MORE;
 }
@@ -1,4 +1,4 @@
-static uint8_t rawLoaderImage[] = {
+static const uint8_t rawLoaderImage[] = {
 /* 0000 */ 0x00,0xB4,0xC4,0x04,0x6F,0x93,0x10,0x00,0x88,0x01,0x90,0x01,0x80,0x01,0x94,0x01,
 /* 0010 */ 0x78,0x01,0x02,0x00,0x70,0x01,0x00,0x00,0x4D,0xE8,0xBF,0xA0,0x4D,0xEC,0xBF,0xA0,
 /* 0020 */ 0x51,0xB8,0xBC,0xA1,0x01,0xB8,0xFC,0x28,0xF1,0xB9,0xBC,0x80,0xA0,0xB6,0xCC,0xA0,
@@ -25,14 +25,14 @@ static uint8_t rawLoaderImage[] = {
 /* 0170 */ 0x30,0x00,0x00,0x00,0x30,0x00,0x00,0x00,0x68,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
 /* 0350 */ 0x35,0xC7,0x08,0x35,0x2C,0x32,0x00,0x00};
 
-static uint8_t verifyRAM[] = {
+static const uint8_t verifyRAM[] = {
 /* 0184 */ 0x49,0xBC,0xBC,0xA0,0x45,0xBC,0xBC,0x84,0x02,0xBC,0xFC,0x2A,0x45,0x8C,0x14,0x08,
 /* 0194 */ 0x04,0x8A,0xD4,0x80,0x66,0xBC,0xD4,0xE4,0x0A,0xBC,0xFC,0x04,0x04,0xBC,0xFC,0x84,
 /* 01a4 */ 0x5E,0x94,0x3C,0x08,0x04,0xBC,0xFC,0x84,0x5E,0x94,0x3C,0x08,0x01,0x8A,0xFC,0x84,
 /* 01b4 */ 0x45,0xBE,0xBC,0x00,0x5F,0x8C,0xBC,0x80,0x6E,0x8A,0x7C,0xE8,0x46,0xB2,0xBC,0xA4,
 /* 01c4 */ 0x09,0x00,0x7C,0x5C};
 
-static uint8_t programVerifyEEPROM[] = {
+static const uint8_t programVerifyEEPROM[] = {
 /* 01cc */ 0x03,0x8C,0xFC,0x2C,0x4F,0xEC,0xBF,0x68,0x82,0x18,0xFD,0x5C,0x40,0xBE,0xFC,0xA0,
 /* 01dc */ 0x45,0xBA,0xBC,0x00,0xA0,0x62,0xFD,0x5C,0x79,0x00,0x70,0x5C,0x01,0x8A,0xFC,0x80,
 /* 01ec */ 0x67,0xBE,0xFC,0xE4,0x8F,0x3E,0xFD,0x5C,0x49,0x8A,0x3C,0x86,0x65,0x00,0x54,0x5C,
@@ -54,12 +54,12 @@ static uint8_t programVerifyEEPROM[] = {
 /* 02ec */ 0x57,0xB8,0xBC,0xF8,0x4F,0xE8,0xBF,0x68,0xF2,0x9D,0x3C,0x61,0x58,0xB8,0xBC,0xF8,
 /* 02fc */ 0xA7,0xC0,0xFC,0xE4,0xFF,0xBA,0xFC,0x60,0x00,0x00,0x7C,0x5C};
 
-static uint8_t readyToLaunch[] = {
+static const uint8_t readyToLaunch[] = {
 /* 030c */ 0xB8,0x72,0xFC,0x58,0x66,0x72,0xFC,0x50,0x09,0x00,0x7C,0x5C,0x06,0xBE,0xFC,0x04,
 /* 031c */ 0x10,0xBE,0x7C,0x86,0x00,0x8E,0x54,0x0C,0x04,0xBE,0xFC,0x00,0x78,0xBE,0xFC,0x60,
 /* 032c */ 0x50,0xBE,0xBC,0x68,0x00,0xBE,0x7C,0x0C,0x40,0xAE,0xFC,0x2C,0x6E,0xAE,0xFC,0xE4,
 /* 033c */ 0x04,0xBE,0xFC,0x00,0x00,0xBE,0x7C,0x0C,0x02,0x96,0x7C,0x0C};
 
-static uint8_t launchNow[] = {
+static const uint8_t launchNow[] = {
 /* 034c */ 0x66,0x00,0x7C,0x5C};
 
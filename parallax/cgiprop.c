@@ -14,6 +14,8 @@
 #include "sscp.h"
 #include "uart.h"
 #include "roffs.h"
+#include "imagecache.h"
+#include "loadjobs.h"
 #include "gpio-helpers.h"
 
 //#define STATE_DEBUG
@@ -52,6 +54,20 @@ static void resetButtonTimerCallback(void *data);
 static void armTimer(PropellerConnection *connection, int delay);
 static void timerCallback(void *data);
 static void readCallback(char *buf, short length);
+static void sendPacket(PropellerConnection *connection);
+static void packetAccepted(PropellerConnection *connection);
+static void loadStarted(PropellerConnection *connection);
+static int streamPostData(PropellerConnection *connection, HttpdConnData *connData);
+static void releaseStream(PropellerConnection *connection);
+static void freeStream(PropellerConnection *connection);
+static void closeFile(PropellerConnection *connection);
+static int loadFileRequest(HttpdConnData *connData, int p2LoaderMode);
+static int queueCachedImage(HttpdConnData *connData);
+static int8_t getJobArgs(HttpdConnData *connData, LoadJob *params);
+static int submitJob(HttpdConnData *connData, LoadJob *params);
+static void jobCompletionCB(PropellerConnection *connection, LoadStatus status);
+static void trackJob(PropellerConnection *connection);
+static int escalationFailed(PropellerConnection *connection);
 
 /* the order here must match the definition of LoadState in proploader.h */
 static const char * ICACHE_RODATA_ATTR stateNames[] = {
@@ -62,10 +78,13 @@ static const char * ICACHE_RODATA_ATTR stateNames[] = {
     "RxHandshake",
     "LoadContinue",
     "VerifyChecksum",
-    "StartAck"
+    "StartAck",
+    "LoaderStart",
+    "PacketAck",
+    "PacketWait"
 };
 
-static const ICACHE_FLASH_ATTR char *stateName(LoadState state)
+const char ICACHE_FLASH_ATTR *loadStateName(LoadState state)
 {
     return state >= 0 && state < stMAX ? stateNames[state] : "Unknown";
 }
@@ -79,12 +98,29 @@ static int8_t ICACHE_FLASH_ATTR getIntArg(HttpdConnData *connData, char *name, i
   return 1;
 }
 
+// EEPROM programming is done by the second-stage loader so it needs a fast-baud-rate
+static int8_t ICACHE_FLASH_ATTR getLoadType(HttpdConnData *connData, PropellerConnection *connection)
+{
+    int eeprom;
+    if (!getIntArg(connData, "eeprom", &eeprom))
+        eeprom = 0;
+    if (eeprom && connection->fastBaudRate <= 0) {
+        httpdSendResponse(connData, 400, "EEPROM programming requires fast-baud-rate\r\n", -1);
+        return 0;
+    }
+    connection->loadType = eeprom ? ltDownloadAndProgramAndRun : ltDownloadAndRun;
+    return 1;
+}
+
 
 
 
 // this is statically allocated because the serial read callback has no context parameter
 PropellerConnection myConnection;
 
+// the queued load that is using myConnection
+static LoadJob *runningJob;
+
 int ICACHE_FLASH_ATTR cgiPropInit()
 {
     
@@ -159,6 +195,7 @@ int ICACHE_FLASH_ATTR cgiPropInit()
     if ((ret = roffs_mount(fs_base, fs_size)) != 0) {
         os_printf("Mounting flash filesystem failed: %d\n", ret);
         os_printf("Attempting to format...");
+        imageCacheReset();
         if ((ret = roffs_format(fs_base)) != 0) {
             os_printf("Error formatting filesystem: %d\n", ret);
             return -1;
@@ -210,14 +247,30 @@ int ICACHE_FLASH_ATTR cgiPropInit()
 int ICACHE_FLASH_ATTR cgiPropLoad(HttpdConnData *connData) // This func is called when SimpleIDE/BlocklyProp perform overair firmware programming of Propeller 1
 {
     PropellerConnection *connection = &myConnection;
+    char arg[IMAGE_CACHE_HASH_SIZE + 8], hash[IMAGE_CACHE_HASH_SIZE + 1], fileName[IMAGE_CACHE_NAME_MAX];
+    int queue;
 
     // check for the cleanup call
-    if (connData->conn == NULL)
+    if (connData->conn == NULL) {
+        // the image can't arrive anymore, nor can the response be sent
+        if (connection->state != stIdle && connection->connData == connData) {
+            connection->connData = NULL;
+            abortLoading(connection, lsLoadImageFailed);
+        }
         return HTTPD_CGI_DONE;
+    }
+
+    // the next part of an image that is being streamed
+    if (connData->cgiData)
+        return streamPostData(connection, connData);
+
+    // only an image that is already cached can wait in the queue
+    if (getIntArg(connData, "queue", &queue) && queue)
+        return queueCachedImage(connData);
 
     if (connection->state != stIdle) {
         char buf[128];
-        os_sprintf(buf, "Transfer already in progress: state %s\r\n", stateName(connection->state));
+        os_sprintf(buf, "Transfer already in progress: state %s\r\n", loadStateName(connection->state));
         httpdSendResponse(connData, 400, buf, -1);
         return HTTPD_CGI_DONE;
     }
@@ -229,12 +282,34 @@ int ICACHE_FLASH_ATTR cgiPropLoad(HttpdConnData *connData) // This func is calle
     }
 #endif
 
-    if (connData->post->len == 0) {
-        httpdSendResponse(connData, 400, "No data\r\n", -1);
+    // an image that is already in the cache is loaded from flash, whether or not it was sent again
+    connection->file = NULL;
+    hash[0] = '\0';
+    if (httpdFindArg(connData->getArgs, "sha1", arg, sizeof(arg)) >= 0) {
+        if (!imageCacheParseHash(arg, hash)) {
+            httpdSendResponse(connData, 400, "Invalid sha1 argument\r\n", -1);
+            return HTTPD_CGI_DONE;
+        }
+        if (imageCacheLookup(hash, fileName))
+            connection->file = roffs_open(fileName);
+    }
+
+    if (!connection->file && connData->post->len == 0) {
+        if (hash[0])
+            httpdSendResponse(connData, 404, "Image not cached\r\n", -1);
+        else
+            httpdSendResponse(connData, 400, "No data\r\n", -1);
         return HTTPD_CGI_DONE;
     }
-    else if (connData->post->buffLen != connData->post->len) {
-        httpdSendResponse(connData, 400, "Data too large\r\n", -1);
+
+    // an image larger than the POST buffer is sent to the Propeller as it arrives
+    connection->stream = NULL;
+    connection->streamCount = 0;
+    connection->streamHeld = 0;
+    if (!connection->file
+    &&  connData->post->buffLen != connData->post->len
+    &&  !(connection->stream = (uint8_t *)os_malloc(LOAD_STREAM_SIZE))) {
+        httpdSendResponse(connData, 400, "Out of memory\r\n", -1);
         return HTTPD_CGI_DONE;
     }
 
@@ -251,6 +326,13 @@ int ICACHE_FLASH_ATTR cgiPropLoad(HttpdConnData *connData) // This func is calle
         connection->responseSize = 0;
     if (!getIntArg(connData, "response-timeout", &connection->responseTimeout))
         connection->responseTimeout = 1000;
+    if (!getIntArg(connData, "fast-baud-rate", &connection->fastBaudRate))
+        connection->fastBaudRate = flashConfig.fast_loader_baud_rate;
+    if (!getLoadType(connData, connection)) {
+        freeStream(connection);
+        closeFile(connection);
+        return HTTPD_CGI_DONE;
+    }
     
     // P1 only feature, so force timing values to P1 mode
     connection->p2LoaderMode = ddoff;
@@ -258,68 +340,207 @@ int ICACHE_FLASH_ATTR cgiPropLoad(HttpdConnData *connData) // This func is calle
     connection->st_load_segment_max_size = P1_LOAD_SEGMENT_MAX_SIZE;
     connection->st_reset_delay_2 = P1_RESET_DELAY_2;
 
-    DBG("cgiPropLoad: size %d, baud-rate %d, final-baud-rate %d, reset-pin %d, reset-delay %d\n", connData->post->buffLen, connection->baudRate, connection->finalBaudRate, connection->resetPin, connection->st_reset_delay_2);
+    DBG("cgiPropLoad: size %d, baud-rate %d, final-baud-rate %d, reset-pin %d, reset-delay %d\n", connData->post->len, connection->baudRate, connection->finalBaudRate, connection->resetPin, connection->st_reset_delay_2);
     
     if (connection->responseSize > 0)
         DBG("  responseSize %d, responseTimeout %d\n", connection->responseSize, connection->responseTimeout);
 
-    connection->file = NULL;
     connection->completionCB = wifiLoadCompletionCB;
+    if (connection->file) {
+        startLoading(connection, NULL, roffs_file_size(connection->file));
+        return HTTPD_CGI_MORE;
+    }
+
+    // keep a copy under its hash for next time
+    if (hash[0])
+        imageCacheStoreStart(hash, connData->post->len);
+
+    if (connection->stream) {
+        startLoading(connection, NULL, connData->post->len);
+        return streamPostData(connection, connData);
+    }
+    imageCacheStoreData((uint8_t *)connData->post->buff, connData->post->buffLen);
     startLoading(connection, (uint8_t *)connData->post->buff, connData->post->buffLen);
 
     return HTTPD_CGI_MORE;
 }
 
-int ICACHE_FLASH_ATTR cgiPropLoadP1File(HttpdConnData *connData)
+static int ICACHE_FLASH_ATTR queueCachedImage(HttpdConnData *connData)
 {
-    PropellerConnection *connection = &myConnection;
-    
-    connection->p2LoaderMode = ddoff;
-    connection->st_load_segment_delay = P1_LOAD_SEGMENT_DELAY;
-    connection->st_load_segment_max_size = P1_LOAD_SEGMENT_MAX_SIZE;
-    connection->st_reset_delay_2 = P1_RESET_DELAY_2;
-    
-    DBG("cgiPropLoadP1File: reset-pin %d, reset-delay %d\n", connection->resetPin, connection->st_reset_delay_2);
+    char arg[IMAGE_CACHE_HASH_SIZE + 8], hash[IMAGE_CACHE_HASH_SIZE + 1];
+    LoadJob params;
+
+#ifdef AUTO_LOAD
+    if (IsAutoLoadEnabled()) {
+        httpdSendResponse(connData, 400, "Not allowed\r\n", -1);
+        return HTTPD_CGI_DONE;
+    }
+#endif
 
-    return cgiPropLoadFile(connData);
+    if (httpdFindArg(connData->getArgs, "sha1", arg, sizeof(arg)) < 0 || !imageCacheParseHash(arg, hash)) {
+        httpdSendResponse(connData, 400, "Queued loads need a sha1 argument\r\n", -1);
+        return HTTPD_CGI_DONE;
+    }
 
+    os_memset(&params, 0, sizeof(params));
+    if (!imageCacheLookup(hash, params.fileName)) {
+        httpdSendResponse(connData, 404, "Image not cached\r\n", -1);
+        return HTTPD_CGI_DONE;
+    }
+
+    if (!getJobArgs(connData, &params))
+        return HTTPD_CGI_DONE;
+
+    return submitJob(connData, &params);
 }
 
-int ICACHE_FLASH_ATTR cgiPropLoadP2File(HttpdConnData *connData)
+// add a chunk of the POST body to the stream, holding the connection while enough is waiting
+static int ICACHE_FLASH_ATTR streamPostData(PropellerConnection *connection, HttpdConnData *connData)
 {
-    PropellerConnection *connection = &myConnection;
-    
-    connection->p2LoaderMode = dragdrop;
-    connection->st_load_segment_delay = P2_LOAD_SEGMENT_DELAY;
-    connection->st_load_segment_max_size = P2_LOAD_SEGMENT_MAX_SIZE;
-    connection->st_reset_delay_2 = P2_RESET_DELAY_2;
-    
-    DBG("cgiPropLoadP2File: reset-pin %d, reset-delay %d\n", connection->resetPin, connection->st_reset_delay_2);
-    
-    return cgiPropLoadFile(connData);
+    int len = connData->post->buffLen;
+
+    // the load has already ended and the response was sent
+    if (!connection->stream || connection->connData != connData)
+        return HTTPD_CGI_MORE;
+
+    if (connection->streamCount + len > LOAD_STREAM_SIZE) {
+        abortLoading(connection, lsStreamOverrun);
+        return HTTPD_CGI_MORE;
+    }
+    memcpy(connection->stream + connection->streamCount, connData->post->buff, len);
+    connection->streamCount += len;
+    imageCacheStoreData((uint8_t *)connData->post->buff, len);
+
+    if (!connection->streamHeld && connection->streamCount >= LOAD_STREAM_HOLD) {
+        httpdHoldRecv(connData, 1);
+        connection->streamHeld = 1;
+    }
+
+    return HTTPD_CGI_MORE;
+}
+
+// let the client send more once the Propeller has taken enough of what is waiting
+static void ICACHE_FLASH_ATTR releaseStream(PropellerConnection *connection)
+{
+    if (connection->streamHeld && connection->streamCount < LOAD_STREAM_HOLD) {
+        connection->streamHeld = 0;
+        if (connection->connData)
+            httpdHoldRecv(connection->connData, 0);
+    }
+}
+
+static void ICACHE_FLASH_ATTR freeStream(PropellerConnection *connection)
+{
+    if (connection->stream) {
+        connection->streamCount = 0;
+        releaseStream(connection);
+        os_free(connection->stream);
+        connection->stream = NULL;
+    }
+}
+
+static void ICACHE_FLASH_ATTR closeFile(PropellerConnection *connection)
+{
+    if (connection->file) {
+        roffs_close(connection->file);
+        connection->file = NULL;
+    }
+}
+
+static void ICACHE_FLASH_ATTR setLoaderMode(PropellerConnection *connection, int p2LoaderMode)
+{
+    connection->p2LoaderMode = p2LoaderMode;
+    if (p2LoaderMode == dragdrop) {
+        connection->st_load_segment_delay = P2_LOAD_SEGMENT_DELAY;
+        connection->st_load_segment_max_size = P2_LOAD_SEGMENT_MAX_SIZE;
+        connection->st_reset_delay_2 = P2_RESET_DELAY_2;
+    }
+    else {
+        connection->st_load_segment_delay = P1_LOAD_SEGMENT_DELAY;
+        connection->st_load_segment_max_size = P1_LOAD_SEGMENT_MAX_SIZE;
+        connection->st_reset_delay_2 = P1_RESET_DELAY_2;
+    }
+}
+
+// the load arguments shared by immediate and queued loads of a file
+static int8_t ICACHE_FLASH_ATTR getJobArgs(HttpdConnData *connData, LoadJob *params)
+{
+    int eeprom;
+    if (!getIntArg(connData, "baud-rate", &params->baudRate))
+        params->baudRate = flashConfig.loader_baud_rate;
+    if (!getIntArg(connData, "final-baud-rate", &params->finalBaudRate))
+        params->finalBaudRate = flashConfig.baud_rate;
+    if (!getIntArg(connData, "fast-baud-rate", &params->fastBaudRate))
+        params->fastBaudRate = flashConfig.fast_loader_baud_rate;
+    if (params->p2)
+        params->fastBaudRate = 0; // the second-stage loader is P1 only
+    if (!getIntArg(connData, "eeprom", &eeprom))
+        eeprom = 0;
+    if (eeprom && params->fastBaudRate <= 0) {
+        httpdSendResponse(connData, 400, "EEPROM programming requires fast-baud-rate\r\n", -1);
+        return 0;
+    }
+    params->loadType = eeprom ? ltDownloadAndProgramAndRun : ltDownloadAndRun;
+    if (params->p2) {
+        int escalate;
+        if (!getIntArg(connData, "escalate", &escalate))
+            escalate = flashConfig.p2_baud_escalation;
+        params->fastBaudRate = ploadP2FastBaudRate(params->baudRate, params->finalBaudRate, escalate);
+    }
+    return 1;
+}
+
+// add a load to the job queue, it starts as soon as the loader is free
+static int ICACHE_FLASH_ATTR submitJob(HttpdConnData *connData, LoadJob *params)
+{
+    LoadJob *job;
+
+    if (!(job = loadJobSubmit(params))) {
+        httpdSendResponse(connData, 503, "Load queue full\r\n", -1);
+        return HTTPD_CGI_DONE;
+    }
+
+    loadJobSendJson(connData, 202, job);
+    return HTTPD_CGI_DONE;
+}
+
+int ICACHE_FLASH_ATTR cgiPropLoadP1File(HttpdConnData *connData)
+{
+    return loadFileRequest(connData, ddoff);
+}
 
+int ICACHE_FLASH_ATTR cgiPropLoadP2File(HttpdConnData *connData)
+{
+    return loadFileRequest(connData, dragdrop);
 }
 
 int ICACHE_FLASH_ATTR cgiPropLoadFile(HttpdConnData *connData)
+{
+    return loadFileRequest(connData, ddoff);
+}
+
+static int ICACHE_FLASH_ATTR loadFileRequest(HttpdConnData *connData, int p2LoaderMode)
 {
     PropellerConnection *connection = &myConnection;
-    
-    
-    char fileName[128];
+    LoadJob params;
+    ROFFS_FILE *file;
     int fileSize = 0;
+    int queue;
 
     // check for the cleanup call
     if (connData->conn == NULL) {
-        if (connection->file) {
-            roffs_close(connection->file);
-            connection->file = NULL;
-        }
+        // the load goes on without anyone to tell about it
+        if (connection->connData == connData)
+            connection->connData = NULL;
         return HTTPD_CGI_DONE;
     }
 
-    if (connection->state != stIdle) {
+    if (!getIntArg(connData, "queue", &queue))
+        queue = 0;
+
+    if (!queue && connection->state != stIdle) {
         char buf[128];
-        os_sprintf(buf, "Transfer already in progress: state %s\r\n", stateName(connection->state));
+        os_sprintf(buf, "Transfer already in progress: state %s\r\n", loadStateName(connection->state));
         httpdSendResponse(connData, 400, buf, -1);
         return HTTPD_CGI_DONE;
     }
@@ -331,28 +552,43 @@ int ICACHE_FLASH_ATTR cgiPropLoadFile(HttpdConnData *connData)
     }
 #endif
 
-    connData->cgiData = connection;
-    connection->connData = connData;
+    os_memset(&params, 0, sizeof(params));
+    params.p2 = p2LoaderMode == dragdrop;
 
-    if (httpdFindArg(connData->getArgs, "file", fileName, sizeof(fileName)) < 0) {
+    if (httpdFindArg(connData->getArgs, "file", params.fileName, sizeof(params.fileName)) < 0) {
         httpdSendResponse(connData, 400, "Missing file argument\r\n", -1);
         return HTTPD_CGI_DONE;
     }
 
-    if (!(connection->file = roffs_open(fileName))) {
+    if (!(file = roffs_open(params.fileName))) {
         httpdSendResponse(connData, 400, "File not found\r\n", -1);
         return HTTPD_CGI_DONE;
     }
-    fileSize = roffs_file_size(connection->file);
+    fileSize = roffs_file_size(file);
 
-    if (!getIntArg(connData, "baud-rate", &connection->baudRate))
-        connection->baudRate = flashConfig.loader_baud_rate;
-    if (!getIntArg(connData, "final-baud-rate", &connection->finalBaudRate))
-        connection->finalBaudRate = flashConfig.baud_rate;
+    if (!getJobArgs(connData, &params)) {
+        roffs_close(file);
+        return HTTPD_CGI_DONE;
+    }
+
+    if (queue) {
+        roffs_close(file);
+        return submitJob(connData, &params);
+    }
+
+    connData->cgiData = connection;
+    connection->connData = connData;
+    connection->file = file;
+
+    setLoaderMode(connection, p2LoaderMode);
+    connection->baudRate = params.baudRate;
+    connection->finalBaudRate = params.finalBaudRate;
 //    if (!getIntArg(connData, "reset-pin", &connection->resetPin))
     connection->resetPin = flashConfig.reset_pin;
+    connection->fastBaudRate = params.fastBaudRate;
+    connection->loadType = params.loadType;
 
-    DBG("load-file: file %s, size %d, baud-rate %d, final-baud-rate %d, reset-pin %d, reset-delay %d\n", fileName, fileSize, connection->baudRate, connection->finalBaudRate, connection->resetPin, connection->st_reset_delay_2);
+    DBG("load-file: file %s, size %d, baud-rate %d, final-baud-rate %d, reset-pin %d, reset-delay %d\n", params.fileName, fileSize, connection->baudRate, connection->finalBaudRate, connection->resetPin, connection->st_reset_delay_2);
     
     connection->completionCB = wifiLoadCompletionCB;
     startLoading(connection, NULL, fileSize);
@@ -371,7 +607,7 @@ int ICACHE_FLASH_ATTR cgiPropReset(HttpdConnData *connData)
 
     if (connection->state != stIdle) {
         char buf[128];
-        os_sprintf(buf, "Transfer already in progress: state %s\r\n", stateName(connection->state));
+        os_sprintf(buf, "Transfer already in progress: state %s\r\n", loadStateName(connection->state));
         httpdSendResponse(connData, 400, buf, -1);
         return HTTPD_CGI_DONE;
     }
@@ -414,6 +650,10 @@ static void ICACHE_FLASH_ATTR wifiLoadCompletionCB(PropellerConnection *connecti
     char *msg = NULL;
     char buf[128];
 
+    // the client went away
+    if (!connection->connData)
+        return;
+
     switch (status) {
     case lsOK:
         msg = "OK\r\n";
@@ -422,7 +662,7 @@ static void ICACHE_FLASH_ATTR wifiLoadCompletionCB(PropellerConnection *connecti
         httpdSendResponse(connection->connData, 200, (char *)connection->buffer, connection->bytesReceived);
         break;
     case lsBusy:
-        os_sprintf(buf, "Transfer already in progress: state %s\r\n", stateName(connection->state));
+        os_sprintf(buf, "Transfer already in progress: state %s\r\n", loadStateName(connection->state));
         msg = buf;
         break;
     case lsRXHandshakeTimeout:
@@ -447,6 +687,30 @@ static void ICACHE_FLASH_ATTR wifiLoadCompletionCB(PropellerConnection *connecti
     case lsChecksumError:
         msg = "Checksum error\r\n";
         break;
+    case lsLoaderStartTimeout:
+        msg = "Second-stage loader start timeout\r\n";
+        break;
+    case lsLoaderStartFailed:
+        msg = "Second-stage loader failed to start\r\n";
+        break;
+    case lsPacketTimeout:
+        msg = "Packet response timeout\r\n";
+        break;
+    case lsPacketFailed:
+        msg = "Packet rejected\r\n";
+        break;
+    case lsRAMVerifyFailed:
+        msg = "RAM verify failed\r\n";
+        break;
+    case lsEEPROMVerifyFailed:
+        msg = "EEPROM verify failed\r\n";
+        break;
+    case lsStreamOverrun:
+        msg = "Data overrun\r\n";
+        break;
+    case lsCancelled:
+        msg = "Load cancelled\r\n";
+        break;
     default:
         msg = "Internal error\r\n";
         break;
@@ -457,6 +721,66 @@ static void ICACHE_FLASH_ATTR wifiLoadCompletionCB(PropellerConnection *connecti
     }
 }
 
+// start a queued job, the job queue hears about its progress and completion
+LoadStatus ICACHE_FLASH_ATTR loadJobFile(LoadJob *job)
+{
+    PropellerConnection *connection = &myConnection;
+
+    if (connection->state != stIdle) {
+        return lsBusy;
+    }
+
+    if (!(connection->file = roffs_open(job->fileName))) {
+        return lsFileNotFound;
+    }
+    job->imageSize = roffs_file_size(connection->file);
+
+    setLoaderMode(connection, job->p2 ? dragdrop : ddoff);
+    connection->baudRate = job->baudRate;
+    connection->finalBaudRate = job->finalBaudRate;
+    connection->resetPin = flashConfig.reset_pin;
+    connection->responseSize = 0;
+    connection->fastBaudRate = job->fastBaudRate;
+    connection->loadType = job->loadType;
+    connection->connData = NULL;
+
+    connection->completionCB = jobCompletionCB;
+    runningJob = job;
+    startLoading(connection, NULL, job->imageSize);
+    trackJob(connection);
+
+    return lsOK;
+}
+
+int ICACHE_FLASH_ATTR loadJobAbort(LoadJob *job)
+{
+    PropellerConnection *connection = &myConnection;
+
+    if (job != runningJob)
+        return -1;
+
+    // don't leave the Propeller held in reset
+    if (connection->state == stReset)
+        GPIO_DIS_OUTPUT(connection->resetPin);
+
+    abortLoading(connection, lsCancelled);
+    return 0;
+}
+
+static void ICACHE_FLASH_ATTR jobCompletionCB(PropellerConnection *connection, LoadStatus status)
+{
+    LoadJob *job = runningJob;
+    runningJob = NULL;
+    if (job)
+        loadJobFinished(job, status);
+}
+
+static void ICACHE_FLASH_ATTR trackJob(PropellerConnection *connection)
+{
+    if (runningJob)
+        loadJobUpdate(runningJob, connection->state, connection->imageSize);
+}
+
 LoadStatus ICACHE_FLASH_ATTR loadBuffer(const uint8_t *image, int imageSize)
 {
     PropellerConnection *connection = &myConnection;
@@ -469,6 +793,8 @@ LoadStatus ICACHE_FLASH_ATTR loadBuffer(const uint8_t *image, int imageSize)
     connection->finalBaudRate = flashConfig.baud_rate;
     connection->resetPin = flashConfig.reset_pin;
     connection->responseSize = 0;
+    connection->fastBaudRate = flashConfig.fast_loader_baud_rate;
+    connection->loadType = ltDownloadAndRun;
 
     connection->file = NULL;
     connection->completionCB = loadCompletionCB;
@@ -495,6 +821,8 @@ LoadStatus ICACHE_FLASH_ATTR loadFile(char *fileName)
     connection->finalBaudRate = flashConfig.baud_rate;
     connection->resetPin = flashConfig.reset_pin;
     connection->responseSize = 0;
+    connection->fastBaudRate = flashConfig.fast_loader_baud_rate;
+    connection->loadType = ltDownloadAndRun;
 
     connection->completionCB = loadCompletionCB;
     startLoading(connection, NULL, fileSize);
@@ -514,6 +842,9 @@ static void ICACHE_FLASH_ATTR startLoading(PropellerConnection *connection, cons
 {
     connection->image = image;
     connection->imageSize = imageSize;
+    connection->segmentCount = 0;
+    connection->escalating = 0;
+    connection->escalated = 0;
 
     // turn off SSCP during loading
     flashConfig.sscp_enable = 0;
@@ -530,8 +861,13 @@ static void ICACHE_FLASH_ATTR startLoading(PropellerConnection *connection, cons
 
 static void ICACHE_FLASH_ATTR finishLoading(PropellerConnection *connection, LoadStatus status)
 {
-    if (connection->finalBaudRate != connection->baudRate);
-        uart0_config(connection->finalBaudRate, flashConfig.stop_bits);
+    ploadFreePacket(connection);
+    ploadFreeReadAhead(connection);
+    freeStream(connection);
+    closeFile(connection);
+    imageCacheStoreFinish(status < lsFirstError);
+    // the load may have ended at the fast baud rate and always uses one stop bit
+    uart0_config(connection->finalBaudRate, flashConfig.stop_bits);
     if (connection->completionCB)
         (*connection->completionCB)(connection, status);
     programmingCB = NULL;
@@ -540,12 +876,32 @@ static void ICACHE_FLASH_ATTR finishLoading(PropellerConnection *connection, Loa
 
 static void ICACHE_FLASH_ATTR abortLoading(PropellerConnection *connection, LoadStatus status)
 {
+    os_timer_disarm(&connection->timer);
+    ploadFreePacket(connection);
+    ploadFreeReadAhead(connection);
+    freeStream(connection);
+    closeFile(connection);
+    imageCacheStoreFinish(0);
+    // don't leave UART0 at the loader or fast baud rate
+    uart0_config(connection->finalBaudRate, flashConfig.stop_bits);
     if (connection->completionCB)
         (*connection->completionCB)(connection, status);
     programmingCB = NULL;
     connection->state = stIdle;
 }
 
+// a P2 that doesn't answer the handshake at the higher baud rate is loaded at the loader baud rate instead
+static int ICACHE_FLASH_ATTR escalationFailed(PropellerConnection *connection)
+{
+    if (!connection->escalating)
+        return 0;
+    DBG("P2: no handshake at %d baud, loading at %d\n", connection->fastBaudRate, connection->baudRate);
+    ploadFallbackBaudRate(connection);
+    armTimer(connection, RX_HANDSHAKE_TIMEOUT);
+    connection->state = stRxHandshakeStart;
+    return 1;
+}
+
 static void ICACHE_FLASH_ATTR armTimer(PropellerConnection *connection, int delay)
 {
     os_timer_disarm(&connection->timer);
@@ -558,7 +914,7 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
     int finished;
 
 #ifdef STATE_DEBUG
-    DBG("TIMER %s", stateName(connection->state));
+    DBG("TIMER %s", loadStateName(connection->state));
 #endif
 
     switch (connection->state) {
@@ -569,7 +925,7 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
 //        GPIO_OUTPUT_SET(connection->resetPin, 1);
         GPIO_DIS_OUTPUT(connection->resetPin);
         armTimer(connection, connection->st_reset_delay_2);
-        if (connection->image || connection->file) {
+        if (connection->image || connection->file || connection->stream) {
             connection->state = stTxHandshake;
             programmingCB = readCallback;
         }
@@ -585,16 +941,22 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
         break;
     case stRxHandshakeStart:
     case stRxHandshake:
-        abortLoading(connection, lsRXHandshakeTimeout);
+        if (!escalationFailed(connection))
+            abortLoading(connection, lsRXHandshakeTimeout);
         break;
     case stLoadContinue:
+        if (ploadStreamWaiting(connection)) {
+            armTimer(connection, LOAD_STREAM_POLL);
+            break;
+        }
         if (ploadLoadImageContinue(connection, ltDownloadAndRun, &finished) == 0) {
+            releaseStream(connection);
             if (finished) {
-                armTimer(connection, connection->retryDelay);
+                armTimer(connection, ploadTxDrainTime(connection));
                 connection->state = stVerifyChecksum;
             }
             else {
-                armTimer(connection, connection->st_load_segment_delay);
+                armTimer(connection, ploadSegmentDelay(connection));
                 connection->state = stLoadContinue;
             }
         }
@@ -614,22 +976,108 @@ static void ICACHE_FLASH_ATTR timerCallback(void *data)
     case stStartAck:
         abortLoading(connection, lsStartAckTImeout);
         break;
+    case stLoaderStart:
+        abortLoading(connection, lsLoaderStartTimeout);
+        break;
+    case stPacketWait:
+        sendPacket(connection);
+        break;
+    case stPacketAck:
+        if (connection->retriesRemaining > 0) {
+            --connection->retriesRemaining;
+            ploadResendPacket(connection);
+            armTimer(connection, connection->retryDelay);
+        }
+        else {
+            abortLoading(connection, lsPacketTimeout);
+        }
+        break;
     default:
         break;
     }
 
+    trackJob(connection);
+
 #ifdef STATE_DEBUG
-    DBG(" -> %s\n", stateName(connection->state));
+    DBG(" -> %s\n", loadStateName(connection->state));
 #endif
 }
 
+// send the next packet to the second-stage loader
+static void ICACHE_FLASH_ATTR sendPacket(PropellerConnection *connection)
+{
+    switch (ploadSendPacket(connection)) {
+    case 0:
+        releaseStream(connection);
+        break;
+    case 1:
+        // wait for more of a streamed image
+        armTimer(connection, LOAD_STREAM_POLL);
+        connection->state = stPacketWait;
+        return;
+    default:
+        abortLoading(connection, lsLoadImageFailed);
+        return;
+    }
+
+    // the launch packet isn't answered
+    if (connection->packetPhase == ppLaunchNow) {
+        loadStarted(connection);
+        return;
+    }
+
+    connection->retriesRemaining = PACKET_RETRIES;
+    connection->retryDelay = connection->packetPhase == ppProgramEEPROM
+                           ? EEPROM_PROGRAM_TIMEOUT + EEPROM_VERIFY_TIMEOUT
+                           : PACKET_RESPONSE_TIMEOUT;
+    armTimer(connection, connection->retryDelay);
+    connection->state = stPacketAck;
+}
+
+static void ICACHE_FLASH_ATTR packetAccepted(PropellerConnection *connection)
+{
+    LoadStatus status;
+
+    switch (ploadCheckPacketResponse(connection, &status)) {
+    case 0:
+        sendPacket(connection);
+        break;
+    case 1:
+        if (connection->retriesRemaining > 0) {
+            --connection->retriesRemaining;
+            ploadResendPacket(connection);
+            armTimer(connection, connection->retryDelay);
+        }
+        else {
+            abortLoading(connection, lsPacketFailed);
+        }
+        break;
+    default:
+        abortLoading(connection, status);
+        break;
+    }
+}
+
+// the image is running, wait for its response if one was requested
+static void ICACHE_FLASH_ATTR loadStarted(PropellerConnection *connection)
+{
+    if ((connection->bytesRemaining = connection->responseSize) > 0) {
+        connection->bytesReceived = 0;
+        armTimer(connection, connection->responseTimeout);
+        connection->state = stStartAck;
+    }
+    else {
+        finishLoading(connection, lsOK);
+    }
+}
+
 static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
 {
     PropellerConnection *connection = &myConnection;
     int cnt, finished;
 
 #ifdef STATE_DEBUG
-    DBG("READ: length %d, state %s", length, stateName(connection->state));
+    DBG("READ: length %d, state %s", length, loadStateName(connection->state));
 #endif
 
     switch (connection->state) {
@@ -655,6 +1103,8 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
         // fall through
     case stRxHandshake:
     case stStartAck:
+    case stLoaderStart:
+    case stPacketAck:
         if ((cnt = length) > connection->bytesRemaining)
             cnt = connection->bytesRemaining;
         memcpy(&connection->buffer[connection->bytesReceived], buf, cnt);
@@ -664,19 +1114,25 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
             case stRxHandshakeStart:
             case stRxHandshake:
                 if (ploadVerifyHandshakeResponse(connection) != 0) {
-                    abortLoading(connection, lsRXHandshakeFailed);
+                    if (!escalationFailed(connection))
+                        abortLoading(connection, lsRXHandshakeFailed);
                 }
                 else if (connection->version != 1) {
                     abortLoading(connection, lsWrongPropellerVersion);
                 }
+                else if (ploadEscalateBaudRate(connection)) {
+                    armTimer(connection, ESCALATE_HANDSHAKE_TIMEOUT);
+                    connection->state = stRxHandshakeStart;
+                }
                 else {
                         if (ploadLoadImage(connection, ltDownloadAndRun, &finished) == 0) {
+                            releaseStream(connection);
                             if (finished) {
-                                armTimer(connection, connection->retryDelay);
+                                armTimer(connection, ploadTxDrainTime(connection));
                                 connection->state = stVerifyChecksum;
                             }
                             else {
-                                armTimer(connection, connection->st_load_segment_delay);
+                                armTimer(connection, ploadSegmentDelay(connection));
                                 connection->state = stLoadContinue;
                             }
                         }
@@ -688,6 +1144,20 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
             case stStartAck:
                 finishLoading(connection, lsAckResponse);
                 break;
+            case stLoaderStart:
+                if (ploadVerifyLoaderStart(connection) != 0) {
+                    abortLoading(connection, lsLoaderStartFailed);
+                }
+                else {
+                    // the loader has switched to the fast baud rate
+                    uart_drain_tx_buffer(UART0);
+                    uart0_config(connection->fastBaudRate, ONE_STOP_BIT);
+                    sendPacket(connection);
+                }
+                break;
+            case stPacketAck:
+                packetAccepted(connection);
+                break;
             default:
                 break;
             }
@@ -695,15 +1165,31 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
         break;
     case stVerifyChecksum:
                    
-        if (buf[0] == 0xFE) {
-            if ((connection->bytesRemaining = connection->responseSize) > 0) {
-                connection->bytesReceived = 0;
-                armTimer(connection, connection->responseTimeout);
-                connection->state = stStartAck;
+        if (connection->escalated) {
+            // the ROM answers '?' with '.' or '!', an image it rejected at the higher rate is sent again at the loader baud rate
+            if (buf[0] == '.')
+                loadStarted(connection);
+            else if (buf[0] == '!' && ploadRestartImage(connection) == 0) {
+                DBG("P2: checksum failed at %d baud, loading at %d\n", connection->baudRate, connection->fastBaudRate);
+                ploadFallbackBaudRate(connection);
+                armTimer(connection, RX_HANDSHAKE_TIMEOUT);
+                connection->state = stRxHandshakeStart;
             }
-            else {
-                finishLoading(connection, lsOK);
+            else
+                abortLoading(connection, lsChecksumError);
+        }
+        else if (buf[0] == 0xFE) {
+            if (connection->packet) {
+                // the second-stage loader is running, it starts by sending the first packet ID
+                connection->bytesReceived = 0;
+                connection->bytesRemaining = 8;
+                armTimer(connection, LOADER_START_TIMEOUT);
+                connection->state = stLoaderStart;
+                if (length > 1)
+                    readCallback(buf + 1, length - 1);
             }
+            else
+                loadStarted(connection);
         }
         else {
             abortLoading(connection, lsChecksumError);
@@ -713,8 +1199,10 @@ static void ICACHE_FLASH_ATTR readCallback(char *buf, short length)
         break;
     }
 
+    trackJob(connection);
+
 #ifdef STATE_DEBUG
-    DBG(" -> %s\n", stateName(connection->state));
+    DBG(" -> %s\n", loadStateName(connection->state));
 #endif
 }
 
@@ -0,0 +1,223 @@
+/*
+    dnscache.c - module DNS result cache used by the SSCP connection commands
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#include <esp8266.h>
+#include "config.h"
+#include "dnscache.h"
+
+#define DNS_CACHE_NAME_MAX  64
+
+typedef struct {
+    char name[DNS_CACHE_NAME_MAX];  // empty if this entry is unused
+    ip_addr_t addr;
+    int found;                      // zero for a cached lookup failure
+    uint32 expires;                 // in dnsCacheNow seconds
+    uint32 lastUsed;
+    int used;                       // hit since it was last resolved
+    int refreshing;
+} dns_cache_entry;
+
+// a lookup in progress, the original caller is NULL for a prefetch
+typedef struct {
+    struct espconn *conn;
+    dns_found_callback found;
+    char name[DNS_CACHE_NAME_MAX];
+} dns_cache_request;
+
+int dnsCacheHits;
+int dnsCacheMisses;
+
+static dns_cache_entry *cache;
+static int cacheSize;
+static uint32 dnsCacheNow;
+static ETSTimer dnsCacheTimer;
+
+static void dnsCacheTimerCallback(void *arg);
+static void dnsFoundCallback(const char *name, ip_addr_t *ipaddr, void *arg);
+static sint8 startLookup(struct espconn *conn, const char *name, ip_addr_t *addr, dns_found_callback found);
+static void storeResult(const char *name, ip_addr_t *ipaddr, int prefetch);
+
+void ICACHE_FLASH_ATTR initDnsCache(void)
+{
+    os_timer_disarm(&dnsCacheTimer);
+    os_timer_setfn(&dnsCacheTimer, dnsCacheTimerCallback, NULL);
+    os_timer_arm(&dnsCacheTimer, 1000, 1);
+}
+
+// returns the number of entries the settings ask for, zero if the cache is disabled
+static int ICACHE_FLASH_ATTR configuredSize(void)
+{
+    int size = flashConfig.dns_cache_size;
+    if (size < 0)
+        return 0;
+    if (size == 0)
+        return DNS_CACHE_DEFAULT_SIZE;
+    return size > DNS_CACHE_MAX_SIZE ? DNS_CACHE_MAX_SIZE : size;
+}
+
+static int ICACHE_FLASH_ATTR configuredTTL(void)
+{
+    return flashConfig.dns_cache_ttl > 0 ? flashConfig.dns_cache_ttl : DNS_CACHE_DEFAULT_TTL;
+}
+
+// (re)allocate the cache when the size setting has changed, dropping its entries
+static int ICACHE_FLASH_ATTR checkCache(void)
+{
+    int size = configuredSize();
+    if (size != cacheSize) {
+        if (cache) {
+            os_free(cache);
+            cache = NULL;
+        }
+        cacheSize = 0;
+        if (size > 0) {
+            if (!(cache = (dns_cache_entry *)os_zalloc(size * sizeof(dns_cache_entry))))
+                return 0;
+            cacheSize = size;
+        }
+    }
+    return cacheSize;
+}
+
+static dns_cache_entry ICACHE_FLASH_ATTR *findEntry(const char *name)
+{
+    int i;
+    for (i = 0; i < cacheSize; ++i) {
+        if (cache[i].name[0] && os_strcmp(cache[i].name, name) == 0)
+            return &cache[i];
+    }
+    return NULL;
+}
+
+sint8 ICACHE_FLASH_ATTR dnsCacheGetHostByName(struct espconn *conn, const char *name, ip_addr_t *addr, dns_found_callback found)
+{
+    dns_cache_entry *entry;
+
+    if (!checkCache() || os_strlen(name) >= DNS_CACHE_NAME_MAX) {
+        ++dnsCacheMisses;
+        return espconn_gethostbyname(conn, name, addr, found);
+    }
+
+    if ((entry = findEntry(name)) != NULL && (int32)(entry->expires - dnsCacheNow) > 0) {
+        ++dnsCacheHits;
+        entry->lastUsed = dnsCacheNow;
+        if (!entry->found)
+            return ESPCONN_ARG;
+        entry->used = 1;
+        *addr = entry->addr;
+        return ESPCONN_OK;
+    }
+
+    ++dnsCacheMisses;
+    return startLookup(conn, name, addr, found);
+}
+
+static sint8 ICACHE_FLASH_ATTR startLookup(struct espconn *conn, const char *name, ip_addr_t *addr, dns_found_callback found)
+{
+    dns_cache_request *req;
+    sint8 result;
+
+    if (!(req = (dns_cache_request *)os_zalloc(sizeof(dns_cache_request))))
+        return conn ? espconn_gethostbyname(conn, name, addr, found) : ESPCONN_MEM;
+    req->conn = conn;
+    req->found = found;
+    os_strcpy(req->name, name);
+
+    // the espconn argument is only handed back to the callback so the request can stand in for it
+    switch (result = espconn_gethostbyname((struct espconn *)req, name, addr, dnsFoundCallback)) {
+    case ESPCONN_OK:
+        // lwIP already had the answer in its own table
+        storeResult(name, addr, !conn);
+        os_free(req);
+        break;
+    case ESPCONN_INPROGRESS:
+        // dnsFoundCallback frees the request
+        break;
+    default:
+        os_free(req);
+        break;
+    }
+
+    return result;
+}
+
+static void ICACHE_FLASH_ATTR dnsFoundCallback(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+    dns_cache_request *req = (dns_cache_request *)arg;
+
+    storeResult(req->name, ipaddr, !req->conn);
+    if (req->conn)
+        (*req->found)(name, ipaddr, req->conn);
+
+    os_free(req);
+}
+
+static void ICACHE_FLASH_ATTR storeResult(const char *name, ip_addr_t *ipaddr, int prefetch)
+{
+    dns_cache_entry *entry;
+    int i;
+
+    if (!checkCache())
+        return;
+
+    if ((entry = findEntry(name)) != NULL) {
+        entry->refreshing = 0;
+
+        // keep the old address until it expires if a refresh fails
+        if (!ipaddr && prefetch)
+            return;
+    }
+
+    else {
+        // use a free entry or replace the least recently used one
+        for (i = 0, entry = &cache[0]; i < cacheSize; ++i) {
+            if (!cache[i].name[0]) {
+                entry = &cache[i];
+                break;
+            }
+            if ((int32)(cache[i].lastUsed - entry->lastUsed) < 0)
+                entry = &cache[i];
+        }
+        os_memset(entry, 0, sizeof(dns_cache_entry));
+        os_strcpy(entry->name, name);
+        entry->lastUsed = dnsCacheNow;
+    }
+
+    if (ipaddr) {
+        entry->addr = *ipaddr;
+        entry->found = 1;
+        entry->expires = dnsCacheNow + configuredTTL();
+    }
+    else {
+        entry->found = 0;
+        entry->expires = dnsCacheNow + DNS_CACHE_NEGATIVE_TTL;
+    }
+    entry->used = 0;
+}
+
+// refresh entries that are still in use shortly before they expire
+static void ICACHE_FLASH_ATTR dnsCacheTimerCallback(void *arg)
+{
+    ip_addr_t addr;
+    int i;
+
+    ++dnsCacheNow;
+
+    if (!checkCache())
+        return;
+
+    for (i = 0; i < cacheSize; ++i) {
+        dns_cache_entry *entry = &cache[i];
+        int32 remaining = (int32)(entry->expires - dnsCacheNow);
+        if (entry->name[0] && entry->found && entry->used && !entry->refreshing
+        &&  remaining > 0 && remaining <= DNS_CACHE_PREFETCH) {
+            entry->refreshing = 1;
+            if (startLookup(NULL, entry->name, &addr, NULL) != ESPCONN_INPROGRESS)
+                entry->refreshing = 0;
+        }
+    }
+}
@@ -0,0 +1,25 @@
+/*
+    dnscache.h - definitions for the module DNS result cache
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#define DNS_CACHE_DEFAULT_SIZE  8       // used when the dns-cache-size setting is zero
+#define DNS_CACHE_MAX_SIZE      32
+#define DNS_CACHE_DEFAULT_TTL   300     // seconds, used when the dns-cache-ttl setting is zero
+#define DNS_CACHE_NEGATIVE_TTL  10      // seconds to remember a failed lookup
+#define DNS_CACHE_PREFETCH      30      // seconds before expiry to refresh an entry that is in use
+
+extern int dnsCacheHits;
+extern int dnsCacheMisses;
+
+void initDnsCache(void);
+
+// same as espconn_gethostbyname but answers from the cache when it can
+sint8 dnsCacheGetHostByName(struct espconn *conn, const char *name, ip_addr_t *addr, dns_found_callback found);
+
+#endif
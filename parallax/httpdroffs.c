@@ -21,6 +21,7 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 #include "roffs.h"
 #include "proploader.h"
 #include "cgiprop.h"
+#include "imagecache.h"
 
 #define FLASH_PREFIX    "/files/"
 
@@ -121,6 +122,7 @@ int ICACHE_FLASH_ATTR cgiRoffsFormat(HttpdConnData *connData)
     uint32_t fs_base, fs_size;
     fs_base = roffs_base_address(&fs_size);
     
+    imageCacheReset();
     if (roffs_format(fs_base) != 0) {
         httpdSendResponse(connData, 400, "Error formatting filesystem\r\n", -1);
         return HTTPD_CGI_DONE;
@@ -172,6 +174,8 @@ int ICACHE_FLASH_ATTR cgiRoffsWriteFile(HttpdConnData *connData)
     // append data to the file
     if (connData->post->buffLen > 0) {
         if (roffs_write(file, connData->post->buff, connData->post->buffLen) != connData->post->buffLen) {
+            roffs_close(file);
+            connData->cgiData = NULL;
             httpdSendResponse(connData, 400, "File write failed\r\n", -1);
             return HTTPD_CGI_DONE;
         }
@@ -0,0 +1,293 @@
+/*
+    imagecache.c - Propeller images kept in the flash filesystem under their SHA-1 so they needn't be sent again
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#include <esp8266.h>
+#include "config.h"
+#include "roffs.h"
+#include "sha1.h"
+#include "imagecache.h"
+
+#define IMAGE_CACHE_WRITE_SIZE  256     // roffs_write needs long aligned buffers, so image data is collected here
+
+typedef struct {
+    char hash[IMAGE_CACHE_HASH_SIZE + 1];   // empty if this entry is unused
+    uint32 lastUsed;
+} image_cache_entry;
+
+// an image being stored as it is loaded
+typedef struct {
+    ROFFS_FILE *file;
+    char hash[IMAGE_CACHE_HASH_SIZE + 1];
+    sha1nfo sha1;
+    uint32_t buffer[IMAGE_CACHE_WRITE_SIZE / sizeof(uint32_t)];
+    int count;
+} image_cache_store;
+
+int imageCacheHits;
+int imageCacheMisses;
+
+static image_cache_entry *cache;
+static int cacheSize;
+static uint32 imageCacheNow;
+static image_cache_store *store;
+
+static int addEntry(const char *hash);
+static void abandonStore(void);
+
+// returns the number of entries the settings ask for, zero if the cache is disabled
+static int ICACHE_FLASH_ATTR configuredSize(void)
+{
+    int size = flashConfig.image_cache_size;
+    if (size < 0)
+        return 0;
+    if (size == 0)
+        return IMAGE_CACHE_DEFAULT_SIZE;
+    return size > IMAGE_CACHE_MAX_SIZE ? IMAGE_CACHE_MAX_SIZE : size;
+}
+
+static void ICACHE_FLASH_ATTR makeFileName(const char *hash, char *fileName)
+{
+    os_strcpy(fileName, IMAGE_CACHE_PREFIX);
+    os_strcat(fileName, hash);
+}
+
+// (re)allocate the cache when the size setting has changed and fill it from the filesystem, oldest files first
+static int ICACHE_FLASH_ATTR checkCache(void)
+{
+    int size = configuredSize();
+    if (size != cacheSize) {
+        char fileName[256];
+        int fileSize, i;
+
+        if (cache) {
+            os_free(cache);
+            cache = NULL;
+        }
+        cacheSize = 0;
+        if (size > 0) {
+            if (!(cache = (image_cache_entry *)os_zalloc(size * sizeof(image_cache_entry))))
+                return 0;
+            cacheSize = size;
+
+            // files are listed in the order they were written, any beyond the cache size get evicted
+            for (i = 0; roffs_fileinfo(i, fileName, &fileSize) == 0; ++i) {
+                const char *hash = fileName + sizeof(IMAGE_CACHE_PREFIX) - 1;
+                char normalized[IMAGE_CACHE_HASH_SIZE + 1];
+                if (os_strncmp(fileName, IMAGE_CACHE_PREFIX, sizeof(IMAGE_CACHE_PREFIX) - 1) == 0
+                &&  imageCacheParseHash(hash, normalized)
+                &&  addEntry(normalized))
+                    --i;    // an earlier file was deleted
+            }
+        }
+    }
+    return cacheSize;
+}
+
+static image_cache_entry ICACHE_FLASH_ATTR *findEntry(const char *hash)
+{
+    int i;
+    for (i = 0; i < cacheSize; ++i) {
+        if (cache[i].hash[0] && os_strcmp(cache[i].hash, hash) == 0)
+            return &cache[i];
+    }
+    return NULL;
+}
+
+// find an entry whose file is still there, an entry whose file has gone is dropped
+static image_cache_entry ICACHE_FLASH_ATTR *findImage(const char *hash)
+{
+    image_cache_entry *entry;
+    char fileName[IMAGE_CACHE_NAME_MAX];
+    ROFFS_FILE *file;
+
+    if ((entry = findEntry(hash)) == NULL)
+        return NULL;
+
+    makeFileName(hash, fileName);
+    if (!(file = roffs_open(fileName))) {
+        entry->hash[0] = '\0';
+        return NULL;
+    }
+    roffs_close(file);
+
+    return entry;
+}
+
+// use a free entry or evict the least recently used image, returns non-zero if an image was evicted
+static int ICACHE_FLASH_ATTR addEntry(const char *hash)
+{
+    image_cache_entry *entry;
+    char fileName[IMAGE_CACHE_NAME_MAX];
+    int evicted = 0;
+    int i;
+
+    if ((entry = findEntry(hash)) == NULL) {
+        for (i = 0, entry = &cache[0]; i < cacheSize; ++i) {
+            if (!cache[i].hash[0]) {
+                entry = &cache[i];
+                break;
+            }
+            if ((int32)(cache[i].lastUsed - entry->lastUsed) < 0)
+                entry = &cache[i];
+        }
+        if (entry->hash[0]) {
+            makeFileName(entry->hash, fileName);
+            evicted = roffs_delete(fileName) == 0;
+        }
+        os_strcpy(entry->hash, hash);
+    }
+
+    entry->lastUsed = ++imageCacheNow;
+
+    return evicted;
+}
+
+int ICACHE_FLASH_ATTR imageCacheParseHash(const char *hash, char *normalized)
+{
+    int i;
+
+    for (i = 0; i < IMAGE_CACHE_HASH_SIZE; ++i) {
+        char ch = hash[i];
+        if (ch >= 'A' && ch <= 'F')
+            ch += 'a' - 'A';
+        if (!((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f')))
+            return 0;
+        normalized[i] = ch;
+    }
+    normalized[i] = '\0';
+
+    return hash[i] == '\0';
+}
+
+int ICACHE_FLASH_ATTR imageCacheLookup(const char *hash, char *fileName)
+{
+    image_cache_entry *entry;
+
+    if (!checkCache() || (entry = findImage(hash)) == NULL) {
+        ++imageCacheMisses;
+        return 0;
+    }
+
+    ++imageCacheHits;
+    entry->lastUsed = ++imageCacheNow;
+    makeFileName(hash, fileName);
+
+    return 1;
+}
+
+int ICACHE_FLASH_ATTR imageCacheStoreStart(const char *hash, int size)
+{
+    char fileName[IMAGE_CACHE_NAME_MAX];
+    uint32_t freeSpace, fsSize;
+
+    if (store)
+        abandonStore();
+
+    // an image that is already cached doesn't need to be stored again
+    if (!checkCache() || findImage(hash))
+        return -1;
+
+    // evicted and abandoned images keep their flash until the filesystem is formatted, so the cache
+    // stops storing before it can crowd out other files
+    if (roffs_space(&freeSpace, &fsSize) != 0
+    ||  freeSpace < size + IMAGE_CACHE_FILE_OVERHEAD + fsSize / IMAGE_CACHE_FREE_SHARE)
+        return -1;
+
+    if (!(store = (image_cache_store *)os_zalloc(sizeof(image_cache_store))))
+        return -1;
+
+    makeFileName(hash, fileName);
+    if (!(store->file = roffs_create(fileName))) {
+        os_free(store);
+        store = NULL;
+        return -1;
+    }
+    os_strcpy(store->hash, hash);
+    sha1_init(&store->sha1);
+
+    return 0;
+}
+
+void ICACHE_FLASH_ATTR imageCacheStoreData(const uint8_t *data, int size)
+{
+    if (!store)
+        return;
+
+    sha1_write(&store->sha1, (const char *)data, size);
+
+    while (size > 0) {
+        int cnt = IMAGE_CACHE_WRITE_SIZE - store->count;
+        if (cnt > size)
+            cnt = size;
+        os_memcpy((uint8_t *)store->buffer + store->count, data, cnt);
+        store->count += cnt;
+        data += cnt;
+        size -= cnt;
+
+        if (store->count == IMAGE_CACHE_WRITE_SIZE) {
+            if (roffs_write(store->file, (char *)store->buffer, store->count) != store->count) {
+                abandonStore();
+                return;
+            }
+            store->count = 0;
+        }
+    }
+}
+
+void ICACHE_FLASH_ATTR imageCacheStoreFinish(int complete)
+{
+    char hash[IMAGE_CACHE_HASH_SIZE + 1];
+    uint8_t *result;
+    int i;
+
+    if (!store)
+        return;
+
+    if (!complete
+    ||  (store->count > 0 && roffs_write(store->file, (char *)store->buffer, store->count) != store->count)) {
+        abandonStore();
+        return;
+    }
+
+    // only keep the image if it really has the hash it was stored under
+    result = sha1_result(&store->sha1);
+    for (i = 0; i < HASH_LENGTH; ++i)
+        os_sprintf(&hash[i * 2], "%02x", result[i]);
+    if (os_strcmp(hash, store->hash) != 0) {
+        abandonStore();
+        return;
+    }
+
+    roffs_close(store->file);
+    addEntry(store->hash);
+
+    os_free(store);
+    store = NULL;
+}
+
+void ICACHE_FLASH_ATTR imageCacheReset(void)
+{
+    if (store)
+        abandonStore();
+    if (cache) {
+        os_free(cache);
+        cache = NULL;
+    }
+    cacheSize = 0;
+}
+
+static void ICACHE_FLASH_ATTR abandonStore(void)
+{
+    char fileName[IMAGE_CACHE_NAME_MAX];
+
+    roffs_close(store->file);
+    makeFileName(store->hash, fileName);
+    roffs_delete(fileName);
+
+    os_free(store);
+    store = NULL;
+}
@@ -0,0 +1,36 @@
+/*
+    imagecache.h - definitions for the Propeller image cache kept in the flash filesystem
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#define IMAGE_CACHE_DEFAULT_SIZE    4       // used when the image-cache-size setting is zero
+#define IMAGE_CACHE_MAX_SIZE        16
+#define IMAGE_CACHE_HASH_SIZE       40      // SHA-1 of the image in hex
+#define IMAGE_CACHE_PREFIX          "cache/"
+#define IMAGE_CACHE_NAME_MAX        (sizeof(IMAGE_CACHE_PREFIX) + IMAGE_CACHE_HASH_SIZE)
+#define IMAGE_CACHE_FILE_OVERHEAD   64      // file header and name of a cached image in the filesystem
+#define IMAGE_CACHE_FREE_SHARE      4       // images are only stored while 1/4 of the filesystem stays free
+
+extern int imageCacheHits;
+extern int imageCacheMisses;
+
+// returns zero if hash isn't a SHA-1 in hex, otherwise stores it in lower case
+int imageCacheParseHash(const char *hash, char *normalized);
+
+// returns non-zero and the name of the file holding the image if it is in the cache
+int imageCacheLookup(const char *hash, char *fileName);
+
+// store an image under its hash while it is being loaded, the file is only kept if the hash matches at the end
+int imageCacheStoreStart(const char *hash, int size);
+void imageCacheStoreData(const uint8_t *data, int size);
+void imageCacheStoreFinish(int complete);
+
+// forget every cached image, call this before the filesystem is formatted
+void imageCacheReset(void);
+
+#endif
@@ -0,0 +1,380 @@
+/*
+    loadjobs.c - queue of Propeller load jobs so a busy loader doesn't turn requests away
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#include <esp8266.h>
+#include "cgiprop.h"
+#include "loadjobs.h"
+
+#define MAX_SENDBUFF_LEN    1024
+#define JOB_JSON_MAX        768
+
+typedef struct {
+    HttpdConnData *connData;    // NULL if this slot is unused
+    int id;
+} load_job_waiter;
+
+static LoadJob jobs[LOAD_JOB_MAX];
+static int nextJobId = 1;
+static load_job_waiter waiters[LOAD_JOB_WAITERS];
+static ETSTimer loadJobTimer;
+
+// job JSON and the responses carrying it are built here rather than on the stack, jobEnded can run deep
+// inside an httpd callback (cancel, abort, finished) where the NONOS stack has little room left
+static char jobJson[JOB_JSON_MAX + 1]; // room for the '[' or ',' of the job list
+static char sendBuff[MAX_SENDBUFF_LEN];
+
+static const char *jobStateNames[] = {
+    "queued",
+    "running",
+    "done",
+    "failed",
+    "cancelled"
+};
+
+static void runNextJob(void *data);
+static void jobEnded(LoadJob *job);
+
+static void ICACHE_FLASH_ATTR scheduleNextJob(int delay)
+{
+    os_timer_disarm(&loadJobTimer);
+    os_timer_setfn(&loadJobTimer, runNextJob, NULL);
+    os_timer_arm(&loadJobTimer, delay, 0);
+}
+
+// use a free slot or the one of the job that finished longest ago, queued and running jobs are never replaced
+LoadJob ICACHE_FLASH_ATTR *loadJobSubmit(const LoadJob *params)
+{
+    LoadJob *job = NULL;
+    int i;
+
+    for (i = 0; i < LOAD_JOB_MAX; ++i) {
+        if (!jobs[i].id) {
+            job = &jobs[i];
+            break;
+        }
+        if (jobs[i].state >= jsDone && (!job || jobs[i].id < job->id))
+            job = &jobs[i];
+    }
+    if (!job)
+        return NULL;
+
+    *job = *params;
+    job->id = nextJobId++;
+    job->state = jsQueued;
+    job->status = lsOK;
+    job->imageSize = 0;
+    job->bytesSent = 0;
+    job->loadState = stIdle;
+    job->submitted = system_get_time();
+    job->started = job->finished = 0;
+    os_memset(job->stateTime, 0, sizeof(job->stateTime));
+
+    scheduleNextJob(0);
+
+    return job;
+}
+
+LoadJob ICACHE_FLASH_ATTR *loadJobFind(int id)
+{
+    int i;
+    for (i = 0; i < LOAD_JOB_MAX; ++i) {
+        if (id > 0 && jobs[i].id == id)
+            return &jobs[i];
+    }
+    return NULL;
+}
+
+int ICACHE_FLASH_ATTR loadJobCancel(LoadJob *job)
+{
+    switch (job->state) {
+    case jsQueued:
+        job->state = jsCancelled;
+        job->status = lsCancelled;
+        job->finished = system_get_time();
+        jobEnded(job);
+        return 0;
+    case jsRunning:
+        // the loader calls loadJobFinished
+        return loadJobAbort(job);
+    default:
+        return -1;
+    }
+}
+
+// start the oldest queued job once the loader is idle
+static void ICACHE_FLASH_ATTR runNextJob(void *data)
+{
+    LoadJob *job = NULL;
+    LoadStatus status;
+    int i;
+
+    for (i = 0; i < LOAD_JOB_MAX; ++i) {
+        if (jobs[i].id && jobs[i].state == jsRunning)
+            return;
+        if (jobs[i].id && jobs[i].state == jsQueued && (!job || jobs[i].id < job->id))
+            job = &jobs[i];
+    }
+    if (!job)
+        return;
+
+    job->state = jsRunning;
+    job->started = job->stateEntered = job->lastProgress = system_get_time();
+    switch (status = loadJobFile(job)) {
+    case lsOK:
+        break;
+    case lsBusy:
+        // something other than a job is using the loader
+        job->state = jsQueued;
+        job->started = 0;
+        scheduleNextJob(LOAD_JOB_POLL);
+        break;
+    default:
+        job->state = jsFailed;
+        job->status = status;
+        job->finished = system_get_time();
+        jobEnded(job);
+        break;
+    }
+}
+
+void ICACHE_FLASH_ATTR loadJobUpdate(LoadJob *job, LoadState state, int remaining)
+{
+    uint32 now = system_get_time();
+    int changed = 0;
+
+    if (state != job->loadState) {
+        job->stateTime[job->loadState] += (now - job->stateEntered) / 1000;
+        job->loadState = state;
+        job->stateEntered = now;
+        changed = 1;
+    }
+    job->bytesSent = job->imageSize - remaining;
+
+    if (changed || (now - job->lastProgress) / 1000 >= LOAD_JOB_PROGRESS_INTERVAL) {
+        job->lastProgress = now;
+        cgiWebsockBroadcast(LOAD_JOB_PROGRESS_URL, jobJson, loadJobJson(job, jobJson, 0), WEBSOCK_FLAG_NONE);
+    }
+}
+
+void ICACHE_FLASH_ATTR loadJobFinished(LoadJob *job, LoadStatus status)
+{
+    uint32 now = system_get_time();
+
+    job->stateTime[job->loadState] += (now - job->stateEntered) / 1000;
+    job->state = status == lsCancelled ? jsCancelled : status < lsFirstError ? jsDone : jsFailed;
+    job->status = status;
+    job->finished = now;
+    if (status < lsFirstError)
+        job->bytesSent = job->imageSize;
+
+    jobEnded(job);
+
+    // this is called before the loader is idle again
+    scheduleNextJob(1);
+}
+
+// json is usually jobJson, the response is built in sendBuff
+static void ICACHE_FLASH_ATTR sendJson(HttpdConnData *connData, int code, char *json)
+{
+    httpdSetSendBuffer(connData, sendBuff, sizeof(sendBuff));
+    httpdStartResponse(connData, code);
+    httpdHeader(connData, "Content-Type", "application/json");
+    httpdHeader(connData, "Cache-Control", "no-cache");
+    httpdEndHeaders(connData);
+    httpdSend(connData, json, -1);
+    httpdFlushSendBuffer(connData);
+    httpdCgiIsDone(connData);
+}
+
+void ICACHE_FLASH_ATTR loadJobSendJson(HttpdConnData *connData, int code, LoadJob *job)
+{
+    loadJobJson(job, jobJson, 1);
+    sendJson(connData, code, jobJson);
+}
+
+// tell the websocket clients, the requests waiting for the job and whoever submitted it
+static void ICACHE_FLASH_ATTR jobEnded(LoadJob *job)
+{
+    int len, i;
+
+    len = loadJobJson(job, jobJson, 1);
+    cgiWebsockBroadcast(LOAD_JOB_PROGRESS_URL, jobJson, len, WEBSOCK_FLAG_NONE);
+
+    for (i = 0; i < LOAD_JOB_WAITERS; ++i) {
+        if (waiters[i].connData && waiters[i].id == job->id) {
+            HttpdConnData *connData = waiters[i].connData;
+            waiters[i].connData = NULL;
+            sendJson(connData, 200, jobJson);
+        }
+    }
+
+    if (job->completionCB)
+        (*job->completionCB)(job);
+}
+
+static int ICACHE_FLASH_ATTR jsonString(char *buf, const char *str)
+{
+    char *p = buf;
+    *p++ = '"';
+    while (*str) {
+        if (*str == '"' || *str == '\\')
+            *p++ = '\\';
+        *p++ = *str++;
+    }
+    *p++ = '"';
+    *p = '\0';
+    return p - buf;
+}
+
+int ICACHE_FLASH_ATTR loadJobJson(LoadJob *job, char *buf, int detail)
+{
+    uint32 end = job->state >= jsDone ? job->finished : system_get_time();
+    int queued = ((job->started ? job->started : end) - job->submitted) / 1000;
+    int elapsed = job->started ? (end - job->started) / 1000 : 0;
+    int len, i;
+
+    len = os_sprintf(buf, "{\"id\":%d,\"state\":\"%s\",\"file\":", job->id, jobStateNames[job->state]);
+    len += jsonString(buf + len, job->fileName);
+    len += os_sprintf(buf + len, ",\"p2\":%d,\"size\":%d,\"sent\":%d,\"load-state\":\"%s\",\"status\":%d,\"queued-ms\":%d,\"elapsed-ms\":%d",
+                      job->p2, job->imageSize, job->bytesSent, loadStateName(job->loadState), job->status, queued, elapsed);
+
+    if (detail) {
+        len += os_sprintf(buf + len, ",\"state-ms\":{");
+        for (i = stIdle + 1; i < stMAX; ++i)
+            len += os_sprintf(buf + len, "%s\"%s\":%d", i == stIdle + 1 ? "" : ",", loadStateName(i), job->stateTime[i]);
+        len += os_sprintf(buf + len, "}");
+    }
+
+    len += os_sprintf(buf + len, "}");
+
+    return len;
+}
+
+static int8_t ICACHE_FLASH_ATTR getIntArg(HttpdConnData *connData, char *name, int *pValue)
+{
+    char buf[16];
+    int len = httpdFindArg(connData->getArgs, name, buf, sizeof(buf));
+    if (len < 0) return 0; // not found, skip
+    *pValue = atoi(buf);
+    return 1;
+}
+
+// GET /propeller/jobs - every job that is remembered, one per call
+int ICACHE_FLASH_ATTR cgiPropJobs(HttpdConnData *connData)
+{
+    int index = (int)connData->cgiData;
+    char *buf = jobJson;
+    int len = 0;
+
+    // check for the cleanup call
+    if (connData->conn == NULL)
+        return HTTPD_CGI_DONE;
+
+    if (index == 0) {
+        httpdStartResponse(connData, 200);
+        httpdHeader(connData, "Content-Type", "application/json");
+        httpdHeader(connData, "Cache-Control", "no-cache");
+        httpdEndHeaders(connData);
+        buf[len++] = '[';
+    }
+
+    while (index < LOAD_JOB_MAX && !jobs[index].id)
+        ++index;
+
+    if (index < LOAD_JOB_MAX) {
+        if (len == 0)
+            buf[len++] = ',';
+        len += loadJobJson(&jobs[index], buf + len, 0);
+        httpdSend(connData, buf, len);
+        connData->cgiData = (void *)(index + 1);
+        return HTTPD_CGI_MORE;
+    }
+
+    buf[len++] = ']';
+    httpdSend(connData, buf, len);
+    return HTTPD_CGI_DONE;
+}
+
+// GET /propeller/job?id=n[&wait=1] - the status of a job, optionally once it has finished
+int ICACHE_FLASH_ATTR cgiPropJob(HttpdConnData *connData)
+{
+    LoadJob *job;
+    int id, wait, i;
+
+    // check for the cleanup call
+    if (connData->conn == NULL) {
+        for (i = 0; i < LOAD_JOB_WAITERS; ++i) {
+            if (waiters[i].connData == connData)
+                waiters[i].connData = NULL;
+        }
+        return HTTPD_CGI_DONE;
+    }
+
+    // still waiting
+    if (connData->cgiData)
+        return HTTPD_CGI_MORE;
+
+    if (!getIntArg(connData, "id", &id) || !(job = loadJobFind(id))) {
+        httpdSendResponse(connData, 400, "Job not found\r\n", -1);
+        return HTTPD_CGI_DONE;
+    }
+
+    if (!getIntArg(connData, "wait", &wait))
+        wait = 0;
+
+    if (wait && job->state < jsDone) {
+        for (i = 0; i < LOAD_JOB_WAITERS; ++i) {
+            if (!waiters[i].connData) {
+                waiters[i].connData = connData;
+                waiters[i].id = job->id;
+                connData->cgiData = job;
+                return HTTPD_CGI_MORE;
+            }
+        }
+    }
+
+    loadJobJson(job, jobJson, 1);
+    sendJson(connData, 200, jobJson);
+    return HTTPD_CGI_DONE;
+}
+
+// POST /propeller/cancel?id=n
+int ICACHE_FLASH_ATTR cgiPropCancel(HttpdConnData *connData)
+{
+    LoadJob *job;
+    int id;
+
+    // check for the cleanup call
+    if (connData->conn == NULL)
+        return HTTPD_CGI_DONE;
+
+    if (!getIntArg(connData, "id", &id) || !(job = loadJobFind(id))) {
+        httpdSendResponse(connData, 400, "Job not found\r\n", -1);
+        return HTTPD_CGI_DONE;
+    }
+
+    if (loadJobCancel(job) != 0) {
+        httpdSendResponse(connData, 400, "Job already finished\r\n", -1);
+        return HTTPD_CGI_DONE;
+    }
+
+    // jobEnded has used jobJson by now, so the reply is built after the cancel
+    loadJobJson(job, jobJson, 1);
+    sendJson(connData, 200, jobJson);
+    return HTTPD_CGI_DONE;
+}
+
+// progress messages are broadcast to every client, nothing is expected from them
+void ICACHE_FLASH_ATTR loadJobWebsocketConnect(Websock *ws)
+{
+    int i;
+
+    for (i = 0; i < LOAD_JOB_MAX; ++i) {
+        if (jobs[i].id && jobs[i].state == jsRunning)
+            cgiWebsocketSend(ws, jobJson, loadJobJson(&jobs[i], jobJson, 0), WEBSOCK_FLAG_NONE);
+    }
+}
@@ -0,0 +1,77 @@
+/*
+    loadjobs.h - definitions for the queue of Propeller load jobs
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#ifndef LOADJOBS_H
+#define LOADJOBS_H
+
+#include "httpd.h"
+#include "cgiwebsocket.h"
+#include "proploader.h"
+
+#define LOAD_JOB_MAX                8       // queued, running and finished jobs that are remembered
+#define LOAD_JOB_NAME_MAX           64
+#define LOAD_JOB_POLL               100     // ms between checks for an idle loader while jobs are queued
+#define LOAD_JOB_PROGRESS_INTERVAL  250     // ms between progress messages while the state doesn't change
+#define LOAD_JOB_WAITERS            4       // requests waiting for a job to finish
+#define LOAD_JOB_PROGRESS_URL       "/propeller/progress"
+
+typedef enum {
+    jsQueued,
+    jsRunning,
+    jsDone,
+    jsFailed,
+    jsCancelled
+} LoadJobState;
+
+typedef struct LoadJob LoadJob;
+
+struct LoadJob {
+    int id;                 // zero if this slot is unused
+    LoadJobState state;
+    char fileName[LOAD_JOB_NAME_MAX];
+    int p2;                 // load with the P2 loader
+    int baudRate;
+    int finalBaudRate;
+    int fastBaudRate;
+    LoadType loadType;
+    LoadStatus status;      // set when the job has finished
+    int imageSize;
+    int bytesSent;
+    LoadState loadState;
+    uint32 submitted;       // system_get_time() when the job was queued, started and finished
+    uint32 started;
+    uint32 finished;
+    uint32 stateEntered;
+    uint32 lastProgress;
+    uint32 stateTime[stMAX]; // ms spent in each load state
+    void (*completionCB)(LoadJob *job);
+    void *data;
+};
+
+// queue a copy of a job, returns NULL if the queue is full
+LoadJob *loadJobSubmit(const LoadJob *params);
+LoadJob *loadJobFind(int id);
+int loadJobCancel(LoadJob *job);
+
+// called by the loader as a job runs
+void loadJobUpdate(LoadJob *job, LoadState state, int remaining);
+void loadJobFinished(LoadJob *job, LoadStatus status);
+
+// in cgiprop.c
+LoadStatus loadJobFile(LoadJob *job);
+int loadJobAbort(LoadJob *job);
+const char *loadStateName(LoadState state);
+
+int loadJobJson(LoadJob *job, char *buf, int detail);
+void loadJobSendJson(HttpdConnData *connData, int code, LoadJob *job);
+
+int cgiPropJobs(HttpdConnData *connData);
+int cgiPropJob(HttpdConnData *connData);
+int cgiPropCancel(HttpdConnData *connData);
+void loadJobWebsocketConnect(Websock *ws);
+
+#endif
@@ -9,6 +9,7 @@
 #include <esp8266.h>
 #include "proploader.h"
 #include "uart.h"
+#include "IP_Loader.h"
 
 //#define P2LOADER_DEBUG
           
@@ -135,6 +136,24 @@ static const uint8_t programShutdownCmd[] = {
 static const uint8_t programRunCmd[] = {
     0x25, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0xfe};
 
+// The ROM loader reads longs 3 bits per byte, LSB first: each byte is %1x01x01x with the data bits in positions 0, 3
+// and 6. A long takes ten such bytes for bits 0-29 and a final one for bits 30 and 31 that also has bits 5 and 6 set.
+// This table gives the two bytes that encode each 6-bit value so a long is encoded with five lookups and one more
+// for the last byte.
+#define ENCODED_LONG_SIZE   11
+#define ENCODE_BLOCK_LONGS  16      // longs encoded at once, more than the TX FIFO ever has room for
+
+static const uint8_t txEncoding[64][2] = {
+    {0x92,0x92}, {0x93,0x92}, {0x9A,0x92}, {0x9B,0x92}, {0xD2,0x92}, {0xD3,0x92}, {0xDA,0x92}, {0xDB,0x92},
+    {0x92,0x93}, {0x93,0x93}, {0x9A,0x93}, {0x9B,0x93}, {0xD2,0x93}, {0xD3,0x93}, {0xDA,0x93}, {0xDB,0x93},
+    {0x92,0x9A}, {0x93,0x9A}, {0x9A,0x9A}, {0x9B,0x9A}, {0xD2,0x9A}, {0xD3,0x9A}, {0xDA,0x9A}, {0xDB,0x9A},
+    {0x92,0x9B}, {0x93,0x9B}, {0x9A,0x9B}, {0x9B,0x9B}, {0xD2,0x9B}, {0xD3,0x9B}, {0xDA,0x9B}, {0xDB,0x9B},
+    {0x92,0xD2}, {0x93,0xD2}, {0x9A,0xD2}, {0x9B,0xD2}, {0xD2,0xD2}, {0xD3,0xD2}, {0xDA,0xD2}, {0xDB,0xD2},
+    {0x92,0xD3}, {0x93,0xD3}, {0x9A,0xD3}, {0x9B,0xD3}, {0xD2,0xD3}, {0xD3,0xD3}, {0xDA,0xD3}, {0xDB,0xD3},
+    {0x92,0xDA}, {0x93,0xDA}, {0x9A,0xDA}, {0x9B,0xDA}, {0xD2,0xDA}, {0xD3,0xDA}, {0xDA,0xDA}, {0xDB,0xDA},
+    {0x92,0xDB}, {0x93,0xDB}, {0x9A,0xDB}, {0x9B,0xDB}, {0xD2,0xDB}, {0xD3,0xDB}, {0xDA,0xDB}, {0xDB,0xDB}
+};
+
 // The RxHandshake array consists of 125 bytes encoded to represent the expected 250-bit (125-byte @ 2 bits/byte) response
 // of continuing-LFSR stream bits from the Propeller, prompted by the timing templates following the TxHandshake stream.
 static const uint8_t rxHandshake[] = {
@@ -177,55 +196,58 @@ static const uint8_t p2_rxHandshake[] = {
     0x0d, 0x0a, 0x50, 0x72, 0x6f, 0x70, 0x5f, 0x56, 0x65, 0x72, 0x20, 0x47, 0x0d, 0x0a}; // CR+LF+"Prop_Ver G"+CR+LF
 
 
-//Base64 Stuff
-static int mod_table[] = {0, 2, 1};
-static const uint8_t encoding_table[] = { 
-    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-    'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-    'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-    'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-    'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-    'w', 'x', 'y', 'z', '0', '1', '2', '3',
-    '4', '5', '6', '7', '8', '9', '+', '/' };
+// base64 characters sent per UART write, more than the TX FIFO ever has room for
+#define P2_ENCODE_BLOCK_SIZE    128
 
-static int ICACHE_FLASH_ATTR base64_encode(const unsigned char *data, int input_length, char *encoded_data, int output_length) {
+// the longs of an image loaded with '?' have to sum to "Prop"
+#define P2_CHECKSUM_TARGET      0x706F7250
 
-    int i,j;
-    
-    if (!encoded_data) return -1;
-    
-    for (i = 0, j = 0; i < input_length;) {
+// -- P2
 
-        uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
-        uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
-        uint32_t octet_c = i < input_length ? (unsigned char)data[i++] : 0;
 
-        uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
+// Second-stage loader --
+//
+// Instead of sending the whole image through the ROM's 3-bits-per-byte encoding, the ROM is given the small loader
+// in IP_Loader.h. It reports the number of the first packet it expects and switches to the fast baud rate. The image
+// then goes as raw bytes in packets of up to P1_PACKET_MAX_SIZE, each preceded by its packet ID and a tag. Packet IDs
+// count down to zero and the loader answers every packet with the ID it expects next and the tag it was sent, after
+// which the verify RAM, program EEPROM, ready to launch and launch packets run the corresponding loader code.
 
-        encoded_data[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
+#define LOADER_INIT_OFFSET  (sizeof(rawLoaderImage) - 10 * 4 - 8)
+#define LOADER_CLOCK_SPEED  80000000
+#define MAX_RX_SENSE_ERROR  23          // maximum number of cycles by which the detection of a start bit could be off
 
-    }
+// the call frame the ROM places at the top of RAM before starting the image, it is included in the checksums
+static const uint8_t initCallFrame[] = { 0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF };
 
-    for (i = 0; i < mod_table[input_length % 3]; i++)
-        encoded_data[output_length - 1 - i] = '=';
+static void ICACHE_FLASH_ATTR setLong(uint8_t *buf, uint32_t value)
+{
+    buf[0] = value;
+    buf[1] = value >> 8;
+    buf[2] = value >> 16;
+    buf[3] = value >> 24;
+}
 
-    return 1;
+static int32_t ICACHE_FLASH_ATTR getLong(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+}
 
-};
+static int loadSecondStage(PropellerConnection *connection, int *pFinished);
 
-// -- P2
+// -- Second-stage loader
 
 
 
 static int startLoad(PropellerConnection *connection, LoadType loadType, int imageSize);
-static int encodeFile(PropellerConnection *connection, int *pFinished);
+static int nextSegment(PropellerConnection *connection);
+static int streamAvailable(PropellerConnection *connection);
+static int segmentSent(PropellerConnection *connection, int *pFinished);
+static void consumeStream(PropellerConnection *connection, int size);
 static int encodeBuffer(PropellerConnection *connection, const uint8_t *buffer, int size);
 static void finishLoad(PropellerConnection *connection);
 static void txLong(uint32_t x);
+static int encodeLongs(const uint8_t *src, int count, uint8_t *dst);
 
 int ICACHE_FLASH_ATTR ploadInitiateHandshake(PropellerConnection *connection)
 {
@@ -299,32 +321,101 @@ int ICACHE_FLASH_ATTR ploadVerifyHandshakeResponse(PropellerConnection *connecti
     return 0;
 }
 
-int ICACHE_FLASH_ATTR ploadLoadImage(PropellerConnection *connection, LoadType loadType, int *pFinished)
+// a P2 image is sent at the final baud rate when escalation is on and that is faster than the loader baud rate
+int ICACHE_FLASH_ATTR ploadP2FastBaudRate(int baudRate, int finalBaudRate, int escalate)
 {
-    if (startLoad(connection, loadType, connection->imageSize) != 0)
-        return -1;
-    return ploadLoadImageContinue(connection, loadType, pFinished);
+    return escalate && finalBaudRate > baudRate ? finalBaudRate : 0;
 }
 
-int ICACHE_FLASH_ATTR ploadLoadImageContinue(PropellerConnection *connection, LoadType loadType, int *pFinished)
+// the P2 ROM autobauds on the '>' that starts every command, so once it has answered at the loader baud rate
+// the handshake is repeated at fastBaudRate and the image follows at that rate if it answers again
+// returns non-zero if the handshake has been sent again at the higher rate
+int ICACHE_FLASH_ATTR ploadEscalateBaudRate(PropellerConnection *connection)
+{
+    if (connection->escalating) {
+        int loaderBaudRate = connection->baudRate;
+        connection->escalating = 0;
+        connection->escalated = 1;
+        connection->baudRate = connection->fastBaudRate;
+        connection->fastBaudRate = loaderBaudRate;
+        return 0;
+    }
+
+    if (connection->p2LoaderMode != dragdrop
+    ||  connection->fastBaudRate <= 0
+    ||  connection->fastBaudRate == connection->baudRate)
+        return 0;
+
+    uart_drain_tx_buffer(UART0);
+    uart0_config(connection->fastBaudRate, ONE_STOP_BIT);
+    connection->escalating = 1;
+    ploadInitiateHandshake(connection);
+
+    return 1;
+}
+
+// the P2 didn't answer at fastBaudRate or the image sent at it failed its checksum, go back to the loader baud rate
+// and load the image at that
+void ICACHE_FLASH_ATTR ploadFallbackBaudRate(PropellerConnection *connection)
+{
+    if (connection->escalated)
+        connection->baudRate = connection->fastBaudRate;
+    connection->escalating = 0;
+    connection->escalated = 0;
+    connection->fastBaudRate = 0;
+    uart_drain_tx_buffer(UART0);
+    uart0_config(connection->baudRate, ONE_STOP_BIT);
+    ploadInitiateHandshake(connection);
+}
+
+// get ready to send the image again after it failed its checksum, a stream has already been consumed so it can't be
+int ICACHE_FLASH_ATTR ploadRestartImage(PropellerConnection *connection)
 {
     if (connection->image) {
-        if (encodeBuffer(connection, connection->image, connection->imageSize) != 0)
-            return -1;
-        connection->image = NULL;
-        *pFinished = 1;
+        // an image in memory always goes as a single segment
+        connection->imageSize = connection->segmentSize;
     }
     else if (connection->file) {
-        if (encodeFile(connection, pFinished) != 0)
+        ploadFreeReadAhead(connection);
+        if (roffs_rewind(connection->file) != 0)
             return -1;
-        if (*pFinished) {
-            roffs_close(connection->file);
-            connection->file = NULL;
-        }
+        connection->imageSize = roffs_file_size(connection->file);
     }
     else
         return -1;
 
+    connection->segmentCount = 0;
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR ploadLoadImage(PropellerConnection *connection, LoadType loadType, int *pFinished)
+{
+    if (connection->p2LoaderMode != dragdrop && connection->fastBaudRate > 0)
+        return loadSecondStage(connection, pFinished);
+    if (startLoad(connection, loadType, connection->imageSize) != 0)
+        return -1;
+    return ploadLoadImageContinue(connection, loadType, pFinished);
+}
+
+// the current segment is sent a FIFO's worth at a time, the caller comes back after ploadSegmentDelay for more
+int ICACHE_FLASH_ATTR ploadLoadImageContinue(PropellerConnection *connection, LoadType loadType, int *pFinished)
+{
+    int size;
+
+    *pFinished = 0;
+
+    if (connection->segmentCount == 0 && nextSegment(connection) != 0)
+        return -1;
+
+    if ((size = encodeBuffer(connection, connection->segment, connection->segmentCount)) < 0)
+        return -1;
+    connection->segment += size;
+    if ((connection->segmentCount -= size) > 0)
+        return 0;
+
+    if (segmentSent(connection, pFinished) != 0)
+        return -1;
+
     if (*pFinished)
         finishLoad(connection);
 
@@ -357,7 +448,9 @@ static int ICACHE_FLASH_ATTR startLoad(PropellerConnection *connection, LoadType
             }
             
             if (loadType != ltShutdown) {
-                connection->encodedSize = 0;
+                base64_stream_init(&connection->base64);
+                connection->checksum = 0;
+                connection->checksumBytes = 0;
             }
 
 
@@ -387,7 +480,6 @@ static int ICACHE_FLASH_ATTR startLoad(PropellerConnection *connection, LoadType
             
             if (loadType != ltShutdown) {
                 txLong(imageSize / 4);
-                connection->encodedSize = 0;
             }
 
 
@@ -398,35 +490,130 @@ static int ICACHE_FLASH_ATTR startLoad(PropellerConnection *connection, LoadType
     return 0;
 }
 
-static int ICACHE_FLASH_ATTR encodeFile(PropellerConnection *connection, int *pFinished)
+static int ICACHE_FLASH_ATTR readSegment(PropellerConnection *connection)
 {
-    uint8_t buffer[connection->st_load_segment_max_size];
     int readSize;
 
-    if ((readSize = connection->imageSize) <= 0) {
-        *pFinished = 1;
-        return 0;
-    }
+    if ((readSize = connection->imageSize) > connection->st_load_segment_max_size)
+        readSize = connection->st_load_segment_max_size;
 
-    if (readSize > sizeof(buffer))
-        readSize = sizeof(buffer);
-
-    if (roffs_read(connection->file, (char *)buffer, readSize) != readSize)
+    if (roffs_read(connection->file, (char *)connection->readAhead, readSize) != readSize)
         return -1;
 
-    if (encodeBuffer(connection, buffer, readSize) != 0)
+    return readSize;
+}
+
+// pick the next part of the image to send
+static int ICACHE_FLASH_ATTR nextSegment(PropellerConnection *connection)
+{
+    int size;
+
+    if (connection->image) {
+        connection->segment = connection->image;
+        size = connection->imageSize;
+    }
+    else if (connection->file) {
+        if (!connection->readAhead) {
+            if (!(connection->readAhead = (uint8_t *)os_malloc(connection->st_load_segment_max_size)))
+                return -1;
+            if ((connection->readAheadCount = readSegment(connection)) < 0)
+                return -1;
+        }
+        connection->segment = connection->readAhead;
+        size = connection->readAheadCount;
+    }
+    else if (connection->stream) {
+        connection->segment = connection->stream;
+        size = streamAvailable(connection);
+    }
+    else
         return -1;
 
-    if ((connection->imageSize -= readSize) == 0)
+    connection->segmentCount = connection->segmentSize = size;
+    return 0;
+}
+
+// the next segment of a file is read from flash right after the last of the current one is queued, while the UART is
+// still sending it
+static int ICACHE_FLASH_ATTR segmentSent(PropellerConnection *connection, int *pFinished)
+{
+    // the second-stage loader is sent from the packet buffer, the image follows in packets once it is running
+    if (connection->packet) {
         *pFinished = 1;
-    else
-        *pFinished = 0;
+        return 0;
+    }
+
+    connection->imageSize -= connection->segmentSize;
+
+    // the image and file are kept until the load ends in case a P2 asks for them again with '!'
+    if (connection->image)
+        *pFinished = 1;
+    else if (connection->file) {
+        if (connection->imageSize == 0) {
+            ploadFreeReadAhead(connection);
+            *pFinished = 1;
+        }
+        else if ((connection->readAheadCount = readSegment(connection)) < 0)
+            return -1;
+    }
+    else {
+        consumeStream(connection, connection->segmentSize);
+        *pFinished = connection->imageSize == 0;
+    }
 
     return 0;
 }
 
+// milliseconds until the TX FIFO runs dry, rounded down so the next write is queued just before it does
+int ICACHE_FLASH_ATTR ploadTxDrainTime(PropellerConnection *connection)
+{
+    return uart_tx_fifo_count(UART0) * 10 * 1000 / connection->baudRate;
+}
+
+// each call to ploadLoadImageContinue fills the FIFO, so more is due when that has gone out
+int ICACHE_FLASH_ATTR ploadSegmentDelay(PropellerConnection *connection)
+{
+    int delay = ploadTxDrainTime(connection);
+    if (delay > connection->st_load_segment_delay)
+        delay = connection->st_load_segment_delay;
+    return delay;
+}
+
+void ICACHE_FLASH_ATTR ploadFreeReadAhead(PropellerConnection *connection)
+{
+    if (connection->readAhead) {
+        os_free(connection->readAhead);
+        connection->readAhead = NULL;
+    }
+}
+
+// the P1 encoder needs whole longs except at the end of the image, the P2 base64 encoder carries partial groups itself
+static int ICACHE_FLASH_ATTR streamAvailable(PropellerConnection *connection)
+{
+    int unit = connection->p2LoaderMode == dragdrop ? 1 : 4;
+    int size = connection->streamCount;
+    if (size > connection->st_load_segment_max_size)
+        size = connection->st_load_segment_max_size;
+    if (size < connection->imageSize)
+        size -= size % unit;
+    return size;
+}
+
+int ICACHE_FLASH_ATTR ploadStreamWaiting(PropellerConnection *connection)
+{
+    return connection->segmentCount == 0 && connection->stream && connection->imageSize > 0 && streamAvailable(connection) == 0;
+}
+
+static void ICACHE_FLASH_ATTR consumeStream(PropellerConnection *connection, int size)
+{
+    connection->streamCount -= size;
+    memmove(connection->stream, connection->stream + size, connection->streamCount);
+}
+
+// encode as much of buffer as the TX FIFO has room for, returns the number of bytes used
 static int ICACHE_FLASH_ATTR encodeBuffer(PropellerConnection *connection, const uint8_t *buffer, int size)
 {
+    int room = uart_tx_fifo_room(UART0);
 
     if (connection->p2LoaderMode == dragdrop) { // P2
         
@@ -434,54 +621,74 @@ static int ICACHE_FLASH_ATTR encodeBuffer(PropellerConnection *connection, const
             httpd_printf("P2: encodeBuffer\n");
         #endif
         
-        int enclen = 4 * ((size + 2) / 3);
-        char *enc = (char*)malloc(enclen);
-        
-        
-        if (!base64_encode(buffer, size, enc, enclen))
+        // leave room for the up to two bytes the encoder kept from the last call
+        char encoded[P2_ENCODE_BLOCK_SIZE];
+        int blockSize = room / 4 * 3 - 2;
+        int encodedCount;
+        if (blockSize <= 0)
+            return 0;
+        if (blockSize > size)
+            blockSize = size;
+        if ((encodedCount = base64_stream_encode(&connection->base64, blockSize, buffer, sizeof(encoded), encoded)) < 0)
             return -1;
-        
-        
-        for (int di = 0; di < enclen; di++)
-        {       
-            if (enc[di] != 0x3D) // Don't transmit = sign 
-            { 
-                uart_tx_one_char(UART0, enc[di]);
-                connection->encodedSize += 1;
-            }
-                
-             
+
+        // an image sent at the escalated baud rate is checked by the ROM, sum it as little-endian longs
+        if (connection->escalated) {
+            int i;
+            for (i = 0; i < blockSize; ++i, ++connection->checksumBytes)
+                connection->checksum += (uint32_t)buffer[i] << (8 * (connection->checksumBytes & 3));
         }
-            
-        free(enc);
-        
-           
+
+        uart_tx_buffer(UART0, encoded, (uint16_t)encodedCount);
+        return blockSize;
+
     } else { // P1 
         
         #ifdef P2LOADER_DEBUG
             httpd_printf("P1: encodeBuffer\n");
         #endif
     
-        uint32_t *p = (uint32_t *)buffer;
-        while ((size -= sizeof(uint32_t)) >= 0) {
-            txLong(*p++);
-            connection->encodedSize += sizeof(uint32_t);
-        }
+        uint8_t encoded[ENCODE_BLOCK_LONGS * ENCODED_LONG_SIZE];
+        int longs = size / sizeof(uint32_t);
+        int count = room / ENCODED_LONG_SIZE;
+        if (count > longs)
+            count = longs;
+        uart_tx_buffer(UART0, (char *)encoded, (uint16_t)encodeLongs(buffer, count, encoded));
+
+        // a partial long at the end of the image is dropped
+        return count == longs ? size : count * sizeof(uint32_t);
 
     }
-    return 0;
 }
 
 static void ICACHE_FLASH_ATTR finishLoad(PropellerConnection *connection)
 {
-    int tmp = (connection->encodedSize * 10 * 1000) / connection->baudRate;
-    connection->retriesRemaining = (tmp + 250) / CALIBRATE_DELAY;
+    // everything but the FIFO has already been sent, so only its drain time is added to the time the Propeller gets to answer
+    connection->retriesRemaining = (ploadTxDrainTime(connection) + RX_CHECKSUM_TIMEOUT) / CALIBRATE_DELAY + 1;
     connection->retryDelay = CALIBRATE_DELAY;
 
     if (connection->p2LoaderMode == dragdrop) { // P2
     
+        // an escalated load is padded to a long and followed by the long that brings the sum of all of them to "Prop"
+        char encoded[16];
+        int encodedCount = 0;
+        if (connection->escalated) {
+            uint8_t tail[3 + sizeof(uint32_t)];
+            int tailSize = (4 - (connection->checksumBytes & 3)) & 3;
+            memset(tail, 0, tailSize);
+            setLong(&tail[tailSize], P2_CHECKSUM_TARGET - (uint32_t)connection->checksum);
+            tailSize += sizeof(uint32_t);
+            encodedCount = base64_stream_encode(&connection->base64, tailSize, tail, sizeof(encoded), encoded);
+        }
+
+        // the P2 loader doesn't need the '=' padding
+        if (encodedCount >= 0)
+            encodedCount += base64_stream_finish(&connection->base64, 0, sizeof(encoded) - encodedCount, encoded + encodedCount);
+        if (encodedCount > 0)
+            uart_tx_buffer(UART0, encoded, (uint16_t)encodedCount);
+
         uart_tx_one_char(UART0, 0x20);
-        uart_tx_one_char(UART0, 0x7e); // Send tilde for P2 code load without checksum
+        uart_tx_one_char(UART0, connection->escalated ? 0x3f : 0x7e); // '?' has the ROM verify the checksum, '~' loads without one
         uart_tx_one_char(UART0, 0x0d);
         
         #ifdef P2LOADER_DEBUG
@@ -500,15 +707,212 @@ static void ICACHE_FLASH_ATTR finishLoad(PropellerConnection *connection)
 
 static void ICACHE_FLASH_ATTR txLong(uint32_t x)
 {
-    int i;
-    for (i = 0; i < 11; ++i) {
-        uart_tx_one_char(UART0, 0x92 
-                              | (i == 10 ? 0x60 : 0x00)
-                              |  (x & 1)
-                              | ((x & 2) << 2)
-                              | ((x & 4) << 4));
-        x >>= 3;
+    uint8_t buf[4], encoded[ENCODED_LONG_SIZE];
+    buf[0] = x;
+    buf[1] = x >> 8;
+    buf[2] = x >> 16;
+    buf[3] = x >> 24;
+    uart_tx_buffer(UART0, (char *)encoded, (uint16_t)encodeLongs(buf, 1, encoded));
+}
+
+// encode little-endian longs for the ROM loader, returns the number of bytes written to dst
+static int ICACHE_FLASH_ATTR encodeLongs(const uint8_t *src, int count, uint8_t *dst)
+{
+    uint8_t *start = dst;
+    while (--count >= 0) {
+        uint32_t x = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+        int i;
+        for (i = 0; i < 5; ++i) {
+            const uint8_t *pair = txEncoding[x & 0x3F];
+            *dst++ = pair[0];
+            *dst++ = pair[1];
+            x >>= 6;
+        }
+        *dst++ = txEncoding[x][0] | 0x60;
+        src += sizeof(uint32_t);
     }
+    return dst - start;
 }
 
+static int ICACHE_FLASH_ATTR loadSecondStage(PropellerConnection *connection, int *pFinished)
+{
+    uint8_t *loader;
+    int checksum, i;
 
+    // the loader is patched and sent from the packet buffer, which isn't needed until the loader is running
+    if (!(connection->packet = (uint8_t *)os_malloc(8 + P1_PACKET_MAX_SIZE)))
+        return -1;
+    loader = connection->packet;
+
+    connection->packetId = (connection->imageSize + P1_PACKET_MAX_SIZE - 1) / P1_PACKET_MAX_SIZE;
+    connection->packetPhase = ppImage;
+    connection->checksum = 0;
+    if (connection->packetId == 0) {
+        connection->packetPhase = ppVerifyRAM;
+        for (i = 0; i < sizeof(initCallFrame); ++i)
+            connection->checksum += initCallFrame[i];
+    }
+
+    // patch the loader with the bit timing of both baud rates and the number of packets to expect
+    memcpy(loader, rawLoaderImage, sizeof(rawLoaderImage));
+    setLong(&loader[LOADER_INIT_OFFSET +  4], (LOADER_CLOCK_SPEED + connection->baudRate / 2) / connection->baudRate);
+    setLong(&loader[LOADER_INIT_OFFSET +  8], (LOADER_CLOCK_SPEED + connection->fastBaudRate / 2) / connection->fastBaudRate);
+    setLong(&loader[LOADER_INIT_OFFSET + 12], (3 * LOADER_CLOCK_SPEED + connection->fastBaudRate) / (2 * connection->fastBaudRate) - MAX_RX_SENSE_ERROR);
+    setLong(&loader[LOADER_INIT_OFFSET + 36], connection->packetId);
+
+    // make the low byte of the checksum zero again
+    loader[5] = 0;
+    checksum = 0;
+    for (i = 0; i < sizeof(rawLoaderImage); ++i)
+        checksum += loader[i];
+    for (i = 0; i < sizeof(initCallFrame); ++i)
+        checksum += initCallFrame[i];
+    loader[5] = 256 - (checksum & 0xFF);
+
+    if (startLoad(connection, ltDownloadAndRun, sizeof(rawLoaderImage)) != 0) {
+        ploadFreePacket(connection);
+        return -1;
+    }
+
+    connection->segment = loader;
+    connection->segmentCount = connection->segmentSize = sizeof(rawLoaderImage);
+
+    return ploadLoadImageContinue(connection, ltDownloadAndRun, pFinished);
+}
+
+int ICACHE_FLASH_ATTR ploadVerifyLoaderStart(PropellerConnection *connection)
+{
+    // the loader announces the first packet ID it expects
+    return getLong(connection->buffer) == connection->packetId ? 0 : -1;
+}
+
+// send the packet for the current phase, returns 1 if a streamed image hasn't supplied enough data yet
+int ICACHE_FLASH_ATTR ploadSendPacket(PropellerConnection *connection)
+{
+    uint8_t *payload = &connection->packet[8];
+    const uint8_t *code;
+    int size, i;
+
+    switch (connection->packetPhase) {
+    case ppImage:
+        if ((size = connection->imageSize) > P1_PACKET_MAX_SIZE)
+            size = P1_PACKET_MAX_SIZE;
+        if (connection->file) {
+            if (roffs_read(connection->file, (char *)payload, size) != size)
+                return -1;
+        }
+        else if (connection->stream) {
+            if (connection->streamCount < size)
+                return 1;
+            memcpy(payload, connection->stream, size);
+            consumeStream(connection, size);
+        }
+        else {
+            memcpy(payload, connection->image, size);
+            connection->image += size;
+        }
+        connection->imageSize -= size;
+        for (i = 0; i < size; ++i)
+            connection->checksum += payload[i];
+        if (connection->imageSize == 0) {
+            for (i = 0; i < sizeof(initCallFrame); ++i)
+                connection->checksum += initCallFrame[i];
+        }
+        code = NULL;
+        break;
+    case ppVerifyRAM:
+        code = verifyRAM;
+        size = sizeof(verifyRAM);
+        break;
+    case ppProgramEEPROM:
+        code = programVerifyEEPROM;
+        size = sizeof(programVerifyEEPROM);
+        break;
+    case ppReadyToLaunch:
+        code = readyToLaunch;
+        size = sizeof(readyToLaunch);
+        break;
+    case ppLaunchNow:
+        code = launchNow;
+        size = sizeof(launchNow);
+        break;
+    default:
+        return -1;
+    }
+
+    if (code)
+        memcpy(payload, code, size);
+    setLong(&connection->packet[0], connection->packetId);
+    connection->packetSize = 8 + size;
+
+    return ploadResendPacket(connection);
+}
+
+// send the current packet again under a new tag
+int ICACHE_FLASH_ATTR ploadResendPacket(PropellerConnection *connection)
+{
+    connection->packetTag = (int32_t)os_random();
+    setLong(&connection->packet[4], connection->packetTag);
+    uart_tx_buffer(UART0, (char *)connection->packet, (uint16_t)connection->packetSize);
+    connection->bytesReceived = 0;
+    connection->bytesRemaining = 8;
+    return 0;
+}
+
+// check the loader's answer to the current packet and move on to the next phase
+// returns 0 if the packet was accepted, 1 if it should be sent again and -1 on failure
+int ICACHE_FLASH_ATTR ploadCheckPacketResponse(PropellerConnection *connection, LoadStatus *pStatus)
+{
+    int32_t result = getLong(&connection->buffer[0]);
+
+    if (getLong(&connection->buffer[4]) != connection->packetTag || result == connection->packetId)
+        return 1;
+
+    switch (connection->packetPhase) {
+    case ppImage:
+        if (result != connection->packetId - 1) {
+            *pStatus = lsPacketFailed;
+            return -1;
+        }
+        if (--connection->packetId == 0)
+            connection->packetPhase = ppVerifyRAM;
+        break;
+    case ppVerifyRAM:
+        if (result != -connection->checksum) {
+            *pStatus = lsRAMVerifyFailed;
+            return -1;
+        }
+        connection->packetId = -connection->checksum;
+        connection->packetPhase = connection->loadType & ltDownloadAndProgram ? ppProgramEEPROM : ppReadyToLaunch;
+        break;
+    case ppProgramEEPROM:
+        if (result != -connection->checksum * 2) {
+            *pStatus = lsEEPROMVerifyFailed;
+            return -1;
+        }
+        connection->packetId = -connection->checksum * 2;
+        connection->packetPhase = ppReadyToLaunch;
+        break;
+    case ppReadyToLaunch:
+        if (result != connection->packetId - 1) {
+            *pStatus = lsPacketFailed;
+            return -1;
+        }
+        --connection->packetId;
+        connection->packetPhase = ppLaunchNow;
+        break;
+    default:
+        *pStatus = lsPacketFailed;
+        return -1;
+    }
+
+    return 0;
+}
+
+void ICACHE_FLASH_ATTR ploadFreePacket(PropellerConnection *connection)
+{
+    if (connection->packet) {
+        os_free(connection->packet);
+        connection->packet = NULL;
+    }
+}
@@ -12,6 +12,7 @@
 #include "os_type.h"
 #include "httpd.h"
 #include "roffs.h"
+#include "base64.h"
 
 //#define PROP_DBG
 
@@ -37,6 +38,9 @@ typedef enum {
 /* 5 */    stLoadContinue,
 /* 6 */    stVerifyChecksum,
 /* 7 */    stStartAck, 
+/* 8 */    stLoaderStart,
+/* 9 */    stPacketAck,
+/* 10 */   stPacketWait,
            stMAX
 } LoadState;
 
@@ -52,9 +56,26 @@ typedef enum {
     lsRXHandshakeFailed,
     lsWrongPropellerVersion,
     lsLoadImageFailed,
-    lsChecksumError
+    lsChecksumError,
+    lsLoaderStartTimeout,
+    lsLoaderStartFailed,
+    lsPacketTimeout,
+    lsPacketFailed,
+    lsRAMVerifyFailed,
+    lsEEPROMVerifyFailed,
+    lsStreamOverrun,
+    lsCancelled
 } LoadStatus;
 
+// what the next packet sent to the second-stage loader contains
+typedef enum {
+    ppImage,
+    ppVerifyRAM,
+    ppProgramEEPROM,
+    ppReadyToLaunch,
+    ppLaunchNow
+} PacketPhase;
+
 
 typedef enum {
 /* 0 */    ddoff,
@@ -75,8 +96,16 @@ struct PropellerConnection {
     LoadType loadType;
     ROFFS_FILE *file;       // this is set for loading a file
     const uint8_t *image;   // this is set for loading an image in memory
+    uint8_t *stream;        // this is set for loading an image as it arrives, holds data not yet sent
+    int streamCount;
+    int streamHeld;         // receiving is held until the stream drains
+    uint8_t *readAhead;     // next segment of a file load, read while the previous one is sent
+    int readAheadCount;
+    const uint8_t *segment; // part of the image being sent, a FIFO's worth at a time
+    int segmentCount;       // bytes of it not yet sent
+    int segmentSize;
     int imageSize;
-    int encodedSize;
+    Base64Stream base64;    // P2 bytes not yet sent because they don't make up a whole base64 group
     LoadState state;
     int retriesRemaining;
     int retryDelay;
@@ -88,6 +117,16 @@ struct PropellerConnection {
     int st_load_segment_delay;
     int st_load_segment_max_size;
     int st_reset_delay_2;
+    int fastBaudRate;       // non-zero to load through the second-stage loader at this baud rate, or a P2 image after the handshake
+    int escalating;         // the P2 handshake is being repeated at fastBaudRate
+    int escalated;          // the P2 answered at the higher rate, fastBaudRate holds the loader baud rate to fall back to
+    uint8_t *packet;        // second-stage packet being sent, kept for retries
+    int packetSize;
+    int packetId;
+    int32_t packetTag;
+    int32_t checksum;
+    int checksumBytes;      // P2 image bytes added to checksum so far
+    PacketPhase packetPhase;
     void (*completionCB)(PropellerConnection *connection, LoadStatus status);
 };
 
@@ -103,17 +142,40 @@ struct PropellerConnection {
 #define CALIBRATE_DELAY                 10
 
 #define RX_HANDSHAKE_TIMEOUT            2000
+#define ESCALATE_HANDSHAKE_TIMEOUT      100
 #define RX_CHECKSUM_TIMEOUT             250
 #define EEPROM_PROGRAM_TIMEOUT          5000
 #define EEPROM_VERIFY_TIMEOUT           2000
+#define LOADER_START_TIMEOUT            2000
+#define PACKET_RESPONSE_TIMEOUT         2000
+#define PACKET_RETRIES                  3       // retransmissions after the first send of a packet
+
+// an image arriving in a POST body is buffered here, the TCP window is closed above LOAD_STREAM_HOLD bytes
+// and the buffer leaves room for a full window to arrive after that
+#define LOAD_STREAM_SIZE                8192
+#define LOAD_STREAM_HOLD                2048
+#define LOAD_STREAM_POLL                10
 
 LoadStatus loadBuffer(const uint8_t *image, int imageSize);
 LoadStatus loadFile(char *fileName);
 
 int ploadInitiateHandshake(PropellerConnection *connection);
 int ploadVerifyHandshakeResponse(PropellerConnection *connection);
+int ploadP2FastBaudRate(int baudRate, int finalBaudRate, int escalate);
+int ploadEscalateBaudRate(PropellerConnection *connection);
+void ploadFallbackBaudRate(PropellerConnection *connection);
+int ploadRestartImage(PropellerConnection *connection);
 int ploadLoadImage(PropellerConnection *connection, LoadType loadType, int *pFinished);
 int ploadLoadImageContinue(PropellerConnection *connection, LoadType loadType, int *pFinished);
+int ploadStreamWaiting(PropellerConnection *connection);
+int ploadVerifyLoaderStart(PropellerConnection *connection);
+int ploadSendPacket(PropellerConnection *connection);
+int ploadResendPacket(PropellerConnection *connection);
+int ploadCheckPacketResponse(PropellerConnection *connection, LoadStatus *pStatus);
+void ploadFreePacket(PropellerConnection *connection);
+int ploadTxDrainTime(PropellerConnection *connection);
+int ploadSegmentDelay(PropellerConnection *connection);
+void ploadFreeReadAhead(PropellerConnection *connection);
 
 void httpdSendResponse(HttpdConnData *connData, int code, char *message, int len);
 
@@ -121,6 +183,7 @@ void httpdSendResponse(HttpdConnData *connData, int code, char *message, int len
 #define P1_RESET_DELAY_2                   100
 #define P1_LOAD_SEGMENT_DELAY              50
 #define P1_LOAD_SEGMENT_MAX_SIZE           1024
+#define P1_PACKET_MAX_SIZE                 1392 // largest payload the second-stage loader accepts
 
 
 // P2
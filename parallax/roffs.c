@@ -56,6 +56,9 @@ static uint32_t fsData = BAD_FILESYSTEM_BASE;
 static uint32_t fsSize = 0;
 static uint32_t fsTop = 0;
 
+// header of the file being written, it has no terminator behind it until it is closed
+static uint32_t writing = NOT_FOUND;
+
 static int readFlash(uint32_t addr, void *buf, int size);
 static int writeFlash(uint32_t addr, void *buf, int size);
 static int updateFlash(uint32_t addr, void *buf, int size);
@@ -358,6 +361,8 @@ int ICACHE_FLASH_ATTR roffs_close(ROFFS_FILE *file)
     if (file->flags & FLAG_LASTFILE) {
 	    RoFsHeader h;
 	    
+        writing = NOT_FOUND;
+
         if (readFlash(file->header, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
 DBG("close: error reading new file header\n");
             return -1;
@@ -416,6 +421,14 @@ int ICACHE_FLASH_ATTR roffs_read(ROFFS_FILE *file, char *buf, int len)
 	return len;
 }
 
+int ICACHE_FLASH_ATTR roffs_rewind(ROFFS_FILE *file)
+{
+    if (!file)
+        return -1;
+    file->offset = 0;
+    return 0;
+}
+
 static int ICACHE_FLASH_ATTR find_file_and_insertion_point(const char *fileName, uint32_t *pFileOffset, uint32_t *pInsertionOffset)
 {
     uint32_t p = fsData;
@@ -457,6 +470,13 @@ DBG("find: %08x insertion point\n", p);
             return 0;
         }
 
+		// the file being written ends the filesystem until it is closed
+		else if ((h.flags & FLAG_PENDING) && p == writing) {
+DBG("find: %08x file being written\n", p);
+            *pInsertionOffset = p;
+            return 0;
+		}
+
 		// remove a leftover pending file
 		else if (h.flags & FLAG_PENDING) {
 		    uint32_t pending = p;
@@ -523,6 +543,12 @@ ROFFS_FILE ICACHE_FLASH_ATTR *roffs_create(const char *fileName)
 	ROFFS_FILE *file;
 	RoFsHeader h;
 
+    // files are appended at the end, so only one can be written at a time
+    if (writing != NOT_FOUND) {
+DBG("create: another file is being written\n");
+        return NULL;
+    }
+
     if (find_file_and_insertion_point(fileName, &fileOffset, &insertionOffset) != 0) {
 DBG("create: can't find insertion point\n");
         return NULL;
@@ -577,6 +603,7 @@ DBG("create: error reading new file name\n");
         return NULL;
     }
     
+    writing = insertionOffset;
     return file;
 }
 
@@ -596,6 +623,53 @@ DBG("write: error writing to file\n");
     return len;
 }
 
+// free space is what is left behind the last file, deleted files aren't recovered until the filesystem is formatted
+int ICACHE_FLASH_ATTR roffs_space(uint32_t *pFree, uint32_t *pSize)
+{
+    uint32_t fileOffset, insertionOffset, used;
+
+    if (find_file_and_insertion_point("", &fileOffset, &insertionOffset) != 0) {
+DBG("space: can't find insertion point\n");
+        return -1;
+    }
+
+    // a new file needs its own header and the terminator behind it
+    used = insertionOffset + 2 * sizeof(RoFsHeader);
+    *pFree = used < fsTop ? fsTop - used : 0;
+    *pSize = fsSize;
+
+    return 0;
+}
+
+// the space used by a deleted file is only recovered when the filesystem is formatted
+int ICACHE_FLASH_ATTR roffs_delete(const char *fileName)
+{
+    uint32_t fileOffset, insertionOffset;
+	RoFsHeader h;
+
+    if (find_file_and_insertion_point(fileName, &fileOffset, &insertionOffset) != 0) {
+DBG("delete: can't find insertion point\n");
+        return -1;
+    }
+
+    if (fileOffset == NOT_FOUND) {
+DBG("delete: file not found\n");
+        return -1;
+    }
+
+    if (readFlash(fileOffset, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+DBG("delete: error reading file header\n");
+        return -1;
+    }
+    h.flags &= ~FLAG_ACTIVE;
+    if (updateFlash(fileOffset, (uint32 *)&h, sizeof(RoFsHeader)) != SPI_FLASH_RESULT_OK) {
+DBG("delete: error writing file header\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int ICACHE_FLASH_ATTR readFlash(uint32_t addr, void *buf, int size)
 {
     size = (size + 3) & ~3;
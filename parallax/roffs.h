@@ -37,10 +37,13 @@ ROFFS_FILE *roffs_open(const char *fileName);
 int roffs_file_size(ROFFS_FILE *file);
 int roffs_file_flags(ROFFS_FILE *file);
 int roffs_read(ROFFS_FILE *file, char *buf, int len);
+int roffs_rewind(ROFFS_FILE *file);
 int roffs_close(ROFFS_FILE *file);
 
 ROFFS_FILE *roffs_create(const char *fileName);
 int roffs_write(ROFFS_FILE *file, char *buf, int len);
+int roffs_delete(const char *fileName);
+int roffs_space(uint32_t *pFree, uint32_t *pSize);
 
 #endif
 
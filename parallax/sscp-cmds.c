@@ -64,14 +64,29 @@ static sscp_dispatch listenerDispatch = {
     .close = NULL
 };
 
+// only used by sscp_reset, CLOSE calls tcp_close_listener itself so it can report a failure
+static void ICACHE_FLASH_ATTR tcp_listener_close_handler(sscp_hdr *hdr)
+{
+    tcp_close_listener((sscp_listener *)hdr);
+}
+
+static sscp_dispatch tcpListenerDispatch = {
+    .checkForEvents = NULL,
+    .path = path_handler,
+    .send = NULL,
+    .recv = NULL,
+    .close = tcp_listener_close_handler
+};
+
 // LISTEN,proto,chan
+// LISTEN,TCP,port[,backlog[,options]]
 void ICACHE_FLASH_ATTR cmds_do_listen(int argc, char *argv[])
 {
     sscp_listener *listener;
     char *proto;
-    int type;
+    int type, port, err;
     
-    if (argc != 3) {
+    if (argc < 3 || argc > 5 || (argc > 3 && os_strcmp(argv[1], "TCP") != 0)) {
         sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
         return;
     }
@@ -97,11 +112,25 @@ void ICACHE_FLASH_ATTR cmds_do_listen(int argc, char *argv[])
         return;
     }
 
-    if (!(listener = sscp_allocate_listener(type, argv[2], &listenerDispatch))) {
+    if (type == TYPE_TCP_LISTENER && ((port = atoi(argv[2])) <= 0 || port > 65535)) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+
+    if (!(listener = sscp_allocate_listener(type, argv[2], type == TYPE_TCP_LISTENER ? &tcpListenerDispatch : &listenerDispatch))) {
         sscp_sendResponse("E,%d", SSCP_ERROR_NO_FREE_LISTENER);
         return;
     }
 
+    // TCP listeners accept connections on their own server socket
+    if (type == TYPE_TCP_LISTENER) {
+        if ((err = tcp_listen(listener, port, argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? atoi(argv[4]) : 0)) != 0) {
+            listener->hdr.type = TYPE_UNUSED;
+            sscp_sendResponse("E,%d", err);
+            return;
+        }
+    }
+
     sscp_log("Listening for '%s' on %d", argv[2], listener->hdr.handle);
     
     sscp_sendResponse("S,%d", listener->hdr.handle);
@@ -132,6 +161,9 @@ void ICACHE_FLASH_ATTR cmds_do_poll(int argc, char *argv[])
 
     if (wifi_check_for_events())
         return;
+
+    if (fs_check_for_events())
+        return;
     
     sscp_sendResponse("N,0,0");
 }
@@ -161,6 +193,7 @@ void ICACHE_FLASH_ATTR cmds_do_path(int argc, char *argv[])
 void ICACHE_FLASH_ATTR cmds_do_close(int argc, char *argv[])
 {
     sscp_hdr *hdr;
+    int err;
 
     if (argc != 2) {
         sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
@@ -172,7 +205,14 @@ void ICACHE_FLASH_ATTR cmds_do_close(int argc, char *argv[])
         return;
     }
 
-    if (hdr->dispatch->close)
+    // a TCP listener can't be freed while connections it accepted are still open
+    if (hdr->type == TYPE_TCP_LISTENER) {
+        if ((err = tcp_close_listener((sscp_listener *)hdr)) != 0) {
+            sscp_sendResponse("E,%d", err);
+            return;
+        }
+    }
+    else if (hdr->dispatch->close)
         (*hdr->dispatch->close)(hdr);
     hdr->type = TYPE_UNUSED;
         
@@ -294,13 +334,13 @@ void ICACHE_FLASH_ATTR cmds_do_lock(int argc, char *argv[])
 
 
 
-// SEND,chan,count
+// SEND,chan,count[,binary]
 void ICACHE_FLASH_ATTR cmds_do_send(int argc, char *argv[])
 {
     sscp_connection *connection;
     int count;
 
-    if (argc != 3) {
+    if (argc < 3 || argc > 4) {
         sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
         return;
     }
@@ -320,6 +360,12 @@ void ICACHE_FLASH_ATTR cmds_do_send(int argc, char *argv[])
         return;
     }
 sscp_log("SEND %d %d", connection->hdr.handle, count);
+
+    // websockets send text frames unless the MCU asks for binary
+    if (argc > 3 && atoi(argv[3]))
+        connection->flags |= CONNECTION_TXBINARY;
+    else
+        connection->flags &= ~CONNECTION_TXBINARY;
     
     if (connection->hdr.dispatch->send)
         (*connection->hdr.dispatch->send)((sscp_hdr *)connection, count);
@@ -0,0 +1,307 @@
+/*
+    sscp-fetch.c - Simple Serial Command Protocol scheduled fetches
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#include "esp8266.h"
+#include "sscp.h"
+#include "config.h"
+#include "sha1.h"
+
+#define FETCH_MAX           4
+#define FETCH_URL_MAX       128
+#define FETCH_PATH_MAX      32
+#define FETCH_MIN_INTERVAL  1000    // milliseconds
+
+typedef struct {
+    int interval;                   // zero if this entry is unused
+    char url[FETCH_URL_MAX];
+    char path[FETCH_PATH_MAX];      // optional JSON path of the value to watch
+    ETSTimer timer;
+    uint8_t hash[HASH_LENGTH];
+    int hashValid;
+    int busy;
+    sscp_connection *result;        // the last connection handed over to the MCU
+} fetch_def;
+
+static fetch_def fetches[FETCH_MAX];
+
+static void fetch_timer_cb(void *arg);
+static void fetch_complete(sscp_connection *c, void *data);
+static int json_find(const char *json, int len, const char *path, int *pStart, int *pLength);
+
+// FETCH,url,interval[,json-path]
+// FETCH,id
+//
+// The first form registers a URL that the module fetches every interval
+// milliseconds and returns its id. The MCU is only told about a result when it
+// differs from the previous one with an "F,handle,id,length" event. The result
+// (or just the value selected by the JSON path) is read with RECV on the handle
+// which must then be closed. A newer result closes an older handle that is still
+// open so each fetch holds at most one connection. The second form cancels a fetch.
+void ICACHE_FLASH_ATTR fetch_do_fetch(int argc, char *argv[])
+{
+    fetch_def *f;
+    int id, interval, i;
+
+    if (argc == 2) {
+        if ((id = atoi(argv[1])) < 1 || id > FETCH_MAX || !fetches[id - 1].interval) {
+            sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+            return;
+        }
+        f = &fetches[id - 1];
+        os_timer_disarm(&f->timer);
+        f->interval = 0;
+        sscp_sendResponse("S,0");
+        return;
+    }
+
+    if (argc < 3 || argc > 4) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+        return;
+    }
+
+    if ((interval = atoi(argv[2])) < FETCH_MIN_INTERVAL) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+
+    if (os_strlen(argv[1]) >= FETCH_URL_MAX || (argc > 3 && os_strlen(argv[3]) >= FETCH_PATH_MAX)) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+        return;
+    }
+
+    // a fetch that was cancelled while in progress can't be reused until it finishes
+    for (i = 0, f = NULL; i < FETCH_MAX; ++i) {
+        if (!fetches[i].interval && !fetches[i].busy) {
+            f = &fetches[i];
+            break;
+        }
+    }
+    if (!f) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
+
+    os_strcpy(f->url, argv[1]);
+    os_strcpy(f->path, argc > 3 ? argv[3] : "");
+    f->interval = interval;
+    f->hashValid = 0;
+    f->result = NULL;
+
+    os_timer_disarm(&f->timer);
+    os_timer_setfn(&f->timer, fetch_timer_cb, f);
+    os_timer_arm(&f->timer, interval, 1);
+
+    sscp_sendResponse("S,%d", i + 1);
+
+    // get the first result right away
+    fetch_timer_cb(f);
+}
+
+static void ICACHE_FLASH_ATTR fetch_timer_cb(void *arg)
+{
+    fetch_def *f = (fetch_def *)arg;
+    int err;
+
+    // skip this round if the last fetch is still in progress
+    if (f->busy)
+        return;
+
+    f->busy = 1;
+    if ((err = httpreq_fetch(f->url, fetch_complete, f)) != 0) {
+        sscp_log("FETCH: %d can't fetch '%s', error %d", (int)(f - fetches) + 1, f->url, err);
+        f->busy = 0;
+    }
+}
+
+static void ICACHE_FLASH_ATTR fetch_complete(sscp_connection *c, void *data)
+{
+    fetch_def *f = (fetch_def *)data;
+    int id = (f - fetches) + 1;
+    int start, length;
+    uint8_t *hash;
+    sha1nfo s;
+
+    f->busy = 0;
+
+    // the fetch was cancelled while it was in progress
+    if (!f->interval) {
+        sscp_close_connection(c);
+        return;
+    }
+
+    if (c->error || c->d.httpreq.req->status < 200 || c->d.httpreq.req->status >= 300) {
+        sscp_log("FETCH: %d failed, error %d, status %d", id, c->error, c->d.httpreq.req->status);
+        sscp_close_connection(c);
+        return;
+    }
+
+    // only keep the selected value, a missing value is treated as empty
+    if (*f->path) {
+        if (!json_find(c->rxBuffer + c->rxIndex, c->rxCount - c->rxIndex, f->path, &start, &length))
+            start = length = 0;
+        os_memmove(c->rxBuffer, c->rxBuffer + c->rxIndex + start, length);
+        c->rxIndex = 0;
+        c->rxCount = length;
+    }
+
+    sha1_init(&s);
+    sha1_write(&s, c->rxBuffer + c->rxIndex, c->rxCount - c->rxIndex);
+    hash = sha1_result(&s);
+
+    if (f->hashValid && os_memcmp(hash, f->hash, HASH_LENGTH) == 0) {
+        sscp_close_connection(c);
+        return;
+    }
+    os_memcpy(f->hash, hash, HASH_LENGTH);
+    f->hashValid = 1;
+
+    // a result the MCU hasn't closed yet is out of date, don't let it hold on to a connection
+    if (f->result && f->result != c && f->result->hdr.type == TYPE_HTTPREQ_CONNECTION && f->result->listenerHandle == id) {
+        sscp_log("FETCH: %d dropping unread result on %d", id, f->result->hdr.handle);
+        sscp_close_connection(f->result);
+    }
+
+    // hand the connection over to the MCU
+    f->result = c;
+    sscp_log("FETCH: %d changed, %d bytes on %d", id, c->rxCount - c->rxIndex, c->hdr.handle);
+    c->listenerHandle = id;
+    if (flashConfig.sscp_events)
+        sscp_sendEvent("F,%d,%d,%d", c->hdr.handle, id, c->rxCount - c->rxIndex);
+    else
+        c->flags |= CONNECTION_INIT;
+}
+
+static const char ICACHE_FLASH_ATTR *json_skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        ++p;
+    return p;
+}
+
+static const char ICACHE_FLASH_ATTR *json_skip_string(const char *p, const char *end)
+{
+    for (++p; p < end; ++p) {
+        if (*p == '\\')
+            ++p;
+        else if (*p == '"')
+            return p + 1;
+    }
+    return NULL;
+}
+
+static const char ICACHE_FLASH_ATTR *json_skip_value(const char *p, const char *end)
+{
+    int depth = 0;
+
+    if ((p = json_skip_ws(p, end)) >= end)
+        return NULL;
+
+    switch (*p) {
+    case '"':
+        return json_skip_string(p, end);
+    case '{':
+    case '[':
+        while (p < end) {
+            switch (*p) {
+            case '"':
+                if (!(p = json_skip_string(p, end)))
+                    return NULL;
+                continue;
+            case '{':
+            case '[':
+                ++depth;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0)
+                    return p + 1;
+                break;
+            }
+            ++p;
+        }
+        return NULL;
+    default:
+        while (p < end && !os_strchr(",}] \t\r\n", *p))
+            ++p;
+        return p;
+    }
+}
+
+// find the value selected by a path like "main.temp" or "list.0.name"
+static int ICACHE_FLASH_ATTR json_find(const char *json, int len, const char *path, int *pStart, int *pLength)
+{
+    const char *end = json + len;
+    const char *p = json;
+    const char *q;
+
+    while (*path) {
+        const char *seg = path;
+        int segLength;
+
+        if (!(path = os_strchr(seg, '.')))
+            path = seg + os_strlen(seg);
+        segLength = path - seg;
+        if (*path)
+            ++path;
+
+        if ((p = json_skip_ws(p, end)) >= end)
+            return 0;
+
+        if (*p == '{') {
+            for (++p;; ++p) {
+                const char *key;
+                if ((p = json_skip_ws(p, end)) >= end || *p != '"')
+                    return 0;
+                key = p + 1;
+                if (!(q = json_skip_string(p, end)))
+                    return 0;
+                if ((p = json_skip_ws(q, end)) >= end || *p != ':')
+                    return 0;
+                p = json_skip_ws(p + 1, end);
+                if (q - 1 - key == segLength && os_memcmp(key, seg, segLength) == 0)
+                    break;
+                if (!(p = json_skip_value(p, end)) || (p = json_skip_ws(p, end)) >= end || *p != ',')
+                    return 0;
+            }
+        }
+
+        else if (*p == '[') {
+            int index = 0;
+            if (segLength == 0)
+                return 0;
+            for (q = seg; q < seg + segLength; ++q) {
+                if (!isdigit((int)*q))
+                    return 0;
+                index = index * 10 + *q - '0';
+            }
+            for (++p; index > 0; --index) {
+                if (!(p = json_skip_value(p, end)) || (p = json_skip_ws(p, end)) >= end || *p != ',')
+                    return 0;
+                ++p;
+            }
+            if ((p = json_skip_ws(p, end)) >= end || *p == ']')
+                return 0;
+        }
+
+        else
+            return 0;
+    }
+
+    p = json_skip_ws(p, end);
+    if (!(q = json_skip_value(p, end)))
+        return 0;
+
+    // strings are returned without their quotes
+    if (*p == '"') {
+        ++p;
+        --q;
+    }
+
+    *pStart = p - json;
+    *pLength = q - p;
+    return 1;
+}
@@ -2,6 +2,8 @@
 #include "sscp.h"
 #include "roffs.h"
 #include "proploader.h"
+#include "loadjobs.h"
+#include "config.h"
 
 // FINFO,n
 void ICACHE_FLASH_ATTR fs_do_finfo(int argc, char *argv[])
@@ -40,21 +42,101 @@ void ICACHE_FLASH_ATTR fs_do_fcount(int argc, char *argv[])
     sscp_sendResponse("N,0");
 }
 
+// the most recent FRUN job and whether its completion still has to be reported by POLL
+static int frunJobId;
+static int frunDone;
+static int frunStatus;
+static int frunDuration;
+
+static void ICACHE_FLASH_ATTR send_frun_complete_event(int prefix)
+{
+    sscp_send(prefix, "L,%d,%d,%d", frunJobId, frunStatus, frunDuration);
+}
+
+static void ICACHE_FLASH_ATTR frun_complete(LoadJob *job)
+{
+    if (job->id != frunJobId)
+        return;
+
+    frunStatus = job->status;
+    frunDuration = job->started ? (job->finished - job->started) / 1000 : 0;
+
+    // loading turns SSCP off, give the MCU that asked for the load its command channel back
+    flashConfig.sscp_enable = (int)job->data;
+
+    if (flashConfig.sscp_enable && flashConfig.sscp_events)
+        send_frun_complete_event('!');
+    else
+        frunDone = 1;
+}
+
+int ICACHE_FLASH_ATTR fs_check_for_events(void)
+{
+    int sentEvent = 0;
+    if (frunDone) {
+        send_frun_complete_event('=');
+        frunDone = 0;
+        sentEvent = 1;
+    }
+    return sentEvent;
+}
+
+// id,state,bytes-sent,image-size of the most recent FRUN job
+int ICACHE_FLASH_ATTR fs_get_load_progress(void *data, char *value)
+{
+    LoadJob *job;
+
+    if (!(job = loadJobFind(frunJobId))) {
+        os_sprintf(value, "%d,0,0,0", frunJobId);
+        return 0;
+    }
+
+    os_sprintf(value, "%d,%d,%d,%d", job->id, job->state, job->bytesSent, job->imageSize);
+    return 0;
+}
+
 // FRUN,name
 void ICACHE_FLASH_ATTR fs_do_frun(int argc, char *argv[])
 {
-    int sts;
-    
+    LoadJob params, *job;
+    ROFFS_FILE *file;
+
     if (argc != 2) {
         sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
         return;
     }
-    
-    if ((sts = loadFile(argv[1])) == lsOK) {
-        sscp_sendResponse("S,0");
+
+    if (os_strlen(argv[1]) >= LOAD_JOB_NAME_MAX) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
         return;
     }
 
-    sscp_sendResponse("N,%d", sts);
-}
+    if (!(file = roffs_open(argv[1]))) {
+        sscp_sendResponse("N,%d", lsFileNotFound);
+        return;
+    }
+    roffs_close(file);
+
+    os_memset(&params, 0, sizeof(params));
+    os_strcpy(params.fileName, argv[1]);
+    params.p2 = flashConfig.p2_ddloader_enable;
+    params.baudRate = flashConfig.loader_baud_rate;
+    params.finalBaudRate = flashConfig.baud_rate;
+    params.fastBaudRate = params.p2
+                        ? ploadP2FastBaudRate(params.baudRate, params.finalBaudRate, flashConfig.p2_baud_escalation)
+                        : flashConfig.fast_loader_baud_rate;
+    params.loadType = ltDownloadAndRun;
+    params.completionCB = frun_complete;
+    params.data = (void *)(int)flashConfig.sscp_enable;
+
+    if (!(job = loadJobSubmit(&params))) {
+        sscp_sendResponse("N,%d", lsBusy);
+        return;
+    }
 
+    // a new FRUN replaces any completion that hasn't been polled for yet
+    frunJobId = job->id;
+    frunDone = 0;
+
+    sscp_sendResponse("S,%d", job->id);
+}
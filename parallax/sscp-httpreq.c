@@ -0,0 +1,1254 @@
+/*
+    sscp-httpreq.c - Simple Serial Command Protocol HTTP and WebSocket client support
+
+	Copyright (c) 2016 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#include "esp8266.h"
+#include "sscp.h"
+#include "config.h"
+#include "dnscache.h"
+#include "sha1.h"
+#include "base64.h"
+
+#define HTTPREQ_MAX_REDIRECTS   5
+#define HTTPREQ_DEFAULT_PORT    80
+
+#define WS_GUID                 "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_FRAME_HEAD_MAX       8   // client frames never need the 64 bit length
+
+#define WS_FLAG_FIN             0x80
+#define WS_FLAG_MASK            0x80
+#define WS_OPCODE_MASK          0x0f
+#define WS_OPCODE_TEXT          0x1
+#define WS_OPCODE_BINARY        0x2
+#define WS_OPCODE_CLOSE         0x8
+#define WS_OPCODE_PING          0x9
+#define WS_OPCODE_PONG          0xa
+#define WS_OPCODE_CONTROL       0x8 // set in all control opcodes
+
+// request states
+enum {
+    HTTPREQ_STATE_IDLE = 0,
+    HTTPREQ_STATE_CONNECTING,
+    HTTPREQ_STATE_SENDING,
+    HTTPREQ_STATE_RECEIVING,
+    HTTPREQ_STATE_CLOSING,
+    HTTPREQ_STATE_REDIRECTING
+};
+
+// response parser states
+enum {
+    PARSE_STATUS = 0,
+    PARSE_HEADERS,
+    PARSE_BODY,
+    PARSE_CHUNK_SIZE,
+    PARSE_CHUNK_DATA,
+    PARSE_CHUNK_END,
+    PARSE_TRAILER,
+    PARSE_WS_FRAME,
+    PARSE_WS_PAYLOAD,
+    PARSE_WS_CONTROL,
+    PARSE_DONE
+};
+
+// what the websocket is waiting to hear back about from espconn
+enum {
+    WS_TX_IDLE = 0,
+    WS_TX_DATA,
+    WS_TX_CONTROL
+};
+
+// a DNS lookup carries the tag of the request that started it, so an answer
+// that arrives after the request was closed can't start a reused connection
+typedef struct {
+    sscp_connection *c;
+    int tag;
+} httpreq_lookup;
+
+static int lookupTag;
+
+static void dns_cb(const char *name, ip_addr_t *ipaddr, void *arg);
+static void httpreq_connect_cb(void *arg);
+static void httpreq_discon_cb(void *arg);
+static void httpreq_recv_cb(void *arg, char *data, unsigned short len);
+static void httpreq_sent_cb(void *arg);
+static void httpreq_recon_cb(void *arg, sint8 errType);
+static void httpreq_timer_cb(void *arg);
+
+static int parse_url(sscp_connection *c, const char *url);
+static void begin_request(sscp_connection *c);
+static void connect_to_host(sscp_connection *c, ip_addr_t *ipAddr);
+static void request_failed(sscp_connection *c, int error);
+static int parse_response(sscp_connection *c, char *data, int len);
+static void process_line(sscp_connection *c);
+static int append_data(sscp_connection *c, char *data, int len);
+static void end_headers(sscp_connection *c);
+static void finish_response(sscp_connection *c);
+static void check_complete(sscp_connection *c);
+static void ws_start_frame(sscp_connection *c);
+static void ws_control_frame(sscp_connection *c);
+static void ws_send_control(sscp_connection *c, int opcode, char *data, int len);
+static int ws_send_frame(sscp_connection *c, char *buf, int opcode, char *data, int len);
+static void ws_flush(sscp_connection *c);
+
+static void send_change_event(sscp_connection *connection, int prefix);
+static void send_disconnect_event(sscp_connection *connection, int prefix);
+static void send_data_event(sscp_connection *connection, int prefix);
+static int checkForEvents_handler(sscp_hdr *hdr);
+static void path_handler(sscp_hdr *hdr);
+static void send_handler(sscp_hdr *hdr, int size);
+static void recv_handler(sscp_hdr *hdr, int size);
+static void close_handler(sscp_hdr *hdr);
+
+static sscp_dispatch httpreqDispatch = {
+    .checkForEvents = checkForEvents_handler,
+    .path = path_handler,
+    .send = send_handler,
+    .recv = recv_handler,
+    .close = close_handler
+};
+
+// allocate a connection along with the state of its request
+static sscp_connection ICACHE_FLASH_ATTR *allocate_request(void)
+{
+    sscp_connection *c;
+
+    if (!(c = sscp_allocate_connection(TYPE_HTTPREQ_CONNECTION, &httpreqDispatch)))
+        return NULL;
+
+    if (!(c->d.httpreq.req = (sscp_httpreq *)os_zalloc(sizeof(sscp_httpreq)))) {
+        sscp_close_connection(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+// this is called after the request body has been received from the MCU
+static void ICACHE_FLASH_ATTR body_cb(void *data, int count)
+{
+    sscp_connection *c = (sscp_connection *)data;
+    c->flags &= ~CONNECTION_TXFULL;
+    begin_request(c);
+}
+
+// HTTPREQ,method,url[,body-size[,header,...]]
+//
+// The response to the MCU is "S,handle,status" once the final response
+// headers have arrived (redirects are followed). The values of any headers
+// named in the request are delivered first as "name: value\r\n" lines followed
+// by a blank line and then the decoded response body follows. Use RECV on the
+// handle to read the data. An "X" event is reported once everything has been read.
+void ICACHE_FLASH_ATTR httpreq_do_request(int argc, char *argv[])
+{
+    sscp_connection *c;
+    char *p;
+    int size, i;
+
+    if (argc < 3) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+        return;
+    }
+
+    if (os_strlen(argv[1]) >= SSCP_HTTPREQ_METHOD_MAX) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_METHOD);
+        return;
+    }
+    for (p = argv[1]; *p; ++p) {
+        if (*p < 'A' || *p > 'Z') {
+            sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_METHOD);
+            return;
+        }
+    }
+
+    size = (argc > 3 ? atoi(argv[3]) : 0);
+    if (size < 0 || size > SSCP_TX_BUFFER_MAX) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+        return;
+    }
+
+    // allocate a connection
+    if (!(c = allocate_request())) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_NO_FREE_CONNECTION);
+        return;
+    }
+
+    if (!parse_url(c, argv[2])) {
+        sscp_close_connection(c);
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+    os_strcpy(c->d.httpreq.req->method, argv[1]);
+    c->d.httpreq.req->bodyLength = size;
+    c->flags &= ~CONNECTION_INIT;
+    c->error = 0;
+
+    // remember the names of the headers the MCU wants to see as a '\0' separated list
+    p = c->d.httpreq.req->headers;
+    for (i = 4; i < argc; ++i) {
+        int len = os_strlen(argv[i]) + 1;
+        if (p + len + 1 > &c->d.httpreq.req->headers[SSCP_HTTPREQ_HEADERS_MAX]) {
+            sscp_close_connection(c);
+            sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+            return;
+        }
+        os_memcpy(p, argv[i], len);
+        p += len;
+    }
+    *p = '\0';
+
+    os_timer_setfn(&c->d.httpreq.timer, httpreq_timer_cb, c);
+
+    // response is sent once the response headers arrive or the request fails
+    if (size > 0) {
+        sscp_capturePayload(c->txBuffer, size, body_cb, c);
+        c->flags |= CONNECTION_TXFULL;
+    }
+    else
+        begin_request(c);
+}
+
+// WSCONNECT,url
+//
+// Open a websocket to a "ws://host[:port][/path]" URL. The response is
+// "S,handle" once the server has accepted the upgrade. After that SEND sends a
+// text frame, or a binary frame when its binary argument is non-zero, and RECV
+// returns the payload of the frames from the server.
+void ICACHE_FLASH_ATTR httpreq_do_wsconnect(int argc, char *argv[])
+{
+    sscp_connection *c;
+    uint32_t key[4];
+    int i;
+
+    if (argc != 2) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+        return;
+    }
+
+    // allocate a connection
+    if (!(c = allocate_request())) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_NO_FREE_CONNECTION);
+        return;
+    }
+
+    if (!parse_url(c, argv[1])) {
+        sscp_close_connection(c);
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+    os_strcpy(c->d.httpreq.req->method, "GET");
+    c->flags &= ~CONNECTION_INIT;
+    c->error = 0;
+
+    // the key only has to be unpredictable enough to defeat caching proxies
+    for (i = 0; i < 4; ++i)
+        key[i] = os_random();
+    base64_encode(sizeof(key), (unsigned char *)key, sizeof(c->d.httpreq.req->wsKey), c->d.httpreq.req->wsKey);
+    c->d.httpreq.req->websocket = 1;
+
+    os_timer_setfn(&c->d.httpreq.timer, httpreq_timer_cb, c);
+
+    // response is sent once the server accepts the upgrade or the request fails
+    begin_request(c);
+}
+
+// start a GET on behalf of the module itself rather than the MCU
+// complete is called once the whole response is in rxBuffer or the request
+// has failed in which case c->error is set
+int ICACHE_FLASH_ATTR httpreq_fetch(char *url, void (*complete)(sscp_connection *c, void *data), void *data)
+{
+    sscp_connection *c;
+
+    if (!(c = allocate_request()))
+        return SSCP_ERROR_NO_FREE_CONNECTION;
+
+    if (!parse_url(c, url)) {
+        sscp_close_connection(c);
+        return SSCP_ERROR_INVALID_ARGUMENT;
+    }
+    os_strcpy(c->d.httpreq.req->method, "GET");
+    c->flags &= ~CONNECTION_INIT;
+    c->error = 0;
+
+    // nothing is reported to the MCU until the owner decides to hand over the connection
+    c->d.httpreq.req->replied = 1;
+    c->d.httpreq.req->complete = complete;
+    c->d.httpreq.req->completeData = data;
+
+    os_timer_setfn(&c->d.httpreq.timer, httpreq_timer_cb, c);
+    begin_request(c);
+
+    return 0;
+}
+
+// split an "http://host[:port][/path]" URL or, when following a redirect, a bare "/path"
+static int ICACHE_FLASH_ATTR parse_url(sscp_connection *c, const char *url)
+{
+    const char *host, *end, *path;
+    int len;
+
+    if (*url == '/')
+        path = url;
+
+    else {
+        // only plain http and ws are supported
+        if (os_strncmp(url, "http://", 7) == 0)
+            host = url + 7;
+        else if (os_strncmp(url, "ws://", 5) == 0)
+            host = url + 5;
+        else
+            return 0;
+
+        if (!(path = os_strchr(host, '/')))
+            path = host + os_strlen(host);
+
+        if ((end = os_strchr(host, ':')) != NULL && end < path) {
+            c->d.httpreq.req->port = atoi(end + 1);
+            if (c->d.httpreq.req->port <= 0 || c->d.httpreq.req->port > 65535)
+                return 0;
+        }
+        else {
+            c->d.httpreq.req->port = HTTPREQ_DEFAULT_PORT;
+            end = path;
+        }
+
+        if ((len = end - host) <= 0 || len >= SSCP_HTTPREQ_HOST_MAX)
+            return 0;
+        os_memcpy(c->d.httpreq.req->host, host, len);
+        c->d.httpreq.req->host[len] = '\0';
+    }
+
+    if (!*path)
+        path = "/";
+    if (os_strlen(path) >= SSCP_HTTPREQ_PATH_MAX)
+        return 0;
+    os_strcpy(c->d.httpreq.req->path, path);
+
+    return 1;
+}
+
+static void ICACHE_FLASH_ATTR begin_request(sscp_connection *c)
+{
+    struct espconn *conn = &c->d.httpreq.conn;
+    ip_addr_t ipAddr;
+
+    os_memset(conn, 0, sizeof(*conn));
+    os_memset(&c->d.httpreq.tcp, 0, sizeof(c->d.httpreq.tcp));
+    conn->type = ESPCONN_TCP;
+    conn->state = ESPCONN_NONE;
+    conn->proto.tcp = &c->d.httpreq.tcp;
+    conn->proto.tcp->remote_port = c->d.httpreq.req->port;
+    conn->reverse = (void *)c;
+
+    espconn_regist_connectcb(conn, httpreq_connect_cb);
+    espconn_regist_reconcb(conn, httpreq_recon_cb);
+
+    c->d.httpreq.state = HTTPREQ_STATE_CONNECTING;
+
+    if (isdigit((int)*c->d.httpreq.req->host))
+        ipAddr.addr = ipaddr_addr(c->d.httpreq.req->host);
+    else {
+        httpreq_lookup *lookup;
+        sint8 result;
+
+        if (!(lookup = (httpreq_lookup *)os_malloc(sizeof(httpreq_lookup)))) {
+            request_failed(c, SSCP_ERROR_INTERNAL_ERROR);
+            return;
+        }
+        lookup->c = c;
+        if ((lookup->tag = ++lookupTag) == 0)
+            lookup->tag = ++lookupTag;  // zero means no lookup is in progress
+        c->d.httpreq.lookup = lookup->tag;
+
+        // the espconn argument is only handed back to dns_cb so the lookup can stand in for it
+        if ((result = dnsCacheGetHostByName((struct espconn *)lookup, c->d.httpreq.req->host, &ipAddr, dns_cb)) == ESPCONN_INPROGRESS) {
+            // connection is started by dns_cb, which frees the lookup
+            sscp_log("HTTPREQ: looking up '%s'", c->d.httpreq.req->host);
+            return;
+        }
+        os_free(lookup);
+        c->d.httpreq.lookup = 0;
+
+        if (result != ESPCONN_OK) {
+            request_failed(c, SSCP_ERROR_LOOKUP_FAILED);
+            return;
+        }
+    }
+
+    connect_to_host(c, &ipAddr);
+}
+
+static void ICACHE_FLASH_ATTR connect_to_host(sscp_connection *c, ip_addr_t *ipAddr)
+{
+    struct espconn *conn = &c->d.httpreq.conn;
+
+    os_memcpy(conn->proto.tcp->remote_ip, &ipAddr->addr, 4);
+
+    // response is sent once the response headers arrive or the request fails
+    if (espconn_connect(conn) != ESPCONN_OK)
+        request_failed(c, SSCP_ERROR_CONNECT_FAILED);
+}
+
+// report a failure to the MCU either as the response to HTTPREQ or as a disconnect event
+static void ICACHE_FLASH_ATTR request_failed(sscp_connection *c, int error)
+{
+    int connected;
+
+    switch (c->d.httpreq.state) {
+    case HTTPREQ_STATE_SENDING:
+    case HTTPREQ_STATE_RECEIVING:
+    case HTTPREQ_STATE_CLOSING:
+        connected = 1;
+        break;
+    default:
+        connected = 0;
+        break;
+    }
+
+    c->error = error;
+    c->d.httpreq.req->parseState = PARSE_DONE;
+
+    if (!c->d.httpreq.req->replied) {
+        c->d.httpreq.req->replied = 1;
+        sscp_sendResponse("E,%d", error);
+
+        // the MCU never got a handle so free the connection as soon as possible
+        if (!connected) {
+            c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+            sscp_close_connection(c);
+            return;
+        }
+        c->d.httpreq.req->orphan = 1;
+    }
+    else
+        c->flags |= CONNECTION_TERM;
+
+    // can't disconnect from within an espconn callback
+    if (connected) {
+        c->d.httpreq.state = HTTPREQ_STATE_CLOSING;
+        os_timer_arm(&c->d.httpreq.timer, 0, 0);
+    }
+    else {
+        c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+        os_timer_disarm(&c->d.httpreq.timer);
+        check_complete(c);
+    }
+}
+
+// let the owner of a module request know that it is finished
+static void ICACHE_FLASH_ATTR check_complete(sscp_connection *c)
+{
+    void (*complete)(sscp_connection *c, void *data) = c->d.httpreq.req->complete;
+    if (complete && c->d.httpreq.state == HTTPREQ_STATE_IDLE && (c->flags & CONNECTION_TERM)) {
+        c->d.httpreq.req->complete = NULL;
+        (*complete)(c, c->d.httpreq.req->completeData);
+    }
+}
+
+static void ICACHE_FLASH_ATTR dns_cb(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+    httpreq_lookup *lookup = (httpreq_lookup *)arg;
+    sscp_connection *c = lookup->c;
+    int tag = lookup->tag;
+
+    os_free(lookup);
+
+    if (c->hdr.type != TYPE_HTTPREQ_CONNECTION || c->d.httpreq.lookup != tag)
+        return;
+    c->d.httpreq.lookup = 0;
+
+    if (!ipaddr) {
+        sscp_log("HTTPREQ: no IP address found for '%s'", name);
+        request_failed(c, SSCP_ERROR_LOOKUP_FAILED);
+        return;
+    }
+
+    connect_to_host(c, ipaddr);
+}
+
+static void ICACHE_FLASH_ATTR httpreq_connect_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_connection *c = (sscp_connection *)conn->reverse;
+    char *req = c->rxBuffer;
+    int len;
+
+    if (c->hdr.type != TYPE_HTTPREQ_CONNECTION)
+        return;
+
+    espconn_regist_disconcb(conn, httpreq_discon_cb);
+    espconn_regist_recvcb(conn, httpreq_recv_cb);
+    espconn_regist_sentcb(conn, httpreq_sent_cb);
+
+    // reset the response parser
+    c->d.httpreq.req->parseState = PARSE_STATUS;
+    c->d.httpreq.req->lineLength = 0;
+    c->d.httpreq.req->status = 0;
+    c->d.httpreq.req->contentLength = -1;
+    c->d.httpreq.req->chunked = 0;
+    c->d.httpreq.req->redirect = 0;
+    c->rxCount = c->rxIndex = 0;
+
+    // the request headers are assembled in rxBuffer since it can't be needed
+    // for the response until the server has acknowledged the request
+    len = os_sprintf(req, "%s %s HTTP/1.1\r\nHost: %s", c->d.httpreq.req->method, c->d.httpreq.req->path, c->d.httpreq.req->host);
+    if (c->d.httpreq.req->port != HTTPREQ_DEFAULT_PORT)
+        len += os_sprintf(req + len, ":%d", c->d.httpreq.req->port);
+    if (c->d.httpreq.req->websocket)
+        len += os_sprintf(req + len, "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n", c->d.httpreq.req->wsKey);
+    else
+        len += os_sprintf(req + len, "\r\nConnection: close\r\nAccept-Encoding: identity\r\n");
+    if (c->d.httpreq.req->bodyLength > 0)
+        len += os_sprintf(req + len, "Content-Length: %d\r\n", c->d.httpreq.req->bodyLength);
+    len += os_sprintf(req + len, "\r\n");
+
+    sscp_log("HTTPREQ: %d %s http://%s%s", c->hdr.handle, c->d.httpreq.req->method, c->d.httpreq.req->host, c->d.httpreq.req->path);
+
+    // the body, if any, is sent by httpreq_sent_cb
+    c->d.httpreq.state = HTTPREQ_STATE_SENDING;
+    c->d.httpreq.req->bodySent = 0;
+    if (espconn_send(conn, (uint8 *)req, len) != ESPCONN_OK)
+        request_failed(c, SSCP_ERROR_SEND_FAILED);
+}
+
+static void ICACHE_FLASH_ATTR httpreq_sent_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_connection *c = (sscp_connection *)conn->reverse;
+
+    if (c->hdr.type != TYPE_HTTPREQ_CONNECTION)
+        return;
+
+    if (c->d.httpreq.req->wsTx != WS_TX_IDLE) {
+        if (c->d.httpreq.req->wsTx == WS_TX_DATA) {
+            c->flags &= ~CONNECTION_TXFULL;
+            sscp_sendResponse("S,%d", c->txCount);
+            c->txCount = 0;
+        }
+        else {
+            c->d.httpreq.req->wsControlLength = 0;
+            // our close frame has gone out so the connection can be dropped
+            if (c->d.httpreq.req->parseState == PARSE_DONE && c->d.httpreq.state == HTTPREQ_STATE_RECEIVING)
+                finish_response(c);
+        }
+        c->d.httpreq.req->wsTx = WS_TX_IDLE;
+        ws_flush(c);
+        return;
+    }
+
+    if (c->d.httpreq.state != HTTPREQ_STATE_SENDING)
+        return;
+
+    if (c->d.httpreq.req->bodyLength > 0 && !c->d.httpreq.req->bodySent) {
+        c->d.httpreq.req->bodySent = 1;
+        if (espconn_send(conn, (uint8 *)c->txBuffer, c->d.httpreq.req->bodyLength) != ESPCONN_OK)
+            request_failed(c, SSCP_ERROR_SEND_FAILED);
+        return;
+    }
+
+    c->d.httpreq.state = HTTPREQ_STATE_RECEIVING;
+}
+
+static void ICACHE_FLASH_ATTR httpreq_recv_cb(void *arg, char *data, unsigned short len)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_connection *c = (sscp_connection *)conn->reverse;
+    int available, cnt;
+
+    if (c->hdr.type != TYPE_HTTPREQ_CONNECTION)
+        return;
+
+    // only announce data when the buffer goes from empty to non-empty
+    available = (c->d.httpreq.req->replied && !c->d.httpreq.req->complete ? c->rxCount - c->rxIndex : -1);
+
+    // a response may arrive before the sent callback for the request
+    if (c->d.httpreq.state == HTTPREQ_STATE_SENDING)
+        c->d.httpreq.state = HTTPREQ_STATE_RECEIVING;
+
+    // keep the order of the data if some is already waiting
+    if (c->d.httpreq.req->pending)
+        cnt = 0;
+    else
+        cnt = parse_response(c, data, len);
+
+    if (available == 0 && c->rxCount > c->rxIndex && flashConfig.sscp_events)
+        send_data_event(c, '!');
+
+    // a module request must fit in the buffer since nobody is going to read it yet
+    if (cnt < len && c->d.httpreq.req->complete) {
+        request_failed(c, SSCP_ERROR_INVALID_SIZE);
+        return;
+    }
+
+    // hold on to anything that doesn't fit until the MCU reads some data
+    if (cnt < len) {
+        int remaining = len - cnt;
+        int pendingCount = c->d.httpreq.req->pendingCount - c->d.httpreq.req->pendingIndex;
+        char *pending;
+        if (!(pending = (char *)os_malloc(pendingCount + remaining))) {
+            request_failed(c, SSCP_ERROR_INTERNAL_ERROR);
+            return;
+        }
+        if (c->d.httpreq.req->pending) {
+            os_memcpy(pending, c->d.httpreq.req->pending + c->d.httpreq.req->pendingIndex, pendingCount);
+            os_free(c->d.httpreq.req->pending);
+        }
+        os_memcpy(pending + pendingCount, data + cnt, remaining);
+        c->d.httpreq.req->pending = pending;
+        c->d.httpreq.req->pendingCount = pendingCount + remaining;
+        c->d.httpreq.req->pendingIndex = 0;
+        espconn_recv_hold(conn);
+    }
+}
+
+static void ICACHE_FLASH_ATTR httpreq_discon_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_connection *c = (sscp_connection *)conn->reverse;
+
+    if (c->hdr.type != TYPE_HTTPREQ_CONNECTION)
+        return;
+
+    sscp_log("HTTPREQ: %d disconnected", c->hdr.handle);
+
+    if (c->d.httpreq.req->redirect) {
+        // can't reuse the espconn from within its own callback
+        c->d.httpreq.state = HTTPREQ_STATE_REDIRECTING;
+        os_timer_arm(&c->d.httpreq.timer, 0, 0);
+        return;
+    }
+
+    os_timer_disarm(&c->d.httpreq.timer);
+    c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+
+    // the MCU was already told about the failure
+    if (c->d.httpreq.req->orphan) {
+        sscp_close_connection(c);
+        return;
+    }
+    if (!c->error) {
+
+        // a body without a length or chunked encoding ends when the server closes the connection
+        if (c->d.httpreq.req->parseState == PARSE_BODY && c->d.httpreq.req->contentLength < 0)
+            c->d.httpreq.req->parseState = PARSE_DONE;
+
+        // anything still pending is checked once the MCU has read it
+        if (c->d.httpreq.req->parseState != PARSE_DONE && !c->d.httpreq.req->pending)
+            request_failed(c, SSCP_ERROR_DISCONNECTED);
+        else if (!c->d.httpreq.req->pending)
+            c->flags |= CONNECTION_TERM;
+    }
+
+    check_complete(c);
+}
+
+static void ICACHE_FLASH_ATTR httpreq_recon_cb(void *arg, sint8 errType)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_connection *c = (sscp_connection *)conn->reverse;
+
+    if (c->hdr.type != TYPE_HTTPREQ_CONNECTION)
+        return;
+
+    sscp_log("HTTPREQ: %d connection error %d", c->hdr.handle, errType);
+    os_timer_disarm(&c->d.httpreq.timer);
+    if (c->d.httpreq.req->orphan) {
+        c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+        sscp_close_connection(c);
+        return;
+    }
+    if (c->d.httpreq.state == HTTPREQ_STATE_CONNECTING) {
+        c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+        request_failed(c, SSCP_ERROR_CONNECT_FAILED);
+    }
+    else {
+        c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+        if (!c->error)
+            request_failed(c, SSCP_ERROR_DISCONNECTED);
+        else
+            check_complete(c);
+    }
+}
+
+static void ICACHE_FLASH_ATTR httpreq_timer_cb(void *arg)
+{
+    sscp_connection *c = (sscp_connection *)arg;
+
+    switch (c->d.httpreq.state) {
+    case HTTPREQ_STATE_CLOSING:
+        espconn_disconnect(&c->d.httpreq.conn);
+        break;
+    case HTTPREQ_STATE_REDIRECTING:
+        c->d.httpreq.req->redirect = 0;
+        begin_request(c);
+        break;
+    default:
+        break;
+    }
+}
+
+// feed raw response data through the parser, returns the number of bytes consumed
+static int ICACHE_FLASH_ATTR parse_response(sscp_connection *c, char *data, int len)
+{
+    char *p = data;
+    char *end = data + len;
+    int cnt;
+
+    while (p < end) {
+        switch (c->d.httpreq.req->parseState) {
+        case PARSE_STATUS:
+        case PARSE_HEADERS:
+        case PARSE_CHUNK_SIZE:
+        case PARSE_CHUNK_END:
+        case PARSE_TRAILER:
+            if (*p == '\n') {
+                if (c->d.httpreq.req->lineLength > 0 && c->d.httpreq.req->line[c->d.httpreq.req->lineLength - 1] == '\r')
+                    --c->d.httpreq.req->lineLength;
+                c->d.httpreq.req->line[c->d.httpreq.req->lineLength] = '\0';
+                c->d.httpreq.req->lineLength = 0;
+                process_line(c);
+            }
+            // just truncate lines that are too long, nothing we need is that long
+            else if (c->d.httpreq.req->lineLength < SSCP_HTTPREQ_LINE_MAX)
+                c->d.httpreq.req->line[c->d.httpreq.req->lineLength++] = *p;
+            ++p;
+            break;
+        case PARSE_BODY:
+        case PARSE_CHUNK_DATA:
+        case PARSE_WS_PAYLOAD:
+            cnt = end - p;
+            if (c->d.httpreq.req->contentLength >= 0 && cnt > c->d.httpreq.req->contentLength)
+                cnt = c->d.httpreq.req->contentLength;
+            if ((cnt = append_data(c, p, cnt)) == 0)
+                return p - data;
+            p += cnt;
+
+            // servers shouldn't mask their frames but it doesn't hurt to handle it
+            if (c->d.httpreq.req->parseState == PARSE_WS_PAYLOAD && c->d.httpreq.req->wsMasked) {
+                char *q = c->rxBuffer + c->rxCount - cnt;
+                int i;
+                for (i = 0; i < cnt; ++i)
+                    q[i] ^= c->d.httpreq.req->wsMask[c->d.httpreq.req->wsMaskIndex++ & 3];
+            }
+
+            if (c->d.httpreq.req->contentLength >= 0 && (c->d.httpreq.req->contentLength -= cnt) == 0) {
+                if (c->d.httpreq.req->parseState == PARSE_CHUNK_DATA)
+                    c->d.httpreq.req->parseState = PARSE_CHUNK_END;
+                else if (c->d.httpreq.req->parseState == PARSE_WS_PAYLOAD)
+                    c->d.httpreq.req->parseState = PARSE_WS_FRAME;
+                else
+                    finish_response(c);
+            }
+            break;
+        case PARSE_WS_FRAME:
+            c->d.httpreq.req->line[c->d.httpreq.req->lineLength++] = *p++;
+            if (c->d.httpreq.req->lineLength >= 2) {
+                int length = 2;
+                switch (c->d.httpreq.req->line[1] & 0x7f) {
+                case 126:
+                    length += 2;
+                    break;
+                case 127:
+                    length += 8;
+                    break;
+                }
+                if (c->d.httpreq.req->line[1] & WS_FLAG_MASK)
+                    length += 4;
+                if (c->d.httpreq.req->lineLength >= length)
+                    ws_start_frame(c);
+            }
+            break;
+        case PARSE_WS_CONTROL:
+            c->d.httpreq.req->line[c->d.httpreq.req->lineLength++] = *p++ ^ (c->d.httpreq.req->wsMasked ? c->d.httpreq.req->wsMask[c->d.httpreq.req->wsMaskIndex++ & 3] : 0);
+            if (--c->d.httpreq.req->contentLength == 0)
+                ws_control_frame(c);
+            break;
+        case PARSE_DONE:
+        default:
+            // ignore anything after the end of the response
+            return len;
+        }
+    }
+
+    return len;
+}
+
+static void ICACHE_FLASH_ATTR process_line(sscp_connection *c)
+{
+    char *line = c->d.httpreq.req->line;
+    char *value, *name;
+
+    switch (c->d.httpreq.req->parseState) {
+    case PARSE_STATUS:
+        // HTTP/1.x nnn reason
+        if (os_strncmp(line, "HTTP/", 5) != 0 || !(value = os_strchr(line, ' '))) {
+            request_failed(c, SSCP_ERROR_INVALID_STATE);
+            break;
+        }
+        c->d.httpreq.req->status = atoi(value + 1);
+        c->d.httpreq.req->parseState = PARSE_HEADERS;
+        break;
+    case PARSE_HEADERS:
+        if (!*line) {
+            end_headers(c);
+            break;
+        }
+        if (!(value = os_strchr(line, ':')))
+            break;
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t')
+            ++value;
+
+        if (strcasecmp(line, "Content-Length") == 0)
+            c->d.httpreq.req->contentLength = atoi(value);
+        else if (strcasecmp(line, "Transfer-Encoding") == 0)
+            c->d.httpreq.req->chunked = (strcasecmp(value, "chunked") == 0);
+        else if (strcasecmp(line, "Sec-WebSocket-Accept") == 0 && c->d.httpreq.req->websocket) {
+            char accept[32];
+            sha1nfo s;
+            sha1_init(&s);
+            sha1_write(&s, c->d.httpreq.req->wsKey, os_strlen(c->d.httpreq.req->wsKey));
+            sha1_write(&s, WS_GUID, os_strlen(WS_GUID));
+            base64_encode(HASH_LENGTH, sha1_result(&s), sizeof(accept), accept);
+            c->d.httpreq.req->wsAccepted = (os_strcmp(value, accept) == 0);
+        }
+        else if (strcasecmp(line, "Location") == 0) {
+            switch (c->d.httpreq.req->status) {
+            case 301:
+            case 302:
+            case 303:
+            case 307:
+            case 308:
+                if (c->d.httpreq.req->redirects < HTTPREQ_MAX_REDIRECTS && parse_url(c, value))
+                    c->d.httpreq.req->redirect = 1;
+                break;
+            }
+        }
+
+        // pass along the headers the MCU asked for
+        for (name = c->d.httpreq.req->headers; *name; name += os_strlen(name) + 1) {
+            if (strcasecmp(line, name) == 0) {
+                int nameLength = os_strlen(line);
+                int valueLength = os_strlen(value);
+                // the line buffer has a few spare bytes to rebuild the header in place
+                line[nameLength] = ':';
+                if (value != &line[nameLength + 2]) {
+                    os_memmove(&line[nameLength + 2], value, valueLength);
+                    line[nameLength + 1] = ' ';
+                }
+                os_memcpy(&line[nameLength + 2 + valueLength], "\r\n", 2);
+                append_data(c, line, nameLength + 2 + valueLength + 2);
+                break;
+            }
+        }
+        break;
+    case PARSE_CHUNK_SIZE:
+        c->d.httpreq.req->contentLength = strtol(line, NULL, 16);
+        if (c->d.httpreq.req->contentLength > 0)
+            c->d.httpreq.req->parseState = PARSE_CHUNK_DATA;
+        else
+            c->d.httpreq.req->parseState = PARSE_TRAILER;
+        break;
+    case PARSE_CHUNK_END:
+        c->d.httpreq.req->parseState = PARSE_CHUNK_SIZE;
+        break;
+    case PARSE_TRAILER:
+        if (!*line)
+            finish_response(c);
+        break;
+    }
+}
+
+static void ICACHE_FLASH_ATTR end_headers(sscp_connection *c)
+{
+    int status = c->d.httpreq.req->status;
+
+    // switch to websocket framing once the server agrees to the upgrade
+    if (c->d.httpreq.req->websocket && !c->d.httpreq.req->redirect) {
+        if (status != 101 || !c->d.httpreq.req->wsAccepted) {
+            sscp_log("HTTPREQ: %d websocket upgrade refused, status %d", c->hdr.handle, status);
+            request_failed(c, SSCP_ERROR_CONNECT_FAILED);
+            return;
+        }
+        c->rxCount = c->rxIndex = 0;
+        c->d.httpreq.req->parseState = PARSE_WS_FRAME;
+        c->d.httpreq.req->replied = 1;
+        sscp_sendResponse("S,%d", c->hdr.handle);
+        return;
+    }
+
+    // informational responses are followed by the real one
+    if (status >= 100 && status < 200) {
+        c->rxCount = c->rxIndex = 0;
+        c->d.httpreq.req->contentLength = -1;
+        c->d.httpreq.req->chunked = 0;
+        c->d.httpreq.req->parseState = PARSE_STATUS;
+        return;
+    }
+
+    // the body of a redirect isn't needed, reconnect once the server is gone
+    if (c->d.httpreq.req->redirect) {
+        ++c->d.httpreq.req->redirects;
+        sscp_log("HTTPREQ: %d redirected to http://%s%s", c->hdr.handle, c->d.httpreq.req->host, c->d.httpreq.req->path);
+        // only 307 and 308 keep the method and body
+        if (status != 307 && status != 308) {
+            os_strcpy(c->d.httpreq.req->method, "GET");
+            c->d.httpreq.req->bodyLength = 0;
+        }
+        c->rxCount = c->rxIndex = 0;
+        finish_response(c);
+        return;
+    }
+
+    // terminate the selected headers with a blank line
+    if (*c->d.httpreq.req->headers)
+        append_data(c, "\r\n", 2);
+
+    c->d.httpreq.req->replied = 1;
+    sscp_sendResponse("S,%d,%d", c->hdr.handle, status);
+
+    if (os_strcmp(c->d.httpreq.req->method, "HEAD") == 0 || status == 204 || status == 304)
+        finish_response(c);
+    else if (c->d.httpreq.req->chunked) {
+        c->d.httpreq.req->parseState = PARSE_CHUNK_SIZE;
+        c->d.httpreq.req->contentLength = -1;
+    }
+    else if (c->d.httpreq.req->contentLength == 0)
+        finish_response(c);
+    else
+        c->d.httpreq.req->parseState = PARSE_BODY;
+}
+
+// the frame header has been collected in the line buffer
+static void ICACHE_FLASH_ATTR ws_start_frame(sscp_connection *c)
+{
+    uint8_t *head = (uint8_t *)c->d.httpreq.req->line;
+    int opcode = head[0] & WS_OPCODE_MASK;
+    int i = 2;
+    uint32_t length;
+
+    switch (head[1] & 0x7f) {
+    case 126:
+        length = (head[2] << 8) | head[3];
+        i += 2;
+        break;
+    case 127:
+        // nothing that large could ever be passed along anyway
+        if (head[2] || head[3] || head[4] || head[5] || (head[6] & 0x80)) {
+            request_failed(c, SSCP_ERROR_INVALID_SIZE);
+            return;
+        }
+        length = (head[6] << 24) | (head[7] << 16) | (head[8] << 8) | head[9];
+        i += 8;
+        break;
+    default:
+        length = head[1] & 0x7f;
+        break;
+    }
+
+    if ((c->d.httpreq.req->wsMasked = (head[1] & WS_FLAG_MASK) != 0))
+        os_memcpy(c->d.httpreq.req->wsMask, &head[i], 4);
+    c->d.httpreq.req->wsMaskIndex = 0;
+    c->d.httpreq.req->lineLength = 0;
+    c->d.httpreq.req->contentLength = length;
+
+    if (opcode & WS_OPCODE_CONTROL) {
+        if (length > 125) {
+            request_failed(c, SSCP_ERROR_INVALID_SIZE);
+            return;
+        }
+        c->d.httpreq.req->wsOpcode = opcode;
+        if (length == 0)
+            ws_control_frame(c);
+        else
+            c->d.httpreq.req->parseState = PARSE_WS_CONTROL;
+    }
+
+    // text, binary and continuation frames all just add to the data stream
+    else if (length > 0)
+        c->d.httpreq.req->parseState = PARSE_WS_PAYLOAD;
+}
+
+// the payload of a control frame has been collected in the line buffer
+static void ICACHE_FLASH_ATTR ws_control_frame(sscp_connection *c)
+{
+    int length = c->d.httpreq.req->lineLength;
+
+    c->d.httpreq.req->lineLength = 0;
+    c->d.httpreq.req->parseState = PARSE_WS_FRAME;
+
+    switch (c->d.httpreq.req->wsOpcode) {
+    case WS_OPCODE_PING:
+        ws_send_control(c, WS_OPCODE_PONG, c->d.httpreq.req->line, length);
+        break;
+    case WS_OPCODE_CLOSE:
+        // echo the status code and disconnect once it has been sent
+        sscp_log("HTTPREQ: %d websocket closed by server", c->hdr.handle);
+        c->d.httpreq.req->parseState = PARSE_DONE;
+        ws_send_control(c, WS_OPCODE_CLOSE, c->d.httpreq.req->line, length > 2 ? 2 : length);
+        break;
+    default:
+        // nothing to do for a pong
+        break;
+    }
+}
+
+// control frames have their own buffer since a SEND may be using txBuffer
+static void ICACHE_FLASH_ATTR ws_send_control(sscp_connection *c, int opcode, char *data, int len)
+{
+    c->d.httpreq.req->wsControlLength = ws_send_frame(c, c->d.httpreq.req->wsControl, opcode, data, len);
+    ws_flush(c);
+}
+
+// build a masked frame in buf, data may already be in place right after the header space
+static int ICACHE_FLASH_ATTR ws_send_frame(sscp_connection *c, char *buf, int opcode, char *data, int len)
+{
+    uint8_t *p = (uint8_t *)buf;
+    uint8_t mask[4];
+    uint32_t r = os_random();
+    int i;
+
+    *p++ = WS_FLAG_FIN | opcode;
+    if (len > 125) {
+        *p++ = WS_FLAG_MASK | 126;
+        *p++ = len >> 8;
+        *p++ = len;
+    }
+    else
+        *p++ = WS_FLAG_MASK | len;
+    os_memcpy(mask, &r, 4);
+    os_memcpy(p, mask, 4);
+    p += 4;
+
+    if ((char *)p != data)
+        os_memmove(p, data, len);
+    for (i = 0; i < len; ++i)
+        p[i] ^= mask[i & 3];
+
+    return (char *)p + len - buf;
+}
+
+// start the next websocket transmit, only one can be outstanding at a time
+static void ICACHE_FLASH_ATTR ws_flush(sscp_connection *c)
+{
+    struct espconn *conn = &c->d.httpreq.conn;
+
+    if (c->d.httpreq.req->wsTx != WS_TX_IDLE || c->d.httpreq.state != HTTPREQ_STATE_RECEIVING)
+        return;
+
+    if (c->d.httpreq.req->wsControlLength > 0) {
+        c->d.httpreq.req->wsTx = WS_TX_CONTROL;
+        if (espconn_send(conn, (uint8 *)c->d.httpreq.req->wsControl, c->d.httpreq.req->wsControlLength) != ESPCONN_OK) {
+            c->d.httpreq.req->wsTx = WS_TX_IDLE;
+            c->d.httpreq.req->wsControlLength = 0;
+        }
+    }
+
+    else if (c->txIndex > 0) {
+        c->d.httpreq.req->wsTx = WS_TX_DATA;
+        if (espconn_send(conn, (uint8 *)c->txBuffer + WS_FRAME_HEAD_MAX - c->txIndex, c->txIndex + c->txCount) != ESPCONN_OK) {
+            c->d.httpreq.req->wsTx = WS_TX_IDLE;
+            c->flags &= ~CONNECTION_TXFULL;
+            sscp_sendResponse("E,%d", SSCP_ERROR_SEND_FAILED);
+        }
+        c->txIndex = 0;
+    }
+}
+
+static void ICACHE_FLASH_ATTR finish_response(sscp_connection *c)
+{
+    c->d.httpreq.req->parseState = PARSE_DONE;
+    c->d.httpreq.state = HTTPREQ_STATE_CLOSING;
+    os_timer_arm(&c->d.httpreq.timer, 0, 0);
+}
+
+// add data for the MCU to rxBuffer, returns the number of bytes that fit
+static int ICACHE_FLASH_ATTR append_data(sscp_connection *c, char *data, int len)
+{
+    int space;
+
+    // slide unread data to the start of the buffer
+    if (c->rxIndex > 0) {
+        c->rxCount -= c->rxIndex;
+        if (c->rxCount > 0)
+            os_memmove(c->rxBuffer, c->rxBuffer + c->rxIndex, c->rxCount);
+        c->rxIndex = 0;
+    }
+
+    space = SSCP_RX_BUFFER_MAX - c->rxCount;
+    if (len > space)
+        len = space;
+    if (len > 0) {
+        os_memcpy(c->rxBuffer + c->rxCount, data, len);
+        c->rxCount += len;
+    }
+
+    return len;
+}
+
+static void ICACHE_FLASH_ATTR send_change_event(sscp_connection *connection, int prefix)
+{
+    connection->flags &= ~CONNECTION_INIT;
+    sscp_sendResponse("F,%d,%d,%d", connection->hdr.handle, connection->listenerHandle, connection->rxCount - connection->rxIndex);
+}
+
+static void ICACHE_FLASH_ATTR send_disconnect_event(sscp_connection *connection, int prefix)
+{
+    connection->flags &= ~CONNECTION_TERM;
+    sscp_sendResponse("X,%d,%d", connection->hdr.handle, connection->error);
+}
+
+static void ICACHE_FLASH_ATTR send_data_event(sscp_connection *connection, int prefix)
+{
+    sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount - connection->rxIndex);
+}
+
+static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
+{
+    sscp_connection *connection = (sscp_connection *)hdr;
+
+    if (!connection->d.httpreq.req->replied || connection->d.httpreq.req->complete)
+        return 0;
+
+    // the module has handed over the result of a scheduled fetch
+    if (connection->flags & CONNECTION_INIT) {
+        send_change_event(connection, '=');
+        return 1;
+    }
+
+    // deliver all of the data before reporting the end of the response
+    if (connection->rxIndex < connection->rxCount) {
+        send_data_event(connection, '=');
+        return 1;
+    }
+
+    else if (connection->flags & CONNECTION_TERM) {
+        send_disconnect_event(connection, '=');
+        return 1;
+    }
+
+    return 0;
+}
+
+static void ICACHE_FLASH_ATTR path_handler(sscp_hdr *hdr)
+{
+    sscp_connection *connection = (sscp_connection *)hdr;
+    sscp_sendResponse("S,%s", connection->d.httpreq.req->path);
+}
+
+// this is called after all of the data for a SEND has been received from the MCU
+static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
+{
+    sscp_connection *c = (sscp_connection *)data;
+    char *payload = c->txBuffer + WS_FRAME_HEAD_MAX;
+    int headLength = (count > 125 ? 8 : 6);
+
+    // the header goes right in front of the payload so the frame goes out with a single send
+    // txIndex is the length of the header and txCount the length of the payload
+    ws_send_frame(c, payload - headLength, (c->flags & CONNECTION_TXBINARY) ? WS_OPCODE_BINARY : WS_OPCODE_TEXT, payload, count);
+    c->txIndex = headLength;
+    c->txCount = count;
+    ws_flush(c);
+}
+
+static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
+{
+    sscp_connection *c = (sscp_connection *)hdr;
+
+    if (!c->d.httpreq.req->websocket) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_UNIMPLEMENTED);
+        return;
+    }
+
+    if (c->d.httpreq.state != HTTPREQ_STATE_RECEIVING || c->d.httpreq.req->parseState == PARSE_DONE) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
+        return;
+    }
+
+    if (size > SSCP_TX_BUFFER_MAX - WS_FRAME_HEAD_MAX) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+        return;
+    }
+
+    if (size == 0)
+        sscp_sendResponse("S,0");
+    else {
+        // response is sent by httpreq_sent_cb
+        sscp_capturePayload(c->txBuffer + WS_FRAME_HEAD_MAX, size, send_cb, c);
+        c->flags |= CONNECTION_TXFULL;
+    }
+}
+
+static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
+{
+    sscp_connection *c = (sscp_connection *)hdr;
+    int cnt;
+
+    if (c->rxIndex + size > c->rxCount)
+        size = c->rxCount - c->rxIndex;
+
+    sscp_sendResponse("S,%d", size);
+    if (size > 0) {
+        sscp_sendPayload(c->rxBuffer + c->rxIndex, size);
+        c->rxIndex += size;
+    }
+
+    // refill the buffer from data that didn't fit earlier
+    if (c->d.httpreq.req->pending) {
+        cnt = parse_response(c, c->d.httpreq.req->pending + c->d.httpreq.req->pendingIndex, c->d.httpreq.req->pendingCount - c->d.httpreq.req->pendingIndex);
+        if ((c->d.httpreq.req->pendingIndex += cnt) >= c->d.httpreq.req->pendingCount) {
+            os_free(c->d.httpreq.req->pending);
+            c->d.httpreq.req->pending = NULL;
+            c->d.httpreq.req->pendingCount = c->d.httpreq.req->pendingIndex = 0;
+            if (c->d.httpreq.state == HTTPREQ_STATE_IDLE) {
+                // the server is already gone
+                if (c->d.httpreq.req->parseState == PARSE_BODY && c->d.httpreq.req->contentLength < 0)
+                    c->d.httpreq.req->parseState = PARSE_DONE;
+                if (c->d.httpreq.req->parseState != PARSE_DONE)
+                    c->error = SSCP_ERROR_DISCONNECTED;
+                c->flags |= CONNECTION_TERM;
+            }
+            else
+                espconn_recv_unhold(&c->d.httpreq.conn);
+        }
+    }
+}
+
+static void ICACHE_FLASH_ATTR close_handler(sscp_hdr *hdr)
+{
+    sscp_connection *c = (sscp_connection *)hdr;
+
+    os_timer_disarm(&c->d.httpreq.timer);
+
+    // drop the answer to a lookup that is still in progress
+    c->d.httpreq.lookup = 0;
+
+    switch (c->d.httpreq.state) {
+    case HTTPREQ_STATE_SENDING:
+    case HTTPREQ_STATE_RECEIVING:
+    case HTTPREQ_STATE_CLOSING:
+        c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+        espconn_disconnect(&c->d.httpreq.conn);
+        break;
+    case HTTPREQ_STATE_CONNECTING:
+        // abort the connect so a late connect or error callback can't land on a reused connection
+        c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+        espconn_regist_connectcb(&c->d.httpreq.conn, NULL);
+        espconn_regist_reconcb(&c->d.httpreq.conn, NULL);
+        espconn_disconnect(&c->d.httpreq.conn);
+        break;
+    default:
+        c->d.httpreq.state = HTTPREQ_STATE_IDLE;
+        break;
+    }
+
+    // the connection is closed without request state if allocating it failed
+    if (c->d.httpreq.req) {
+        if (c->d.httpreq.req->pending)
+            os_free(c->d.httpreq.req->pending);
+        os_free(c->d.httpreq.req);
+        c->d.httpreq.req = NULL;
+    }
+}
@@ -5,6 +5,9 @@
 #include "cgiprop.h"
 #include "cgiwifi.h"
 #include "gpio-helpers.h"
+#include "dnscache.h"
+#include "imagecache.h"
+#include "serbridge.h"
 
 static int getVersion(void *data, char *value)
 {
@@ -223,6 +226,61 @@ static int setResetPin(void *data, char *value)
     return 0;
 }
 
+static int setUartRxFull(void *data, char *value)
+{
+    flashConfig.uart_rx_full = atoi(value);
+    uart0_rx_thresholds(flashConfig.uart_rx_full, flashConfig.uart_rx_timeout);
+    return 0;
+}
+
+static int setUartRxTimeout(void *data, char *value)
+{
+    flashConfig.uart_rx_timeout = atoi(value);
+    uart0_rx_thresholds(flashConfig.uart_rx_full, flashConfig.uart_rx_timeout);
+    return 0;
+}
+
+// named uart-rx-full/uart-rx-timeout combinations
+static struct {
+    char *name;
+    int rxFull;
+    int rxTimeout;
+} uartProfiles[] = {
+{   "default",      0,                  0   },
+{   "low-latency",  1,                  1   },  // interrupt as soon as a character arrives
+{   "throughput",   UART_RX_FULL_MAX,   32  },  // batch until the FIFO is nearly full or the line idles
+{   NULL,           0,                  0   }
+};
+
+static int getUartProfile(void *data, char *value)
+{
+    int i;
+    for (i = 0; uartProfiles[i].name; ++i) {
+        if (uartProfiles[i].rxFull == flashConfig.uart_rx_full && uartProfiles[i].rxTimeout == flashConfig.uart_rx_timeout) {
+            os_strcpy(value, uartProfiles[i].name);
+            return 0;
+        }
+    }
+    os_strcpy(value, "custom");
+    return 0;
+}
+
+static int setUartProfile(void *data, char *value)
+{
+    int i;
+    for (i = 0; uartProfiles[i].name; ++i) {
+        if (os_strcmp(value, uartProfiles[i].name) == 0) {
+            flashConfig.uart_rx_full = uartProfiles[i].rxFull;
+            flashConfig.uart_rx_timeout = uartProfiles[i].rxTimeout;
+            uart0_rx_thresholds(flashConfig.uart_rx_full, flashConfig.uart_rx_timeout);
+            // start measuring the new profile
+            serbridgeLatencyReset();
+            return 0;
+        }
+    }
+    return -1;
+}
+
 static int setLoaderBaudrate(void *data, char *value)
 {
     flashConfig.loader_baud_rate = atoi(value);
@@ -415,6 +473,8 @@ static cmd_def vars[] = {
 {   "cmd-loader",       int8GetHandler,     int8SetHandler,     &flashConfig.sscp_loader        },
 {   "cmd-p2-ddloader",  int8GetHandler,     int8SetHandler,     &flashConfig.p2_ddloader_enable },
 {   "loader-baud-rate", intGetHandler,      setLoaderBaudrate,  &flashConfig.loader_baud_rate   },
+{   "fast-loader-baud-rate", intGetHandler, intSetHandler,      &flashConfig.fast_loader_baud_rate },
+{   "p2-baud-escalation", int8GetHandler,   int8SetHandler,     &flashConfig.p2_baud_escalation },
 {   "baud-rate",        intGetHandler,      setBaudrate,        &flashConfig.baud_rate          },
 {   "stop-bits",        int8GetHandler,     setStopBits,        &flashConfig.stop_bits          },
 {   "dbg-baud-rate",    intGetHandler,      setDbgBaudrate,     &flashConfig.dbg_baud_rate      },
@@ -423,6 +483,22 @@ static cmd_def vars[] = {
 {   "reset-pin",        int8GetHandler,     setResetPin,        &flashConfig.reset_pin          },
 {   "connect-led-pin",  int8GetHandler,     int8SetHandler,     &flashConfig.conn_led_pin       },
 {   "rx-pullup",        int8GetHandler,     int8SetHandler,     &flashConfig.rx_pullup          },
+{   "dns-cache-size",   intGetHandler,      intSetHandler,      &flashConfig.dns_cache_size     },
+{   "dns-cache-ttl",    intGetHandler,      intSetHandler,      &flashConfig.dns_cache_ttl      },
+{   "dns-cache-hits",   intGetHandler,      NULL,               &dnsCacheHits                   },
+{   "dns-cache-misses", intGetHandler,      NULL,               &dnsCacheMisses                 },
+{   "image-cache-size", intGetHandler,      intSetHandler,      &flashConfig.image_cache_size   },
+{   "image-cache-hits", intGetHandler,      NULL,               &imageCacheHits                 },
+{   "image-cache-misses", intGetHandler,    NULL,               &imageCacheMisses               },
+{   "load-progress",    fs_get_load_progress, NULL,             NULL                            },
+{   "console-latency",  intGetHandler,      intSetHandler,      &flashConfig.ws_console_latency },
+{   "console-batch",    intGetHandler,      intSetHandler,      &flashConfig.ws_console_batch   },
+{   "uart-rx-full",     intGetHandler,      setUartRxFull,      &flashConfig.uart_rx_full       },
+{   "uart-rx-timeout",  intGetHandler,      setUartRxTimeout,   &flashConfig.uart_rx_timeout    },
+{   "uart-profile",     getUartProfile,     setUartProfile,     NULL                            },
+{   "uart-latency",     intGetHandler,      NULL,               &serbridgeLatencyLast           },
+{   "uart-latency-avg", intGetHandler,      NULL,               &serbridgeLatencyAvg            },
+{   "uart-latency-max", intGetHandler,      NULL,               &serbridgeLatencyMax            },
 {   "pin-gpio0",        getPinHandler,      setPinHandler,      (void *)PIN_GPIO0               },
 {   "pin-gpio1",        getPinHandler,      setPinHandler,      (void *)PIN_GPIO1               },
 {   "pin-gpio2",        getPinHandler,      setPinHandler,      (void *)PIN_GPIO2               },
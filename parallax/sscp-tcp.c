@@ -8,6 +8,15 @@
 #include "esp8266.h"
 #include "sscp.h"
 #include "config.h"
+#include "dnscache.h"
+
+#define TCP_SERVER_TIMEOUT      7200    // seconds, the SDK drops idle clients after 10 by default
+#define TCP_KEEPALIVE_IDLE      30      // seconds
+#define TCP_KEEPALIVE_INTERVAL  5       // seconds
+#define TCP_KEEPALIVE_COUNT     3
+#define TCP_SEND_SEGMENTS       4       // writes queued in lwIP before espconn_send returns ESPCONN_MAXNUM
+#define TCP_COALESCE_TIME       5       // milliseconds to wait for more small SENDs
+#define TCP_COALESCE_MAX        536     // flush right away once this much is waiting
 
 static void dns_cb(const char *name, ip_addr_t *ipaddr, void *arg);
 static void tcp_connect_cb(void *arg);
@@ -15,10 +24,18 @@ static void tcp_discon_cb(void *arg);
 static void tcp_recv_cb(void *arg, char *data, unsigned short len);
 static void tcp_sent_cb(void *arg);
 static void tcp_recon_cb(void *arg, sint8 errType);
+static void tcp_write_finish_cb(void *arg);
+static void tcp_flush(sscp_connection *c);
+static void tcp_coalesce_timer_cb(void *arg);
+static int store_data(sscp_connection *c, char *data, int len);
+static void tcp_accept_cb(void *arg);
+static void tcp_reject(struct espconn *conn);
+static void set_options(struct espconn *conn, int options);
 
 static void send_connect_event(sscp_connection *connection, int prefix);
 static void send_disconnect_event(sscp_connection *connection, int prefix);
 static void send_data_event(sscp_connection *connection, int prefix);
+static void send_error_event(sscp_connection *connection, int prefix);
 static int checkForEvents_handler(sscp_hdr *hdr);
 static void send_handler(sscp_hdr *hdr, int size);
 static void recv_handler(sscp_hdr *hdr, int size);
@@ -32,13 +49,14 @@ static sscp_dispatch tcpDispatch = {
     .close = close_handler
 };
 
+// CONNECT,host,port[,options]
 void ICACHE_FLASH_ATTR tcp_do_connect(int argc, char *argv[])
 {
     sscp_connection *c;
     struct espconn *conn;
     ip_addr_t ipAddr;
 
-    if (argc != 3) {
+    if (argc < 3 || argc > 4) {
         sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
         return;
     }
@@ -51,6 +69,8 @@ void ICACHE_FLASH_ATTR tcp_do_connect(int argc, char *argv[])
     conn = &c->d.tcp.conn;
 
     os_memset(&c->d.tcp, 0, sizeof(c->d.tcp));
+    c->d.tcp.pConn = conn;
+    c->d.tcp.options = argc > 3 ? atoi(argv[3]) : 0;
     conn->type = ESPCONN_TCP;
     conn->state = ESPCONN_NONE;
     conn->proto.tcp = &c->d.tcp.tcp;
@@ -63,7 +83,7 @@ void ICACHE_FLASH_ATTR tcp_do_connect(int argc, char *argv[])
     if (isdigit((int)*argv[1]))
         ipAddr.addr = ipaddr_addr(argv[1]);
     else {
-        switch (espconn_gethostbyname(conn, argv[1], &ipAddr, dns_cb)) {
+        switch (dnsCacheGetHostByName(conn, argv[1], &ipAddr, dns_cb)) {
         case ESPCONN_OK:
             // connect below
             break;
@@ -120,6 +140,169 @@ static void ICACHE_FLASH_ATTR dns_cb(const char *name, ip_addr_t *ipaddr, void *
     c->d.tcp.state = TCP_STATE_CONNECTING;
 }
 
+// start accepting connections for LISTEN,TCP,port[,backlog[,options]]
+int ICACHE_FLASH_ATTR tcp_listen(sscp_listener *listener, int port, int backlog, int options)
+{
+    struct espconn *conn = &listener->conn;
+
+    os_memset(conn, 0, sizeof(struct espconn));
+    os_memset(&listener->tcp, 0, sizeof(esp_tcp));
+    conn->type = ESPCONN_TCP;
+    conn->state = ESPCONN_NONE;
+    conn->proto.tcp = &listener->tcp;
+    conn->proto.tcp->local_port = port;
+    conn->reverse = (void *)listener;
+    listener->options = options;
+
+    espconn_regist_connectcb(conn, tcp_accept_cb);
+
+    if (espconn_accept(conn) != ESPCONN_OK) {
+        sscp_log("TCP: can't listen on port %d", port);
+        return SSCP_ERROR_CONNECT_FAILED;
+    }
+
+    espconn_regist_time(conn, TCP_SERVER_TIMEOUT, 0);
+
+    // limit the number of clients the server will accept at once
+    if (backlog > 0)
+        espconn_tcp_set_max_con_allow(conn, backlog);
+
+    sscp_log("TCP: listening on port %d, backlog %d, options %d", port, backlog, options);
+    return 0;
+}
+
+// the SDK can't delete a server that still has clients so the listener stays open until they are closed
+int ICACHE_FLASH_ATTR tcp_close_listener(sscp_listener *listener)
+{
+    int i;
+
+    for (i = 0; i < SSCP_CONNECTION_MAX; ++i) {
+        sscp_connection *c = &sscp_connections[i];
+        if (c->hdr.type == TYPE_TCP_CONNECTION && c->listenerHandle == listener->hdr.handle)
+            return SSCP_ERROR_BUSY;
+    }
+
+    if (espconn_delete(&listener->conn) != ESPCONN_OK) {
+        sscp_log("TCP: can't stop listening on port %d", listener->tcp.local_port);
+        return SSCP_ERROR_BUSY;
+    }
+
+    return 0;
+}
+
+static void ICACHE_FLASH_ATTR tcp_accept_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_listener *listener = NULL;
+    sscp_connection *c;
+    int i;
+
+    for (i = 0; i < SSCP_LISTENER_MAX; ++i) {
+        if (sscp_listeners[i].hdr.type == TYPE_TCP_LISTENER
+        &&  sscp_listeners[i].tcp.local_port == conn->proto.tcp->local_port) {
+            listener = &sscp_listeners[i];
+            break;
+        }
+    }
+
+    if (!listener || !(c = sscp_allocate_connection(TYPE_TCP_CONNECTION, &tcpDispatch))) {
+        sscp_log("TCP: rejecting connection on port %d", conn->proto.tcp->local_port);
+        tcp_reject(conn);
+        return;
+    }
+
+    // CONNECTION_INIT is set so the MCU gets a T,handle,listener event
+    c->listenerHandle = listener->hdr.handle;
+    c->d.tcp.pConn = conn;
+    c->d.tcp.options = listener->options;
+    conn->reverse = (void *)c;
+
+    set_options(conn, listener->options);
+
+    espconn_regist_reconcb(conn, tcp_recon_cb);
+    espconn_regist_disconcb(conn, tcp_discon_cb);
+    espconn_regist_recvcb(conn, tcp_recv_cb);
+    espconn_regist_sentcb(conn, tcp_sent_cb);
+    c->d.tcp.state = TCP_STATE_CONNECTED;
+
+    sscp_log("TCP: %d accepted on port %d", c->hdr.handle, conn->proto.tcp->local_port);
+}
+
+static void ICACHE_FLASH_ATTR set_options(struct espconn *conn, int options)
+{
+    uint32 value;
+
+    // let espconn copy each write so several can be in flight while txBuffer is refilled
+    espconn_set_opt(conn, ESPCONN_COPY);
+    espconn_tcp_set_buf_count(conn, TCP_SEND_SEGMENTS);
+    espconn_regist_write_finish(conn, tcp_write_finish_cb);
+
+    if (options & SSCP_TCP_NODELAY)
+        espconn_set_opt(conn, ESPCONN_NODELAY);
+
+    if (options & SSCP_TCP_KEEPALIVE) {
+        espconn_set_opt(conn, ESPCONN_KEEPALIVE);
+        value = TCP_KEEPALIVE_IDLE;
+        espconn_set_keepalive(conn, ESPCONN_KEEPIDLE, &value);
+        value = TCP_KEEPALIVE_INTERVAL;
+        espconn_set_keepalive(conn, ESPCONN_KEEPINTVL, &value);
+        value = TCP_KEEPALIVE_COUNT;
+        espconn_set_keepalive(conn, ESPCONN_KEEPCNT, &value);
+    }
+}
+
+// a client that can't be given a connection is dropped once the accept callback returns
+typedef struct {
+    ETSTimer timer;
+    struct espconn *conn;
+} tcp_reject_def;
+
+static void ICACHE_FLASH_ATTR reject_discon_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    tcp_reject_def *r = (tcp_reject_def *)conn->reverse;
+    if (r)
+        r->conn = NULL;
+}
+
+static void ICACHE_FLASH_ATTR reject_recon_cb(void *arg, sint8 errType)
+{
+    reject_discon_cb(arg);
+}
+
+static void ICACHE_FLASH_ATTR reject_recv_cb(void *arg, char *data, unsigned short len)
+{
+    // discard anything the client sends before it is disconnected
+}
+
+static void ICACHE_FLASH_ATTR reject_timer_cb(void *arg)
+{
+    tcp_reject_def *r = (tcp_reject_def *)arg;
+    if (r->conn) {
+        r->conn->reverse = NULL;
+        espconn_disconnect(r->conn);
+    }
+    os_free(r);
+}
+
+static void ICACHE_FLASH_ATTR tcp_reject(struct espconn *conn)
+{
+    tcp_reject_def *r;
+
+    conn->reverse = NULL;
+    espconn_regist_recvcb(conn, reject_recv_cb);
+    espconn_regist_disconcb(conn, reject_discon_cb);
+    espconn_regist_reconcb(conn, reject_recon_cb);
+
+    if (!(r = (tcp_reject_def *)os_zalloc(sizeof(tcp_reject_def))))
+        return;
+    r->conn = conn;
+    conn->reverse = (void *)r;
+    os_timer_disarm(&r->timer);
+    os_timer_setfn(&r->timer, reject_timer_cb, r);
+    os_timer_arm(&r->timer, 0, 0);
+}
+
 static void ICACHE_FLASH_ATTR tcp_connect_cb(void *arg)
 {
     struct espconn *conn = (struct espconn *)arg;
@@ -129,6 +312,8 @@ static void ICACHE_FLASH_ATTR tcp_connect_cb(void *arg)
     espconn_regist_recvcb(conn, tcp_recv_cb);
     espconn_regist_sentcb(conn, tcp_sent_cb);
 
+    set_options(conn, c->d.tcp.options);
+
     c->d.tcp.state = TCP_STATE_CONNECTED;
     sscp_sendResponse("S,%d", c->hdr.handle);
 }
@@ -137,32 +322,87 @@ static void ICACHE_FLASH_ATTR tcp_discon_cb(void *arg)
 {
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
+
+    // the connection was closed while the SDK still had a callback pending
+    if (!c)
+        return;
+
     c->flags |= CONNECTION_TERM;
     sscp_log("TCP: %d disconnected", c->hdr.handle);
     c->d.tcp.state = TCP_STATE_IDLE;
+
+    // the SDK frees the espconn of an accepted client
+    if (c->listenerHandle)
+        c->d.tcp.pConn = NULL;
 }
 
 static void ICACHE_FLASH_ATTR tcp_recv_cb(void *arg, char *data, unsigned short len)
 {
-    int i;
-
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
+    int cnt = 0, remaining, pendingCount;
+    char *pending;
+
+    if (!c)
+        return;
+
     sscp_log("TCP: %d received %d bytes", c->hdr.handle, len);
-    i = c->rxCount;
-    if ((len + i)> SSCP_RX_BUFFER_MAX)
-         len = SSCP_RX_BUFFER_MAX - i;
-    if (len > 0) {
-        os_memcpy(c->rxBuffer + i, data, len);
-        c->rxCount = i + len;
-        c->rxIndex = 0;
-        if (c->rxCount >= SSCP_RX_BUFFER_MAX)
-            c->flags |= CONNECTION_RXFULL;
-        sscp_log("TCP: added %d bytes to buffer", len);
+
+    // data can't be added to rxBuffer ahead of what is already waiting
+    if (!c->d.tcp.pending)
+        cnt = store_data(c, data, len);
+
+    // keep the rest and stop the sender until the MCU has read rxBuffer
+    if ((remaining = len - cnt) > 0) {
+        pendingCount = c->d.tcp.pendingCount - c->d.tcp.pendingIndex;
+        if (!(pending = (char *)os_malloc(pendingCount + remaining))) {
+            sscp_log("TCP: %d dropped %d bytes", c->hdr.handle, remaining);
+            remaining = 0;
+        }
+        else {
+            if (c->d.tcp.pending) {
+                os_memcpy(pending, c->d.tcp.pending + c->d.tcp.pendingIndex, pendingCount);
+                os_free(c->d.tcp.pending);
+            }
+            os_memcpy(pending + pendingCount, data + cnt, remaining);
+            c->d.tcp.pending = pending;
+            c->d.tcp.pendingCount = pendingCount + remaining;
+            c->d.tcp.pendingIndex = 0;
+            espconn_recv_hold(conn);
+        }
+    }
+
+    if (cnt > 0 || remaining > 0) {
         if (flashConfig.sscp_events && !(c->flags & CONNECTION_RXFULL))
             send_data_event(c, '!');
+        c->flags |= CONNECTION_RXFULL;
     }
-    c->flags |= CONNECTION_RXFULL;
+}
+
+// add received data to rxBuffer, returns the number of bytes that fit
+static int ICACHE_FLASH_ATTR store_data(sscp_connection *c, char *data, int len)
+{
+    int cnt;
+
+    // reuse the buffer once the MCU has read everything in it
+    if (c->rxIndex >= c->rxCount)
+        c->rxIndex = c->rxCount = 0;
+
+    // only move unread data when the new data wouldn't fit behind it
+    else if (c->rxCount + len > SSCP_RX_BUFFER_MAX && c->rxIndex > 0) {
+        os_memmove(c->rxBuffer, c->rxBuffer + c->rxIndex, c->rxCount - c->rxIndex);
+        c->rxCount -= c->rxIndex;
+        c->rxIndex = 0;
+    }
+
+    if ((cnt = SSCP_RX_BUFFER_MAX - c->rxCount) > len)
+        cnt = len;
+    if (cnt > 0) {
+        os_memcpy(c->rxBuffer + c->rxCount, data, cnt);
+        c->rxCount += cnt;
+    }
+
+    return cnt;
 }
 
 static void ICACHE_FLASH_ATTR tcp_recon_cb(void *arg, sint8 errType)
@@ -170,7 +410,19 @@ static void ICACHE_FLASH_ATTR tcp_recon_cb(void *arg, sint8 errType)
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
 
+    if (!c)
+        return;
+
     c->d.tcp.state = TCP_STATE_IDLE;
+
+    // an accepted client was reset, there is no CONNECT waiting for a response
+    if (c->listenerHandle) {
+        sscp_log("TCP: %d reset, error %d", c->hdr.handle, errType);
+        c->d.tcp.pConn = NULL;
+        c->flags |= CONNECTION_TERM;
+        return;
+    }
+
     sscp_sendResponse("E,%d", SSCP_ERROR_DISCONNECTED);
 }
 
@@ -178,9 +430,65 @@ static void ICACHE_FLASH_ATTR tcp_sent_cb(void *arg)
 {
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
-    c->flags &= ~CONNECTION_TXFULL;
+
+    if (!c)
+        return;
+
+    // SEND was answered when its data was queued
     c->flags |= CONNECTION_TXDONE;
-    sscp_sendResponse("S,0");
+}
+
+// called when espconn has room for another write
+static void ICACHE_FLASH_ATTR tcp_write_finish_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_connection *c = (sscp_connection *)conn->reverse;
+
+    if (!c)
+        return;
+
+    if (c->txCount > 0)
+        tcp_flush(c);
+}
+
+// hand the data collected in txBuffer to espconn, it stays there if all of the write buffers are in use
+static void ICACHE_FLASH_ATTR tcp_flush(sscp_connection *c)
+{
+    struct espconn *conn = c->d.tcp.pConn;
+
+    // a SEND payload is still arriving behind txCount, send_cb flushes when it is complete
+    if (c->flags & CONNECTION_TXCAPTURE)
+        return;
+
+    os_timer_disarm(&c->d.tcp.timer);
+
+    if (c->txCount == 0 || !conn)
+        return;
+
+    switch (espconn_send(conn, (uint8 *)c->txBuffer, c->txCount)) {
+    case ESPCONN_OK:
+        c->txCount = 0;
+        c->flags &= ~CONNECTION_TXFULL;
+        break;
+    case ESPCONN_MAXNUM:
+        // tcp_write_finish_cb tries again
+        c->flags |= CONNECTION_TXFULL;
+        break;
+    default:
+        sscp_log("TCP: %d send of %d bytes failed", c->hdr.handle, c->txCount);
+        c->error = SSCP_ERROR_SEND_FAILED;
+        c->txCount = 0;
+        c->flags &= ~CONNECTION_TXFULL;
+        // the SENDs were already answered, otherwise POLL or the next SEND reports it
+        if (flashConfig.sscp_events)
+            send_error_event(c, '!');
+        break;
+    }
+}
+
+static void ICACHE_FLASH_ATTR tcp_coalesce_timer_cb(void *arg)
+{
+    tcp_flush((sscp_connection *)arg);
 }
 
 static void ICACHE_FLASH_ATTR send_connect_event(sscp_connection *connection, int prefix)
@@ -197,13 +505,24 @@ static void ICACHE_FLASH_ATTR send_disconnect_event(sscp_connection *connection,
 
 static void ICACHE_FLASH_ATTR send_data_event(sscp_connection *connection, int prefix)
 {
-    sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount);
+    sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount - connection->rxIndex);
+}
+
+static void ICACHE_FLASH_ATTR send_error_event(sscp_connection *connection, int prefix)
+{
+    sscp_send(prefix, "E,%d,%d", connection->hdr.handle, connection->error);
+    connection->error = 0;
 }
 
 static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
     
+    if (connection->error) {
+        send_error_event(connection, '=');
+        return 1;
+    }
+    
     if (connection->flags & CONNECTION_TERM) {
         send_disconnect_event(connection, '=');
         return 1;
@@ -226,10 +545,18 @@ static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
 static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
 {
     sscp_connection *c = (sscp_connection *)data;
-    struct espconn *conn = &c->d.tcp.conn;
-    if (espconn_send(conn, (uint8 *)c->txBuffer, count) != ESPCONN_OK) {
-        c->flags &= ~CONNECTION_TXFULL;
-        sscp_sendResponse("E,%d", SSCP_ERROR_SEND_FAILED);
+
+    c->flags &= ~CONNECTION_TXCAPTURE;
+    c->txCount += count;
+    sscp_sendResponse("S,0");
+
+    // small SENDs wait briefly so they can go out together
+    if ((c->d.tcp.options & SSCP_TCP_NODELAY) || c->txCount >= TCP_COALESCE_MAX)
+        tcp_flush(c);
+    else {
+        os_timer_disarm(&c->d.tcp.timer);
+        os_timer_setfn(&c->d.tcp.timer, tcp_coalesce_timer_cb, c);
+        os_timer_arm(&c->d.tcp.timer, TCP_COALESCE_TIME, 0);
     }
 }
 
@@ -242,20 +569,42 @@ static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
         return;
     }
     
+    if (size > SSCP_TX_BUFFER_MAX) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+        return;
+    }
+
+    // an earlier SEND that was already answered didn't make it out
+    if (c->error) {
+        sscp_sendResponse("E,%d", c->error);
+        c->error = 0;
+        return;
+    }
+
+    // make room by handing what is already collected to espconn
+    if (c->txCount + size > SSCP_TX_BUFFER_MAX)
+        tcp_flush(c);
+    if (c->txCount + size > SSCP_TX_BUFFER_MAX) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
+
     if (size == 0)
         sscp_sendResponse("S,0");
     else {
-        // response is sent by tcp_sent_cb
-        sscp_capturePayload(c->txBuffer, size, send_cb, c);
-        c->flags |= CONNECTION_TXFULL;
+        // response is sent by send_cb once the data is queued, nothing may flush txBuffer until then
+        os_timer_disarm(&c->d.tcp.timer);
+        c->flags |= CONNECTION_TXCAPTURE;
+        sscp_capturePayload(c->txBuffer + c->txCount, size, send_cb, c);
     }
 }
 
 static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
+    int cnt;
     
-    if (connection->rxCount == 0) {
+    if (connection->rxIndex >= connection->rxCount) {
         sscp_sendResponse("S,0");
         return;
     }
@@ -263,12 +612,29 @@ static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
     if (connection->rxIndex + size > connection->rxCount)
         size = connection->rxCount - connection->rxIndex;
 
+    // the payload goes straight from rxBuffer to the UART
     sscp_sendResponse("S,%d", size);
     if (size > 0) {
         sscp_sendPayload(connection->rxBuffer + connection->rxIndex, size);
         connection->rxIndex += size;
     }
     
+    // refill from the held data and let the sender continue once it is all in rxBuffer
+    if (connection->d.tcp.pending) {
+        cnt = store_data(connection, connection->d.tcp.pending + connection->d.tcp.pendingIndex, connection->d.tcp.pendingCount - connection->d.tcp.pendingIndex);
+        if ((connection->d.tcp.pendingIndex += cnt) >= connection->d.tcp.pendingCount) {
+            os_free(connection->d.tcp.pending);
+            connection->d.tcp.pending = NULL;
+            connection->d.tcp.pendingCount = connection->d.tcp.pendingIndex = 0;
+            if (connection->d.tcp.pConn)
+                espconn_recv_unhold(connection->d.tcp.pConn);
+        }
+
+        // RXFULL stays set, so tcp_recv_cb won't announce the data that was moved in
+        if (cnt > 0 && flashConfig.sscp_events)
+            send_data_event(connection, '!');
+    }
+
     if (connection->rxIndex >= connection->rxCount)
         connection->flags &= ~CONNECTION_RXFULL;
 }
@@ -276,7 +642,20 @@ static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
 static void ICACHE_FLASH_ATTR close_handler(sscp_hdr *hdr)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
-    struct espconn *conn = &connection->d.tcp.conn;
-    if (conn)
+    struct espconn *conn = connection->d.tcp.pConn;
+
+    // send whatever is still being coalesced before the FIN
+    tcp_flush(connection);
+
+    if (connection->d.tcp.pending) {
+        os_free(connection->d.tcp.pending);
+        connection->d.tcp.pending = NULL;
+    }
+
+    if (conn) {
+        // don't let callbacks for an accepted client find the freed connection
+        if (connection->listenerHandle)
+            conn->reverse = NULL;
         espconn_disconnect(conn);
+    }
 }
@@ -9,10 +9,16 @@
 #include "esp8266.h"
 #include "sscp.h"
 #include "config.h"
+#include "dnscache.h"
+
+// each datagram received by an unconnected socket is queued in rxBuffer with this header
+#define UDP_DGRAM_HDR_SIZE	8	// source ip[4], source port[2], length[2]
 
 static void dns_cb(const char *name, ip_addr_t *ipaddr, void *arg);
 static void udp_recv_cb(void *arg, char *data, unsigned short len);
 static void udp_sent_cb(void *arg);
+static void udp_unconnected(int localPort);
+static int next_datagram(sscp_connection *c, uint8 *ip, int *port);
 
 static void send_data_event(sscp_connection *connection, int prefix);
 static int checkForEvents_handler(sscp_hdr *hdr);
@@ -28,6 +34,10 @@ static sscp_dispatch udpDispatch = {
     .close = close_handler
 };
 
+// UDP,host,port
+// UDP,*,local-port
+//
+// The second form creates an unconnected socket that uses SENDTO and RECVFROM
 void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
 {
 	sscp_connection *c;
@@ -39,6 +49,11 @@ void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
 		return;
 	}
 
+	if (os_strcmp(argv[1], "*") == 0) {
+		udp_unconnected(atoi(argv[2]));
+		return;
+	}
+
 	// allocate a connection
 	if (!(c = sscp_allocate_connection(TYPE_UDP_CONNECTION, &udpDispatch))) {
 		sscp_sendResponse("E,%d", SSCP_ERROR_NO_FREE_CONNECTION);
@@ -63,7 +78,7 @@ void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
             ipAddr.addr = ipaddr_addr(argv[1]);
 	}
 	else {
-		switch (espconn_gethostbyname(conn, argv[1], &ipAddr, dns_cb)) {
+		switch (dnsCacheGetHostByName(conn, argv[1], &ipAddr, dns_cb)) {
 		case ESPCONN_OK:
 			// connect below
 			break;
@@ -94,6 +109,171 @@ void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
 	sscp_sendResponse("S,%d", c->hdr.handle);
 }
 
+static void ICACHE_FLASH_ATTR udp_unconnected(int localPort)
+{
+	sscp_connection *c;
+	struct espconn *conn;
+
+	if (localPort <= 0 || localPort > 65535) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	if (!(c = sscp_allocate_connection(TYPE_UDP_CONNECTION, &udpDispatch))) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_NO_FREE_CONNECTION);
+		return;
+	}
+
+	conn = &c->d.udp.conn;
+	os_memset(&c->d.udp, 0, sizeof(c->d.udp));
+	conn->type = ESPCONN_UDP;
+	conn->state = ESPCONN_NONE;
+	conn->proto.udp = &c->d.udp.udp;
+	conn->proto.udp->local_port = localPort;
+	conn->reverse = (void *)c;
+	c->d.udp.unconnected = 1;
+
+	espconn_regist_recvcb(conn, udp_recv_cb);
+	espconn_regist_sentcb(conn, udp_sent_cb);
+
+	if (espconn_create(conn) != 0) {
+		sscp_close_connection(c);
+		sscp_sendResponse("E,%d", SSCP_ERROR_CONNECT_FAILED);
+		return;
+	}
+
+	// send broadcasts out of every interface that is up
+	wifi_set_broadcast_if(wifi_get_opmode());
+
+	c->d.udp.state = TCP_STATE_CONNECTED;
+	sscp_sendResponse("S,%d", c->hdr.handle);
+}
+
+static sscp_connection ICACHE_FLASH_ATTR *get_unconnected(char *handle)
+{
+	sscp_connection *c;
+
+	if (!(c = sscp_get_connection(atoi(handle))) || c->hdr.type != TYPE_UDP_CONNECTION || !c->d.udp.unconnected) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	return c;
+}
+
+// SENDTO,chan,ip,port,count
+void ICACHE_FLASH_ATTR udp_do_sendto(int argc, char *argv[])
+{
+	sscp_connection *c;
+	uint32 addr;
+	int port, count;
+
+	if (argc != 5) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+		return;
+	}
+
+	if (!(c = get_unconnected(argv[1])))
+		return;
+
+	if (c->flags & CONNECTION_TXFULL) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+		return;
+	}
+
+	// no lookups here, a DNS round trip per datagram would defeat the purpose
+	if (!isdigit((int)*argv[2]) || (port = atoi(argv[3])) <= 0 || port > 65535) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+	addr = ipaddr_addr(argv[2]);
+
+	if ((count = atoi(argv[4])) <= 0 || count > SSCP_TX_BUFFER_MAX) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+		return;
+	}
+
+	os_memcpy(c->d.udp.destIp, &addr, 4);
+	c->d.udp.destPort = port;
+
+	// the rest works just like SEND
+	send_handler((sscp_hdr *)c, count);
+}
+
+// RECVFROM,chan,count
+void ICACHE_FLASH_ATTR udp_do_recvfrom(int argc, char *argv[])
+{
+	sscp_connection *c;
+	uint8 ip[4];
+	int port, size, count;
+
+	if (argc != 3) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+		return;
+	}
+
+	if (!(c = get_unconnected(argv[1])))
+		return;
+
+	if ((count = atoi(argv[2])) < 0) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	if ((size = next_datagram(c, ip, &port)) < 0) {
+		sscp_sendResponse("S,0,0.0.0.0,0");
+		return;
+	}
+
+	// whatever doesn't fit in count is dropped just like recvfrom()
+	if (size > count)
+		size = count;
+	sscp_sendResponse("S,%d,%d.%d.%d.%d,%d", size, ip[0], ip[1], ip[2], ip[3], port);
+	if (size > 0)
+		sscp_sendPayload(c->rxBuffer + c->rxIndex + UDP_DGRAM_HDR_SIZE, size);
+	recv_handler((sscp_hdr *)c, -1);
+}
+
+// UDPJOIN,chan,group
+void ICACHE_FLASH_ATTR udp_do_join(int argc, char *argv[])
+{
+	struct ip_info info;
+	sscp_connection *c;
+	ip_addr_t group;
+
+	if (argc != 3) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+		return;
+	}
+
+	if (!(c = get_unconnected(argv[1])))
+		return;
+
+	group.addr = ipaddr_addr(argv[2]);
+	if ((group.addr & 0xf0) != 0xe0) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	if (!wifi_get_ip_info(STATION_IF, &info) || info.ip.addr == 0)
+		wifi_get_ip_info(SOFTAP_IF, &info);
+
+	// only one group per socket, joining another leaves the previous one
+	if (c->d.udp.group.addr) {
+		espconn_igmp_leave(&c->d.udp.groupIf, &c->d.udp.group);
+		c->d.udp.group.addr = 0;
+	}
+
+	if (espconn_igmp_join(&info.ip, &group) != ESPCONN_OK) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INTERNAL_ERROR);
+		return;
+	}
+	c->d.udp.group = group;
+	c->d.udp.groupIf = info.ip;
+
+	sscp_sendResponse("S,0");
+}
+
 static void ICACHE_FLASH_ATTR dns_cb(const char *name, ip_addr_t *ipaddr, void *arg)
 {
 	struct espconn *conn = (struct espconn *)arg;
@@ -130,6 +310,44 @@ static void ICACHE_FLASH_ATTR udp_recv_cb(void *arg, char *data, unsigned short
 	struct espconn *conn = (struct espconn *)arg;
 	sscp_connection *c = (sscp_connection *)conn->reverse;
 	sscp_log("UDP Handle: %d received %d bytes", c->hdr.handle, len);
+
+	// queue the datagram along with where it came from
+	if (c->d.udp.unconnected) {
+		remot_info *remote;
+		uint8 *hdr;
+
+		if (c->rxIndex >= c->rxCount)
+			c->rxIndex = c->rxCount = 0;
+		if (c->rxCount + UDP_DGRAM_HDR_SIZE + len > SSCP_RX_BUFFER_MAX && c->rxIndex > 0) {
+			c->rxCount -= c->rxIndex;
+			os_memmove(c->rxBuffer, c->rxBuffer + c->rxIndex, c->rxCount);
+			c->rxIndex = 0;
+		}
+		if (c->rxCount + UDP_DGRAM_HDR_SIZE + len > SSCP_RX_BUFFER_MAX) {
+			sscp_log("UDP Handle: %d queue full, dropped %d bytes", c->hdr.handle, len);
+			return;
+		}
+		if (espconn_get_connection_info(conn, &remote, 0) != 0)
+			return;
+
+		hdr = (uint8 *)c->rxBuffer + c->rxCount;
+		os_memcpy(hdr, remote->remote_ip, 4);
+		hdr[4] = remote->remote_port >> 8;
+		hdr[5] = remote->remote_port;
+		hdr[6] = len >> 8;
+		hdr[7] = len;
+		os_memcpy(hdr + UDP_DGRAM_HDR_SIZE, data, len);
+		c->rxCount += UDP_DGRAM_HDR_SIZE + len;
+
+		// only announce the first datagram, the rest are found by polling
+		if (!(c->flags & CONNECTION_RXFULL)) {
+			c->flags |= CONNECTION_RXFULL;
+			if (flashConfig.sscp_events)
+				send_data_event(c, '!');
+		}
+		return;
+	}
+
 	if (!(c->flags & CONNECTION_RXFULL)) {
 		if (len > SSCP_RX_BUFFER_MAX)
                    len = SSCP_RX_BUFFER_MAX;
@@ -157,6 +375,13 @@ static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
 	sscp_connection *c = (sscp_connection *)data;
 	struct espconn *conn = &c->d.udp.conn;
 	conn->state = ESPCONN_NONE;
+
+	// a datagram received since SENDTO has changed the remote address
+	if (c->d.udp.unconnected) {
+		os_memcpy(c->d.udp.udp.remote_ip, c->d.udp.destIp, 4);
+		c->d.udp.udp.remote_port = c->d.udp.destPort;
+	}
+
 	if (espconn_sendto(conn, (uint8 *)c->txBuffer, count) != ESPCONN_OK) {
 		c->flags &= ~CONNECTION_TXFULL;
 		sscp_sendResponse("E,%d", SSCP_ERROR_SEND_FAILED);
@@ -166,7 +391,7 @@ static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
 static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
 {
 	sscp_connection *c = (sscp_connection *)hdr;
-	if (c->d.udp.state != TCP_STATE_CONNECTED) {
+	if (c->d.udp.state != TCP_STATE_CONNECTED || (c->d.udp.unconnected && !c->d.udp.destPort)) {
 		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
 		return;
 	}
@@ -180,10 +405,47 @@ static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
 	}
 }
 
+// returns the length of the next queued datagram or -1 if there isn't one
+static int ICACHE_FLASH_ATTR next_datagram(sscp_connection *c, uint8 *ip, int *port)
+{
+	uint8 *hdr = (uint8 *)c->rxBuffer + c->rxIndex;
+
+	if (c->rxIndex >= c->rxCount)
+		return -1;
+
+	if (ip)
+		os_memcpy(ip, hdr, 4);
+	if (port)
+		*port = (hdr[4] << 8) | hdr[5];
+	return (hdr[6] << 8) | hdr[7];
+}
+
 static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
 {
 	sscp_connection *connection = (sscp_connection *)hdr;
 
+	// RECV on an unconnected socket returns the next datagram without its source
+	// a negative size just drops the next datagram after RECVFROM has sent it
+	if (connection->d.udp.unconnected) {
+		int length = next_datagram(connection, NULL, NULL);
+		if (size >= 0) {
+			if (length < 0) {
+				sscp_sendResponse("S,0");
+				return;
+			}
+			if (size > length)
+				size = length;
+			sscp_sendResponse("S,%d", size);
+			if (size > 0)
+				sscp_sendPayload(connection->rxBuffer + connection->rxIndex + UDP_DGRAM_HDR_SIZE, size);
+		}
+		if (length >= 0)
+			connection->rxIndex += UDP_DGRAM_HDR_SIZE + length;
+		if (connection->rxIndex >= connection->rxCount)
+			connection->flags &= ~CONNECTION_RXFULL;
+		return;
+	}
+
 	if (!(connection->flags & CONNECTION_RXFULL)) {
 		sscp_sendResponse("S,0");
 		return;
@@ -205,7 +467,10 @@ static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
 
 static void ICACHE_FLASH_ATTR send_data_event(sscp_connection *connection, int prefix)
 {
-	sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount);
+	if (connection->d.udp.unconnected)
+		sscp_sendResponse("D,%d,%d", connection->hdr.handle, next_datagram(connection, NULL, NULL));
+	else
+		sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount);
 }
 
 static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
@@ -224,6 +489,10 @@ static void ICACHE_FLASH_ATTR close_handler(sscp_hdr *hdr)
 {
 	sscp_connection *connection = (sscp_connection *)hdr;
 	struct espconn *conn = &connection->d.udp.conn;
+	if (connection->d.udp.group.addr) {
+		espconn_igmp_leave(&connection->d.udp.groupIf, &connection->d.udp.group);
+		connection->d.udp.group.addr = 0;
+	}
 	if (conn)
 		espconn_delete(conn);
 }
\ No newline at end of file
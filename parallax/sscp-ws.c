@@ -12,6 +12,7 @@
 static void send_connect_event(sscp_connection *connection, int prefix);
 static void send_disconnect_event(sscp_connection *connection, int prefix);
 static void send_data_event(sscp_connection *connection, int prefix);
+static void send_txready_event(sscp_connection *connection, int prefix);
 static int checkForEvents_handler(sscp_hdr *hdr);
 static void path_handler(sscp_hdr *hdr); 
 static void send_handler(sscp_hdr *hdr, int size);
@@ -51,6 +52,18 @@ static void ICACHE_FLASH_ATTR websocketCloseCb(Websock *ws)
 {
 	sscp_connection *connection = (sscp_connection *)ws->userData;
     connection->d.ws.ws = NULL;
+    connection->flags |= CONNECTION_TERM;
+}
+
+static void ICACHE_FLASH_ATTR websocketWritableCb(Websock *ws)
+{
+	sscp_connection *connection = (sscp_connection *)ws->userData;
+    if (connection->flags & CONNECTION_TXFULL) {
+        connection->flags &= ~CONNECTION_TXFULL;
+        connection->flags |= CONNECTION_TXREADY;
+        if (flashConfig.sscp_events)
+            send_txready_event(connection, '!');
+    }
 }
 
 void ICACHE_FLASH_ATTR sscp_websocketConnect(Websock *ws)
@@ -76,6 +89,7 @@ void ICACHE_FLASH_ATTR sscp_websocketConnect(Websock *ws)
     ws->recvCb = websocketRecvCb;
     ws->sentCb = websocketSentCb;
     ws->closeCb = websocketCloseCb;
+    ws->writableCb = websocketWritableCb;
     ws->userData = connection;
 }
 
@@ -96,15 +110,29 @@ static void ICACHE_FLASH_ATTR send_data_event(sscp_connection *connection, int p
     sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount);
 }
 
+// tells the MCU how much it can send now that a refused SEND would fit
+static void ICACHE_FLASH_ATTR send_txready_event(sscp_connection *connection, int prefix)
+{
+    Websock *ws = connection->d.ws.ws;
+    connection->flags &= ~CONNECTION_TXREADY;
+    sscp_sendResponse("C,%d,%d", connection->hdr.handle, ws ? cgiWebsocketSendCredit(ws) : 0);
+}
+
 static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
     
+    // a websocket that went away is still reported so the MCU can free its handle
+    if (connection->flags & CONNECTION_TERM) {
+        send_disconnect_event(connection, '=');
+        return 1;
+    }
+    
     if (!connection->d.ws.ws)
         return 0;
     
-    if (connection->flags & CONNECTION_TERM) {
-        send_disconnect_event(connection, '=');
+    if (connection->flags & CONNECTION_TXREADY) {
+        send_txready_event(connection, '=');
         return 1;
     }
     
@@ -140,10 +168,21 @@ static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
     sscp_connection *connection = (sscp_connection *)data;
     Websock *ws = (Websock *)connection->d.ws.ws;
 
-    char sendBuff[1024];
-    httpdSetSendBuffer(ws->conn, sendBuff, sizeof(sendBuff));
-    cgiWebsocketSend(ws, connection->txBuffer, count, WEBSOCK_FLAG_NONE);
-    connection->flags &= ~CONNECTION_TXFULL;
+    if (!ws) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_DISCONNECTED);
+        return;
+    }
+
+    // the frame is queued on the websocket, so no send buffer is needed outside a httpd callback
+    switch (cgiWebsocketSend(ws, connection->txBuffer, count, (connection->flags & CONNECTION_TXBINARY) ? WEBSOCK_FLAG_BIN : WEBSOCK_FLAG_NONE)) {
+    case WEBSOCK_WOULDBLOCK:
+        connection->flags |= CONNECTION_TXFULL;
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    case 0:
+        sscp_sendResponse("E,%d", SSCP_ERROR_SEND_FAILED);
+        return;
+    }
 
     sscp_sendResponse("S,%d", count);
 }
@@ -151,13 +190,31 @@ static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
 static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
+    Websock *ws = connection->d.ws.ws;
     
+    if (!ws) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
+        return;
+    }
+
+    if (size > SSCP_TX_BUFFER_MAX) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+        return;
+    }
+
+    // the MCU waits for a C,handle,credit event before trying again
+    if (size > cgiWebsocketSendCredit(ws)) {
+        connection->flags |= CONNECTION_TXFULL;
+        cgiWebsocketWantWritable(ws);
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
+
     if (size == 0)
         sscp_sendResponse("S,0");
     else {
-        // response is sent by tcp_sent_cb
+        // response is sent by send_cb
         sscp_capturePayload(connection->txBuffer, size, send_cb, connection);
-        connection->flags |= CONNECTION_TXFULL;
     }
 }
 
@@ -187,6 +244,12 @@ static void ICACHE_FLASH_ATTR close_handler(sscp_hdr *hdr)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
     Websock *ws = connection->d.ws.ws;
-    if (ws)
+    if (ws) {
+        // the websocket outlives this connection until httpd frees it
+        ws->recvCb = NULL;
+        ws->sentCb = NULL;
+        ws->closeCb = NULL;
+        ws->writableCb = NULL;
         cgiWebsocketClose(ws, 0);
+    }
 }
@@ -74,10 +74,11 @@ void ICACHE_FLASH_ATTR sscp_reset(void)
 {
     int i;
     
-    for (i = 0; i < SSCP_LISTENER_MAX; ++i)
-        sscp_close_listener(&sscp_listeners[i]);
+    // connections go first since a TCP listener can't be deleted while it has clients
     for (i = 0; i < SSCP_CONNECTION_MAX; ++i)
         sscp_close_connection(&sscp_connections[i]);
+    for (i = 0; i < SSCP_LISTENER_MAX; ++i)
+        sscp_close_listener(&sscp_listeners[i]);
         
     sscp_processing = 0;
     sscp_state = STATE_IDLE;
@@ -161,7 +162,11 @@ sscp_log("listener: matching '%s' with '%s'", listener->path, path);
 
 void ICACHE_FLASH_ATTR sscp_close_listener(sscp_listener *listener)
 {
-    listener->hdr.type = TYPE_UNUSED;
+    if (listener->hdr.type != TYPE_UNUSED) {
+        if (listener->hdr.dispatch->close)
+            (*listener->hdr.dispatch->close)((sscp_hdr *)listener);
+        listener->hdr.type = TYPE_UNUSED;
+    }
 }
 
 sscp_connection ICACHE_FLASH_ATTR *sscp_get_connection(int i)
@@ -186,6 +191,7 @@ sscp_connection ICACHE_FLASH_ATTR *sscp_allocate_connection(int type, sscp_dispa
             connection->hdr.dispatch = dispatch;
             connection->flags = CONNECTION_INIT;
             connection->listenerHandle = 0;
+            connection->error = 0;
             connection->rxCount = 0;
             connection->rxIndex = 0;
             connection->txCount = 0;
@@ -323,6 +329,12 @@ static cmd_def cmds[] = {
 {   "REPLY",            http_do_reply       },
 {   "CONNECT",          tcp_do_connect      },
 {   "UDP",              udp_do_connect      },
+{   "SENDTO",           udp_do_sendto       },
+{   "RECVFROM",         udp_do_recvfrom     },
+{   "UDPJOIN",          udp_do_join         },
+{   "HTTPREQ",          httpreq_do_request  },
+{   "FETCH",            fetch_do_fetch      },
+{   "WSCONNECT",        httpreq_do_wsconnect},
 {   "APSCAN",           wifi_do_apscan      },
 {   "APGET",            wifi_do_apget       },
 {   "CREGET",           wifi_do_creget      },
@@ -485,6 +497,11 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
             case SSCP_TKN_REPLY:
             case SSCP_TKN_CONNECT:
             case SSCP_TKN_UDP:
+            case SSCP_TKN_HTTPREQ:
+            case SSCP_TKN_FETCH:
+            case SSCP_TKN_WSCONNECT:
+            case SSCP_TKN_SENDTO:
+            case SSCP_TKN_RECVFROM:
             case SSCP_TKN_APSCAN:
             case SSCP_TKN_APGET:
             case SSCP_TKN_CREGET:
@@ -515,6 +532,11 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
                     case SSCP_TKN_REPLY:    name = "REPLY";   sep = ':'; break;
                     case SSCP_TKN_CONNECT:  name = "CONNECT"; sep = ':'; break;
                     case SSCP_TKN_UDP:      name = "UDP";     sep = ':'; break;
+                    case SSCP_TKN_HTTPREQ:  name = "HTTPREQ"; sep = ':'; break;
+                    case SSCP_TKN_FETCH:    name = "FETCH";   sep = ':'; break;
+                    case SSCP_TKN_WSCONNECT: name = "WSCONNECT"; sep = ':'; break;
+                    case SSCP_TKN_SENDTO:   name = "SENDTO";  sep = ':'; break;
+                    case SSCP_TKN_RECVFROM: name = "RECVFROM"; sep = ':'; break;
                     case SSCP_TKN_APSCAN:   name = "APSCAN";  sep = ':'; break;
                     case SSCP_TKN_APGET:    name = "APGET";   sep = ':'; break;
                     case SSCP_TKN_CREGET:   name = "CREGET";  sep = ':'; break;
@@ -21,6 +21,16 @@
 
 #define SSCP_HANDLE_MAX     (SSCP_LISTENER_MAX + SSCP_CONNECTION_MAX)
 
+// options for CONNECT,host,port,options and LISTEN,TCP,port,backlog,options
+#define SSCP_TCP_NODELAY    0x01
+#define SSCP_TCP_KEEPALIVE  0x02
+
+#define SSCP_HTTPREQ_METHOD_MAX     8
+#define SSCP_HTTPREQ_HOST_MAX       64
+#define SSCP_HTTPREQ_PATH_MAX       128
+#define SSCP_HTTPREQ_LINE_MAX       128
+#define SSCP_HTTPREQ_HEADERS_MAX    256
+
 enum {
     SSCP_TKN_START              = 0xFE,
     
@@ -60,6 +70,11 @@ enum {
     SSCP_TKN_FRUN               = 0xDF,
     SSCP_TKN_UDP                = 0xDE,
     SSCP_TKN_LOCK               = 0xDD,
+    SSCP_TKN_HTTPREQ            = 0xDC,
+    SSCP_TKN_FETCH              = 0xDB,
+    SSCP_TKN_WSCONNECT          = 0xD9,
+    SSCP_TKN_SENDTO             = 0xD8,
+    SSCP_TKN_RECVFROM           = 0xD7,
     SSCP_TKN_CREGET             = 0xDA,   
     SSCP_MIN_TOKEN              = 0x80
 };
@@ -67,6 +82,7 @@ enum {
 typedef struct sscp_hdr sscp_hdr;
 typedef struct sscp_listener sscp_listener;
 typedef struct sscp_connection sscp_connection;
+typedef struct sscp_httpreq sscp_httpreq;
 
 enum {
     SSCP_ERROR_INVALID_REQUEST      = 1,
@@ -94,7 +110,8 @@ enum {
     TYPE_HTTP_CONNECTION,
     TYPE_WEBSOCKET_CONNECTION,
     TYPE_TCP_CONNECTION,
-    TYPE_UDP_CONNECTION
+    TYPE_UDP_CONNECTION,
+    TYPE_HTTPREQ_CONNECTION
 };
 
 typedef struct {
@@ -114,6 +131,9 @@ struct sscp_hdr {
 struct sscp_listener {
     sscp_hdr hdr;
     char path[SSCP_PATH_MAX];
+    struct espconn conn;    // server socket, only used by TCP listeners
+    esp_tcp tcp;
+    int options;
 };
 
 enum {
@@ -126,7 +146,10 @@ enum {
 
     // internal state bits
     CONNECTION_RXFULL       = 0x00010000,   // set when incoming data is available
-    CONNECTION_TXFREE       = 0x00020000    // set when the connection should be freed after TXDONE is delivered
+    CONNECTION_TXFREE       = 0x00020000,   // set when the connection should be freed after TXDONE is delivered
+    CONNECTION_TXREADY      = 0x00040000,   // set when a connection that refused a SEND can take data again ('C', with the send credit)
+    CONNECTION_TXBINARY     = 0x00080000,   // set when the data of the current SEND goes to a websocket as a binary frame
+    CONNECTION_TXCAPTURE    = 0x00100000    // set while the payload of a SEND is being written into txBuffer
 };
 
 enum {
@@ -135,6 +158,42 @@ enum {
     TCP_STATE_CONNECTED
 };
 
+// the state of an HTTPREQ, WSCONNECT or FETCH request, kept off the connection so idle connections don't carry it
+struct sscp_httpreq {
+    char method[SSCP_HTTPREQ_METHOD_MAX];
+    char host[SSCP_HTTPREQ_HOST_MAX];
+    char path[SSCP_HTTPREQ_PATH_MAX];
+    char headers[SSCP_HTTPREQ_HEADERS_MAX];
+    int port;
+    int bodyLength;
+    int bodySent;
+    int redirect;
+    int redirects;
+    int replied;
+    int orphan;
+    int parseState;
+    int status;
+    int contentLength;
+    int chunked;
+    char line[SSCP_HTTPREQ_LINE_MAX + 4]; // room to rebuild a header for the MCU
+    int lineLength;
+    char *pending;
+    int pendingCount;
+    int pendingIndex;
+    void (*complete)(sscp_connection *c, void *data);
+    void *completeData;
+    int websocket;
+    char wsKey[25];
+    int wsAccepted;
+    int wsOpcode;
+    int wsMasked;
+    uint8_t wsMask[4];
+    int wsMaskIndex;
+    int wsTx;
+    char wsControl[6 + 125];
+    int wsControlLength;
+};
+
 struct sscp_connection {
     sscp_hdr hdr;
     int flags;
@@ -151,14 +210,33 @@ struct sscp_connection {
         } ws;
         struct {
             int state;
+            struct espconn *pConn;  // conn or a client accepted by a TCP listener
             struct espconn conn;
             esp_tcp tcp;
+            int options;
+            ETSTimer timer;         // flushes SENDs that are being coalesced in txBuffer
+            char *pending;          // received data that didn't fit in rxBuffer
+            int pendingCount;
+            int pendingIndex;
         } tcp;
         struct {
             int state;
             struct espconn conn;
             esp_udp udp;
+            int unconnected;
+            uint8 destIp[4];        // where SENDTO sends, the SDK overwrites remote_ip on every receive
+            int destPort;
+            ip_addr_t group;
+            ip_addr_t groupIf;
         } udp;
+        struct {
+            int state;
+            struct espconn conn;
+            esp_tcp tcp;
+            ETSTimer timer;
+            int lookup;             // tag of the DNS lookup in progress, zero if none
+            sscp_httpreq *req;      // allocated when the request is made, freed when the connection is closed
+        } httpreq;
     } d;
     char rxBuffer[SSCP_RX_BUFFER_MAX];
     int rxCount;
@@ -227,9 +305,22 @@ void sscp_websocketConnect(Websock *ws);
 
 // from sscp-tcp.c
 void tcp_do_connect(int argc, char *argv[]);
+int tcp_listen(sscp_listener *listener, int port, int backlog, int options);
+int tcp_close_listener(sscp_listener *listener);
 
 // from sscp-udp.c
 void udp_do_connect(int argc, char *argv[]);
+void udp_do_sendto(int argc, char *argv[]);
+void udp_do_recvfrom(int argc, char *argv[]);
+void udp_do_join(int argc, char *argv[]);
+
+// from sscp-httpreq.c
+void httpreq_do_request(int argc, char *argv[]);
+void httpreq_do_wsconnect(int argc, char *argv[]);
+int httpreq_fetch(char *url, void (*complete)(sscp_connection *c, void *data), void *data);
+
+// from sscp-fetch.c
+void fetch_do_fetch(int argc, char *argv[]);
 
 // from sscp-wifi.c
 void wifi_do_apscan(int argc, char *argv[]);
@@ -242,6 +333,8 @@ int wifiJoinAuto(void);
 void fs_do_finfo(int argc, char *argv[]);
 void fs_do_fcount(int argc, char *argv[]);
 void fs_do_frun(int argc, char *argv[]);
+int fs_check_for_events(void);
+int fs_get_load_progress(void *data, char *value);
 
 
 
@@ -28,6 +28,7 @@ some pictures of cats.
 #include "cgiwebsocket.h"
 
 #include "serbridge.h"
+#include "wsbridge.h"
 #include "uart.h"
 #include "config.h"
 #include "status.h"
@@ -39,6 +40,8 @@ some pictures of cats.
 #include "cgiprop.h"
 #include "httpdroffs.h"
 #include "discovery.h"
+#include "dnscache.h"
+#include "loadjobs.h"
 #include "sscp.h"
 #endif
 
@@ -207,6 +210,7 @@ HttpdBuiltInUrl builtInUrls[]={
 	{"/wifi/setmode.cgi", cgiWiFiSetModeFilter, NULL},
 
     {"/log/text", ajaxLog, NULL },
+	{WSBRIDGE_URL, cgiWebsocket, wsbridgeConnect},
 
 #ifdef PROPLOADER
     { "/userfs/format", cgiRoffsFormat, NULL },
@@ -215,6 +219,10 @@ HttpdBuiltInUrl builtInUrls[]={
     { "/propeller/load-file", cgiPropLoadP1File, NULL },
     { "/propeller/load-p2-file", cgiPropLoadP2File, NULL },
     { "/propeller/reset", cgiPropReset, NULL },
+    { "/propeller/jobs", cgiPropJobs, NULL },
+    { "/propeller/job", cgiPropJob, NULL },
+    { "/propeller/cancel", cgiPropCancel, NULL },
+    { LOAD_JOB_PROGRESS_URL, cgiWebsocket, loadJobWebsocketConnect },
     { "/wx/module-info", cgiPropModuleInfo, NULL },
     { "/wx/setting", cgiPropSetting, NULL },
     { "/wx/save-settings", cgiPropSaveSettings, NULL },
@@ -268,6 +276,7 @@ void ICACHE_FLASH_ATTR user_init(void) {
 
 #ifdef PROPLOADER
     initDiscovery();
+    initDnsCache();
     cgiPropInit();
     sscp_init();
 #endif
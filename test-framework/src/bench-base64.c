@@ -0,0 +1,239 @@
+/*
+    bench-base64.c - host test and benchmark for the streaming base64 encoder
+
+    P2 images go to the ROM loader as one base64 string, but the loader encodes them a
+    segment at a time, and a segment rarely ends on a three byte group. The stream keeps
+    the leftover bytes for the next call, so splitting the input at any point has to give
+    the same characters as encoding it in one go, without '=' until the end. That is checked
+    here against base64_encode for random images and split points. The timing compares the
+    per-segment malloc, one-shot encode and '=' filtering the P2 loader used to do with
+    the stream, both writing a 1K segment at a time into a buffer in place of the UART.
+
+    keep base64_encode and the stream functions in step with libesphttpd/core/base64.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define IMAGE_SIZE      (32 * 1024)
+#define SEGMENT_SIZE    1024
+#define ENCODED_SIZE    ((IMAGE_SIZE + 2) / 3 * 4 + 1)
+#define SPLIT_RUNS      2000
+#define ITERATIONS      500
+
+typedef struct {
+    unsigned char pending[2];
+    int pendingCount;
+} Base64Stream;
+
+static const uint8_t base64enc_tab[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int base64_encode(size_t in_len, const unsigned char *in, size_t out_len, char *out)
+{
+    unsigned ii, io;
+    uint32_t v;
+    unsigned rem;
+
+    for (io = 0, ii = 0, v = 0, rem = 0; ii < in_len; ii++) {
+        v = (v << 8) | in[ii];
+        rem += 8;
+        while (rem >= 6) {
+            rem -= 6;
+            if (io >= out_len) return -1;
+            out[io++] = base64enc_tab[(v >> rem) & 63];
+        }
+    }
+    if (rem) {
+        v <<= (6 - rem);
+        if (io >= out_len) return -1;
+        out[io++] = base64enc_tab[v & 63];
+    }
+    while (io & 3) {
+        if (io >= out_len) return -1;
+        out[io++] = '=';
+    }
+    if (io >= out_len) return -1;
+    out[io] = 0;
+    return io;
+}
+
+static void base64_group(const unsigned char *in, char *out)
+{
+    out[0] = base64enc_tab[in[0] >> 2];
+    out[1] = base64enc_tab[((in[0] & 3) << 4) | (in[1] >> 4)];
+    out[2] = base64enc_tab[((in[1] & 15) << 2) | (in[2] >> 6)];
+    out[3] = base64enc_tab[in[2] & 63];
+}
+
+static void base64_stream_init(Base64Stream *s)
+{
+    s->pendingCount = 0;
+}
+
+static int base64_stream_encode(Base64Stream *s, size_t in_len, const unsigned char *in, size_t out_len, char *out)
+{
+    unsigned char group[3];
+    size_t io = 0;
+
+    if ((s->pendingCount + in_len) / 3 * 4 > out_len) return -1;
+
+    if (s->pendingCount > 0) {
+        if (s->pendingCount + in_len < 3) {
+            while (in_len-- > 0) s->pending[s->pendingCount++] = *in++;
+            return 0;
+        }
+        group[0] = s->pending[0];
+        group[1] = s->pendingCount > 1 ? s->pending[1] : *in++;
+        group[2] = *in++;
+        in_len -= 3 - s->pendingCount;
+        base64_group(group, out);
+        io += 4;
+    }
+
+    while (in_len >= 3) {
+        base64_group(in, &out[io]);
+        in += 3;
+        in_len -= 3;
+        io += 4;
+    }
+
+    for (s->pendingCount = 0; s->pendingCount < in_len; s->pendingCount++)
+        s->pending[s->pendingCount] = in[s->pendingCount];
+
+    return io;
+}
+
+static int base64_stream_finish(Base64Stream *s, int pad, size_t out_len, char *out)
+{
+    unsigned char group[3] = { 0, 0, 0 };
+    int count = s->pendingCount;
+    int io;
+
+    if (count == 0) return 0;
+    if (out_len < (pad ? 4 : count + 1)) return -1;
+
+    group[0] = s->pending[0];
+    if (count > 1) group[1] = s->pending[1];
+    base64_group(group, out);
+    for (io = count + 1; pad && io < 4; io++) out[io] = '=';
+    s->pendingCount = 0;
+    return io;
+}
+
+static unsigned char image[IMAGE_SIZE];
+static char expected[ENCODED_SIZE];
+static char actual[ENCODED_SIZE];
+
+static int checkSplits(void)
+{
+    int run, size, len, n, padded;
+
+    for (run = 0; run < SPLIT_RUNS; ++run) {
+        Base64Stream s;
+        int offset = 0;
+
+        size = run < 16 ? run : rand() % (IMAGE_SIZE + 1);
+        padded = base64_encode(size, image, sizeof(expected), expected);
+
+        base64_stream_init(&s);
+        len = 0;
+        while (offset < size) {
+            int piece = rand() % 8 == 0 ? rand() % 4 : 1 + rand() % 1500;
+            if (piece > size - offset)
+                piece = size - offset;
+            n = base64_stream_encode(&s, piece, &image[offset], sizeof(actual) - len, &actual[len]);
+            if (n < 0 || n % 4 != 0 || memchr(&actual[len], '=', n)) {
+                printf("bad piece: size %d, offset %d, length %d\n", size, offset, piece);
+                return 0;
+            }
+            offset += piece;
+            len += n;
+        }
+        if ((n = base64_stream_finish(&s, run & 1, sizeof(actual) - len, &actual[len])) < 0) {
+            printf("finish failed: size %d\n", size);
+            return 0;
+        }
+        len += n;
+
+        // the loader finishes unpadded, so compare against the one-shot output with its '=' dropped
+        if (!(run & 1)) {
+            while (padded > 0 && expected[padded - 1] == '=')
+                --padded;
+        }
+        if (len != padded || memcmp(actual, expected, len) != 0) {
+            printf("mismatch: size %d, %s\n", size, run & 1 ? "padded" : "unpadded");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// per segment: malloc, encode with padding, then send what isn't '='
+static int sendOld(char *uart)
+{
+    int offset, i, n, sent = 0;
+
+    for (offset = 0; offset < IMAGE_SIZE; offset += SEGMENT_SIZE) {
+        int size = (SEGMENT_SIZE + 2) / 3 * 4 + 1;
+        char *buf = malloc(size);
+        if (!buf)
+            return -1;
+        n = base64_encode(SEGMENT_SIZE, &image[offset], size, buf);
+        for (i = 0; i < n; ++i) {
+            if (buf[i] != '=')
+                uart[sent++] = buf[i];
+        }
+        free(buf);
+    }
+    return sent;
+}
+
+// per segment: encode straight into the output, leftovers carried to the next segment
+static int sendStream(char *uart)
+{
+    Base64Stream s;
+    int offset, sent = 0;
+
+    base64_stream_init(&s);
+    for (offset = 0; offset < IMAGE_SIZE; offset += SEGMENT_SIZE)
+        sent += base64_stream_encode(&s, SEGMENT_SIZE, &image[offset], ENCODED_SIZE - sent, &uart[sent]);
+    sent += base64_stream_finish(&s, 0, ENCODED_SIZE - sent, &uart[sent]);
+    return sent;
+}
+
+static double timeSend(int (*send)(char *uart))
+{
+    clock_t start;
+    int i;
+
+    start = clock();
+    for (i = 0; i < ITERATIONS; ++i)
+        send(actual);
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+    double oldTime, newTime;
+    int i;
+
+    srand(1);
+    for (i = 0; i < IMAGE_SIZE; ++i)
+        image[i] = rand();
+
+    if (!checkSplits())
+        return 1;
+    printf("stream matches one-shot encoding for %d random sizes and split points\n", SPLIT_RUNS);
+
+    oldTime = timeSend(sendOld);
+    newTime = timeSend(sendStream);
+    printf("%d x %dK image: malloc and filter %.3fs, stream %.3fs", ITERATIONS, IMAGE_SIZE / 1024, oldTime, newTime);
+    if (newTime > 0)
+        printf(" (%.1fx)", oldTime / newTime);
+    printf("\n");
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+    bench-p1encode.c - host benchmark and golden-output test for the P1 ROM loader encoder
+
+    The ROM loader takes each long as eleven bytes carrying three bits apiece, lsb first,
+    with the last byte flagged. encodeLongsOld is txLong as it was before the lookup table,
+    with its uart_tx_one_char calls turned into stores; encodeLongs is the table version
+    from parallax/proploader.c. The golden bytes below were captured from the old encoder
+    and cover all-zero, all-one, single end bits and mixed patterns; random longs are then
+    compared between the two. Time is reported per 1K load segment, the unit the loader
+    hands to the UART.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define ENCODED_LONG_SIZE   11
+#define BLOCK_LONGS         256     // one 1K load segment
+#define ITERATIONS          20000
+
+static const struct {
+    uint32_t value;
+    uint8_t encoded[ENCODED_LONG_SIZE];
+} golden[] = {
+    { 0x00000000, { 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0xF2 } },
+    { 0xFFFFFFFF, { 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xFB } },
+    { 0x12345678, { 0x92, 0xDB, 0x93, 0x9B, 0xD3, 0x92, 0xD3, 0x93, 0x9A, 0x9A, 0xF2 } },
+    { 0x80000001, { 0x93, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0xFA } },
+    { 0xA5A5A5A5, { 0xD3, 0xD2, 0xDA, 0x9A, 0x9A, 0x9B, 0x93, 0xD3, 0xD3, 0xD2, 0xFA } }
+};
+
+// the encoder before the table, with uart_tx_one_char replaced by a store
+static int encodeLongsOld(const uint8_t *src, int count, uint8_t *dst)
+{
+    uint8_t *start = dst;
+    while (--count >= 0) {
+        uint32_t x = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+        int i;
+        for (i = 0; i < 11; ++i) {
+            *dst++ = 0x92
+                   | (i == 10 ? 0x60 : 0x00)
+                   |  (x & 1)
+                   | ((x & 2) << 2)
+                   | ((x & 4) << 4);
+            x >>= 3;
+        }
+        src += sizeof(uint32_t);
+    }
+    return dst - start;
+}
+
+// keep in step with txEncoding and encodeLongs in parallax/proploader.c
+static const uint8_t txEncoding[64][2] = {
+    {0x92,0x92}, {0x93,0x92}, {0x9A,0x92}, {0x9B,0x92}, {0xD2,0x92}, {0xD3,0x92}, {0xDA,0x92}, {0xDB,0x92},
+    {0x92,0x93}, {0x93,0x93}, {0x9A,0x93}, {0x9B,0x93}, {0xD2,0x93}, {0xD3,0x93}, {0xDA,0x93}, {0xDB,0x93},
+    {0x92,0x9A}, {0x93,0x9A}, {0x9A,0x9A}, {0x9B,0x9A}, {0xD2,0x9A}, {0xD3,0x9A}, {0xDA,0x9A}, {0xDB,0x9A},
+    {0x92,0x9B}, {0x93,0x9B}, {0x9A,0x9B}, {0x9B,0x9B}, {0xD2,0x9B}, {0xD3,0x9B}, {0xDA,0x9B}, {0xDB,0x9B},
+    {0x92,0xD2}, {0x93,0xD2}, {0x9A,0xD2}, {0x9B,0xD2}, {0xD2,0xD2}, {0xD3,0xD2}, {0xDA,0xD2}, {0xDB,0xD2},
+    {0x92,0xD3}, {0x93,0xD3}, {0x9A,0xD3}, {0x9B,0xD3}, {0xD2,0xD3}, {0xD3,0xD3}, {0xDA,0xD3}, {0xDB,0xD3},
+    {0x92,0xDA}, {0x93,0xDA}, {0x9A,0xDA}, {0x9B,0xDA}, {0xD2,0xDA}, {0xD3,0xDA}, {0xDA,0xDA}, {0xDB,0xDA},
+    {0x92,0xDB}, {0x93,0xDB}, {0x9A,0xDB}, {0x9B,0xDB}, {0xD2,0xDB}, {0xD3,0xDB}, {0xDA,0xDB}, {0xDB,0xDB}
+};
+
+static int encodeLongs(const uint8_t *src, int count, uint8_t *dst)
+{
+    uint8_t *start = dst;
+    while (--count >= 0) {
+        uint32_t x = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+        int i;
+        for (i = 0; i < 5; ++i) {
+            const uint8_t *pair = txEncoding[x & 0x3F];
+            *dst++ = pair[0];
+            *dst++ = pair[1];
+            x >>= 6;
+        }
+        *dst++ = txEncoding[x][0] | 0x60;
+        src += sizeof(uint32_t);
+    }
+    return dst - start;
+}
+
+static void setLong(uint8_t *buf, uint32_t value)
+{
+    buf[0] = value;
+    buf[1] = value >> 8;
+    buf[2] = value >> 16;
+    buf[3] = value >> 24;
+}
+
+static int checkGolden(int (*encode)(const uint8_t *src, int count, uint8_t *dst), const char *name)
+{
+    uint8_t buf[4], encoded[ENCODED_LONG_SIZE];
+    int i;
+
+    for (i = 0; i < sizeof(golden) / sizeof(golden[0]); ++i) {
+        setLong(buf, golden[i].value);
+        if ((*encode)(buf, 1, encoded) != ENCODED_LONG_SIZE || memcmp(encoded, golden[i].encoded, ENCODED_LONG_SIZE) != 0) {
+            printf("%s: wrong encoding for 0x%08x\n", name, golden[i].value);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int checkRandom(void)
+{
+    static uint8_t image[BLOCK_LONGS * 4 + 1];
+    static uint8_t encoded1[BLOCK_LONGS * ENCODED_LONG_SIZE], encoded2[BLOCK_LONGS * ENCODED_LONG_SIZE];
+    int i;
+
+    for (i = 0; i < sizeof(image); ++i)
+        image[i] = rand();
+
+    // the loader hands the encoder unaligned data
+    encodeLongsOld(image + 1, BLOCK_LONGS, encoded1);
+    encodeLongs(image + 1, BLOCK_LONGS, encoded2);
+    if (memcmp(encoded1, encoded2, sizeof(encoded1)) != 0) {
+        printf("mismatch on random longs\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static double timeEncode(int (*encode)(const uint8_t *src, int count, uint8_t *dst))
+{
+    static uint8_t image[BLOCK_LONGS * 4];
+    static uint8_t encoded[BLOCK_LONGS * ENCODED_LONG_SIZE];
+    clock_t start;
+    int total = 0, i;
+
+    for (i = 0; i < sizeof(image); ++i)
+        image[i] = i * 7;
+
+    start = clock();
+    for (i = 0; i < ITERATIONS; ++i) {
+        image[i % sizeof(image)] ^= 1;
+        total += (*encode)(image, BLOCK_LONGS, encoded);
+        total += encoded[i % sizeof(encoded)];
+    }
+
+    // use the result so the loop isn't optimized away
+    if (total == 0x55)
+        putchar(' ');
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+    double oldTime, newTime;
+
+    if (!checkGolden(encodeLongsOld, "old encoder") || !checkGolden(encodeLongs, "table encoder") || !checkRandom())
+        return 1;
+    printf("golden output and random longs match\n");
+
+    oldTime = timeEncode(encodeLongsOld);
+    newTime = timeEncode(encodeLongs);
+    printf("%d x %d longs: shift and mask %.3fs, table %.3fs", ITERATIONS, BLOCK_LONGS, oldTime, newTime);
+    if (newTime > 0)
+        printf(" (%.1fx)", oldTime / newTime);
+    putchar('\n');
+
+    return 0;
+}
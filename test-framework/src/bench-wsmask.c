@@ -0,0 +1,125 @@
+/*
+    bench-wsmask.c - host benchmark for WebSocket payload unmasking
+
+    A client masks every payload byte with one of four key bytes, picked by the byte's
+    position in the frame. The payload can start anywhere in a received segment and
+    can be split across segments, so the word loop has to line up with the buffer
+    first and carry the key position from one call to the next. Every start offset,
+    length up to 64 and starting key position is checked against the bytewise loop
+    that cgiWebSocketRecv used to run. The timing uses a full 1460-byte segment at each
+    of the four alignments.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define BUFFER_SIZE     1460    // one TCP segment, what cgiWebSocketRecv usually sees
+#define ITERATIONS      20000
+
+static void unmaskBytewise(char *data, int len, uint8_t *mask, uint8_t *maskCtr)
+{
+    int i;
+    for (i = 0; i < len; ++i)
+        data[i] ^= mask[((*maskCtr)++) & 3];
+}
+
+// keep in step with unmaskPayload in libesphttpd/util/cgiwebsocket.c
+static void unmaskPayload(char *data, int len, uint8_t *mask, uint8_t *maskCtr)
+{
+    uint8_t ctr = *maskCtr;
+    uint8_t m[4];
+    uint32_t w, *p;
+    while (len > 0 && ((uintptr_t)data & 3) != 0) {
+        *data++ ^= mask[(ctr++) & 3];
+        len--;
+    }
+    if (len >= 4) {
+        m[0] = mask[ctr & 3]; m[1] = mask[(ctr + 1) & 3]; m[2] = mask[(ctr + 2) & 3]; m[3] = mask[(ctr + 3) & 3];
+        memcpy(&w, m, 4);
+        p = (uint32_t *)data;
+        ctr += len & ~3;
+        while (len >= 4) {
+            *p++ ^= w;
+            len -= 4;
+        }
+        data = (char *)p;
+    }
+    while (len > 0) {
+        *data++ ^= mask[(ctr++) & 3];
+        len--;
+    }
+    *maskCtr = ctr;
+}
+
+static int checkResults(void)
+{
+    static uint32_t aligned1[(BUFFER_SIZE + 8) / 4], aligned2[(BUFFER_SIZE + 8) / 4];
+    char *buf1 = (char *)aligned1, *buf2 = (char *)aligned2;
+    uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    int offset, len, start, i;
+
+    for (offset = 0; offset < 4; ++offset) {
+        for (len = 0; len <= 64; ++len) {
+            for (start = 0; start < 4; ++start) {
+                uint8_t ctr1 = start, ctr2 = start;
+                for (i = 0; i < len; ++i)
+                    buf1[offset + i] = buf2[offset + i] = rand();
+                unmaskBytewise(buf1 + offset, len, mask, &ctr1);
+                unmaskPayload(buf2 + offset, len, mask, &ctr2);
+                if (memcmp(buf1 + offset, buf2 + offset, len) != 0 || (ctr1 & 3) != (ctr2 & 3)) {
+                    printf("mismatch: offset %d, length %d, mask position %d\n", offset, len, start);
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+static double timeUnmask(void (*unmask)(char *data, int len, uint8_t *mask, uint8_t *maskCtr), int offset)
+{
+    static uint32_t aligned[(BUFFER_SIZE + 8) / 4];
+    char *buf = (char *)aligned + offset;
+    uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    uint8_t ctr = 0;
+    clock_t start;
+    int i;
+
+    for (i = 0; i < BUFFER_SIZE; ++i)
+        buf[i] = i;
+
+    start = clock();
+    for (i = 0; i < ITERATIONS; ++i)
+        (*unmask)(buf, BUFFER_SIZE, mask, &ctr);
+
+    // use the result so the loop isn't optimized away
+    if (buf[ctr % BUFFER_SIZE] == 0x55)
+        putchar(' ');
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+    int offset;
+
+    if (!checkResults())
+        return 1;
+    printf("results match for all alignments, lengths and mask positions\n");
+
+    printf("%d x %d byte payloads\n", ITERATIONS, BUFFER_SIZE);
+    for (offset = 0; offset < 4; ++offset) {
+        double bytewise = timeUnmask(unmaskBytewise, offset);
+        double wordwise = timeUnmask(unmaskPayload, offset);
+        printf("  offset %d: bytewise %.3fs, word at a time %.3fs", offset, bytewise, wordwise);
+        if (wordwise > 0)
+            printf(" (%.1fx)", bytewise / wordwise);
+        putchar('\n');
+    }
+
+    return 0;
+}
@@ -70,6 +70,17 @@ int sscpRequestPayload(wifi *dev, const char *buf, int len)
 
 int sscpCollectPayload(wifi *dev, char *buf, int count)
 {
+    int cnt = dev->inputCount - dev->inputNext;
+
+    /* the payload may have arrived along with the response */
+    if (cnt > 0) {
+        if (cnt > count)
+            cnt = count;
+        memcpy(buf, &dev->inputBuffer[dev->inputNext], cnt);
+        dev->inputNext += cnt;
+        return cnt;
+    }
+
     return ReceiveSerialData(dev->port, buf, count);
 }
 
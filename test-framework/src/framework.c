@@ -25,6 +25,7 @@ void initState(TestState *state, const char *prefix, TestState *parent)
         state->ssid = parent->ssid;
         state->passwd = parent->passwd;
         state->moduleAddr = parent->moduleAddr;
+        state->hostAddr = parent->hostAddr;
         state->dev = parent->dev;
     }
 }
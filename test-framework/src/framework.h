@@ -11,6 +11,7 @@ typedef struct {
     const char *ssid;
     const char *passwd;
     SOCKADDR_IN moduleAddr;
+    const char *hostAddr;
     wifi *dev;
     const char *prefix;
     int testNumber;
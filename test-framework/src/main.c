@@ -21,6 +21,7 @@ usage: %s [options] [<file>]\n\
 \n\
 options:\n\
     -i <ip-addr>    IP address of the Wi-Fi module\n\
+    -l <ip-addr>    IP address of this host for tests that need a local server\n\
     -p <port>       serial port connected to DI/DO on the Wi-Fi module\n\
     -s <ssid>       specify an AP SSID\n\
     -t <number>     select a specific test\n\
@@ -61,6 +62,14 @@ int main(int argc, char *argv[])
                 else
                     usage(argv[0]);
                 break;
+            case 'l':   // set the address of this host
+                if (argv[i][2])
+                    globalState.hostAddr = &argv[i][2];
+                else if (++i < argc)
+                    globalState.hostAddr = argv[i];
+                else
+                    usage(argv[0]);
+                break;
             case 'p':   // select a serial port
                 if (argv[i][2])
                     serialDevice = &argv[i][2];
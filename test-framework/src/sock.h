@@ -46,6 +46,8 @@ int OpenBroadcastSocket(short port, SOCKET *pSocket);
 int ConnectSocket(SOCKADDR_IN *addr, SOCKET *pSocket);
 int ConnectSocketTimeout(SOCKADDR_IN *addr, int timeout, SOCKET *pSocket);
 int BindSocket(short port, SOCKET *pSocket);
+int ListenSocket(short port, SOCKET *pSocket);
+int AcceptSocketTimeout(SOCKET sock, int timeout, SOCKET *pSocket);
 void CloseSocket(SOCKET sock);
 int SocketDataAvailableP(SOCKET sock, int timeout);
 int SendSocketData(SOCKET sock, const void *buf, int len);
@@ -235,6 +235,56 @@ int BindSocket(short port, SOCKET *pSocket)
     return 0;
 }
 
+/* ListenSocket - open a socket that accepts TCP connections on a port */
+int ListenSocket(short port, SOCKET *pSocket)
+{
+    SOCKADDR_IN addr;
+    SOCKET sock;
+    int on = 1;
+    
+#ifdef __MINGW32__
+    if (InitWinSock() != 0)
+        return -1;
+#endif
+
+    /* create the socket */
+    if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        return -1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+
+    /* setup the address */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    /* bind the socket to the port and start listening */
+    if (bind(sock, (SOCKADDR *)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0) {
+        closesocket(sock);
+        return -1;
+    }
+
+    /* return the socket */
+    *pSocket = sock;
+    return 0;
+}
+
+/* AcceptSocketTimeout - accept a connection on a listening socket with a timeout */
+int AcceptSocketTimeout(SOCKET sock, int timeout, SOCKET *pSocket)
+{
+    SOCKET client;
+
+    if (!SocketDataAvailableP(sock, timeout))
+        return -1;
+
+    if ((client = accept(sock, NULL, NULL)) < 0)
+        return -1;
+
+    /* return the socket */
+    *pSocket = client;
+    return 0;
+}
+
 /* CloseSocket - close a socket */
 void CloseSocket(SOCKET sock)
 {
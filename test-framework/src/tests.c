@@ -1,12 +1,20 @@
+#include <stdio.h>
+#include <string.h>
 #include "tests.h"
 
 #define DO_BLINK_TEST
 
+#define HTTPREQ_TEST_PORT       8088
+#define HTTPREQ_TEST_BODY       "Hello from the test framework"
+#define HTTPREQ_TEST_REQUEST    "GET /wx-test HTTP/1.1\r\n"
+#define HTTPREQ_TEST_TIMEOUT    10000
+
 #ifdef DO_BLINK_TEST
 static int test_blink(TestState *state);
 #endif
 
 static int test_001(TestState *state);
+static int test_httpreq(TestState *state);
 
 void run_tests(TestState *parent, int selectedTest)
 {
@@ -69,6 +77,15 @@ void run_tests(TestState *parent, int selectedTest)
             failTest(&state, "");
     }
 
+    if (state.hostAddr) {
+        if (startTest(&state, "HTTPREQ against a local server")) {
+            if (test_httpreq(&state))
+                passTest(&state, "");
+            else
+                failTest(&state, "");
+        }
+    }
+
     testResults(&state);
 }
 
@@ -200,3 +217,104 @@ static int test_001(TestState *state)
     return state2.testPassed;
 }
 
+
+// answer one request on the local server, returns the request line or NULL
+static char *serveRequest(SOCKET server, char *req, int reqMax, const char *response)
+{
+    SOCKET client;
+    int cnt;
+
+    if (AcceptSocketTimeout(server, HTTPREQ_TEST_TIMEOUT, &client) != 0)
+        return NULL;
+
+    cnt = ReceiveSocketDataTimeout(client, req, reqMax - 1, HTTPREQ_TEST_TIMEOUT);
+    if (cnt > 0) {
+        req[cnt] = '\0';
+        SendSocketData(client, response, strlen(response));
+    }
+    CloseSocket(client);
+
+    return cnt > 0 ? req : NULL;
+}
+
+static int test_httpreq(TestState *state)
+{
+    TestState state2;
+    SOCKET server;
+    int handle, status, count, total;
+    char req[1024], response[256], res[64], data[256], *expected;
+
+    initState(&state2, "  Subtest", state);
+
+    if (ListenSocket(HTTPREQ_TEST_PORT, &server) != 0) {
+        infoTest(&state2, "error: can't listen on port %d", HTTPREQ_TEST_PORT);
+        return 0;
+    }
+
+    sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s", (int)strlen(HTTPREQ_TEST_BODY), HTTPREQ_TEST_BODY);
+    expected = "Content-Type: text/plain\r\n\r\n" HTTPREQ_TEST_BODY;
+
+    if (startTest(&state2, "HTTPREQ reaches the local server")) {
+        if (serialRequest(&state2, "HTTPREQ:GET,http://%s:%d/wx-test,0,Content-Type", state->hostAddr, HTTPREQ_TEST_PORT)) {
+            if (!serveRequest(server, req, sizeof(req), response))
+                failTest(&state2, ": no request");
+            else if (strncmp(req, HTTPREQ_TEST_REQUEST, strlen(HTTPREQ_TEST_REQUEST)) != 0)
+                failTest(&state2, ": got '%.*s'", (int)strlen(HTTPREQ_TEST_REQUEST), req);
+            else
+                passTest(&state2, "");
+        }
+    }
+
+    beginGroup(&state2);
+
+    if (startTest(&state2, "HTTPREQ response")) {
+        if (!skipTest(&state2))
+            checkSerialResponse(&state2, "=S,^i,^i", &handle, &status);
+    }
+
+    beginGroup(&state2);
+
+    if (startTest(&state2, "HTTP status")) {
+        if (!skipTest(&state2)) {
+            if (status == 200)
+                passTest(&state2, "");
+            else
+                failTest(&state2, ": got %d", status);
+        }
+    }
+
+    if (startTest(&state2, "RECV the headers and body")) {
+        if (!skipTest(&state2)) {
+            total = 0;
+            while (total < (int)strlen(expected)) {
+                if (!serialRequest(&state2, "RECV:%d,%d", handle, (int)(sizeof(data) - 1 - total)))
+                    break;
+                if (sscpGetResponse(state2.dev, res, sizeof(res)) < 0 || sscanf(res, "=S,%d", &count) != 1 || count <= 0)
+                    break;
+                while (count > 0) {
+                    int cnt = sscpCollectPayload(state2.dev, &data[total], count);
+                    if (cnt <= 0)
+                        break;
+                    total += cnt;
+                    count -= cnt;
+                }
+            }
+            data[total] = '\0';
+            if (strcmp(data, expected) == 0)
+                passTest(&state2, "");
+            else
+                failTest(&state2, ": got '%s'", data);
+        }
+    }
+
+    if (startTest(&state2, "CLOSE")) {
+        if (!skipTest(&state2) && serialRequest(&state2, "CLOSE:%d", handle))
+            checkSerialResponse(&state2, "=S,0");
+    }
+
+    CloseSocket(server);
+
+    testResults(&state2);
+
+    return state2.testPassed;
+}